@@ -13,11 +13,22 @@
 #include <time.h>
 #include <math.h>
 #include <dirent.h>
+#include <errno.h>
 #include "commands.h"
 #include "login.h"
 
 const __u32 const ACCEPT_BLOCK_SIZE[] = {512, 1024, 2048, 4096, 8192};
 
+const char *COMMAND_NAMES[] = {"workwith", "ls", "cd", "pwd", "cp", "mv", "rm",
+                               "mkdir", "touch", "import", "export", "cat",
+                               "create", "stats", "latency", "compact",
+                               "defrag", "resize"};
+
+mfs_stats       statsBefore, statsLast, statsCommand[COMMAND_COUNT];
+mfs_histogram   statsLatency[COMMAND_COUNT];
+__u64           statsStart;
+mfs_arena       commandArena;
+
 int readCommand(char *command){
     int i = 0, wordCount = 0, c, whiteSpace = 0;
 
@@ -156,11 +167,37 @@ int isValidCommand(char *command, int wordCount){
         }
         return EXPORT;
     }else if(!strcmp("mfs_cat", command)){
-        if(wordCount < 3){
+        if(wordCount < 2){
             fprintf(stderr, "mfs_cat: Invalid arguments.\n");
             return -1;
         }
         return CAT;
+    }else if(!strcmp("mfs_stats", command)){
+        if(wordCount > 2){
+            fprintf(stderr, "mfs_stats: Invalid arguments.\n");
+            return -1;
+        }
+        return STATS;
+    }else if(!strcmp("mfs_latency", command)){
+        if(wordCount > 3){
+            fprintf(stderr, "mfs_latency: Invalid arguments.\n");
+            return -1;
+        }
+        return LATENCY;
+    }else if(!strcmp("mfs_compact", command)){
+        return COMPACT;
+    }else if(!strcmp("mfs_defrag", command)){
+        if(wordCount > 4){
+            fprintf(stderr, "mfs_defrag: Invalid arguments.\n");
+            return -1;
+        }
+        return DEFRAG;
+    }else if(!strcmp("mfs_resize", command)){
+        if(wordCount != 2){
+            fprintf(stderr, "mfs_resize: Invalid arguments.\n");
+            return -1;
+        }
+        return RESIZE;
     }else if(!strcmp("mfs_create", command)){
         if(wordCount < 2 || wordCount > 10 || wordCount % 2 == 1){
             fprintf(stderr, "mfs_create: Invalid arguments.\n");
@@ -173,13 +210,37 @@ int isValidCommand(char *command, int wordCount){
     }
 }
 
+/* Which image lock a command runs under, -1 for commands that do not touch
+ * the open image. */
+int mfs_commandLock(int commandType){
+    switch(commandType){
+        case LS:
+        case CD:
+        case EXPORT:
+        case CAT:
+            return MFS_LOCK_READ;
+        case CP:
+        case MV:
+        case RM:
+        case MKDIR:
+        case TOUCH:
+        case IMPORT:
+        case COMPACT:
+        case DEFRAG:
+        case RESIZE:
+            return MFS_LOCK_WRITE;
+        default:
+            return -1;
+    }
+}
+
 int mfs_create(char** command, int argc){
     int                 bsFlag = 0, fnsFlag = 0, mfsFlag = 0, mdfnFlag = 0,
-                        path = 0, err = 0, i;
+                        oFlag = 0, backingFlag = 0, path = 0, err = 0, i;
     __u32               offset, inodes_per_block;
     int                 newMFS;
     char                *buffer, *argCheck;
-    ssize_t             wr;
+    mfs_mount           image;
     mfs_superblock      sblock;
     group_linker        grlink;
     group_descriptor    grDesc;
@@ -199,6 +260,12 @@ int mfs_create(char** command, int argc){
         }else if(!strcmp(command[i], "-mdfn")){
             if(!mdfnFlag) mdfnFlag = i + 1;
             else err = -1;
+        }else if(!strcmp(command[i], "-o")){
+            if(!oFlag) oFlag = i + 1;
+            else err = -1;
+        }else if(!strcmp(command[i], "-backing")){
+            if(!backingFlag) backingFlag = i + 1;
+            else err = -1;
         }else{
             if(!path) path = i;
             else err = -1;
@@ -212,6 +279,14 @@ int mfs_create(char** command, int argc){
     if(mfs_validFilename(command[path])){
         return -1;
     }
+    /* An overlay takes its geometry and features from the base image. */
+    if(backingFlag){
+        if(bsFlag || fnsFlag || mfsFlag || mdfnFlag || oFlag){
+            fprintf(stderr, "mfs_create: -backing takes no other options.\n");
+            return -1;
+        }
+        return mfs_overlayCreate(command[backingFlag], command[path]);
+    }
 
     if(bsFlag){
         sblock.block_size = (__u32) strtol(command[bsFlag], &argCheck, 0);
@@ -222,6 +297,10 @@ int mfs_create(char** command, int argc){
     }else{
         sblock.block_size = DEFAULT_BLOCK_SIZE;
     }
+    if(sblock.block_size < 512 || (sblock.block_size & (sblock.block_size - 1))){
+        fprintf(stderr, "mfs_create: Block size must be a power of two.\n");
+        return -1;
+    }
     if(fnsFlag){
         sblock.max_filename_size = (__u32) strtol(command[fnsFlag], &argCheck, 0);
         if(*argCheck != '\0'){
@@ -241,7 +320,7 @@ int mfs_create(char** command, int argc){
         sblock.max_directory_files = DEFAULT_MAX_FILES;
     }
     if(mfsFlag){
-        sblock.max_file_size = (__u32) strtol(command[mfsFlag], &argCheck, 0);
+        sblock.max_file_size = strtoull(command[mfsFlag], &argCheck, 0);
         if(*argCheck != '\0'){
             fprintf(stderr, "\n Invalid argument.\n");
             return -1;
@@ -252,18 +331,39 @@ int mfs_create(char** command, int argc){
 
     sblock.inodes_count = 1;
     sblock.blocks_count = 6;
+    sblock.feature_compat = 0;
+    sblock.feature_incompat = 0;
+    sblock.frag_block = 0;
+    sblock.generation = 0;
+    sblock.dedup_block = 0;
+    sblock.dedup_blocks = 0;
+    if(oFlag && mfs_parseFeatures(command[oFlag], &sblock.feature_incompat)){
+        return -1;
+    }
     sblock.blocks_per_group = sblock.block_size * 8;
     sblock.inodes_per_group = sblock.block_size * 8;
 
     inodes_per_block = sblock.block_size / sizeof(inode);
     sblock.inode_blocks = (int) ceil((double) sblock.inodes_per_group /
                           inodes_per_block);
+    /* The fingerprint table follows the root directory in the first group. */
+    if(sblock.feature_incompat & MFS_FEATURE_DEDUP){
+        sblock.dedup_block = 5 + sblock.inode_blocks;
+        sblock.dedup_blocks = MFS_DEDUP_TABLE_SIZE / sblock.block_size;
+    }
 
     newMFS = open(command[path], O_WRONLY | O_CREAT | O_EXCL, 0666);
     if(newMFS == -1){
         perror("open");
         return -1;
     }
+    image.fd = newMFS;
+    image.sblock = sblock;
+    image.freemap = NULL;
+    image.dedup = NULL;
+    image.overlay = NULL;
+    image.limit = 0;
+    mfs_mountGeometry(&image);
 
     buffer = malloc(sblock.block_size);
     if(buffer == NULL){
@@ -275,8 +375,7 @@ int mfs_create(char** command, int argc){
 
     memset(buffer, 0, sblock.block_size);
     memcpy(buffer, &sblock, sizeof(mfs_superblock));
-    wr = write(newMFS, buffer, sblock.block_size);
-    if(wr < sblock.block_size){
+    if(mfs_write(&image, buffer, 0) == -1){
         mfs_create_error(command[path], buffer, newMFS);
         return -1;
     }
@@ -290,25 +389,26 @@ int mfs_create(char** command, int argc){
     grDesc.block_bitmap = 2;
     grDesc.inode_bitmap = 3;
     grDesc.inode_table = 4;
-    grDesc.free_blocks = sblock.block_size * 8 - 1;
+    grDesc.free_blocks = sblock.block_size * 8 - 1 - sblock.dedup_blocks;
     grDesc.free_inodes = sblock.block_size * 8 - 1;
 
     memcpy(buffer, &grlink, sizeof(group_linker));
     memcpy(buffer + sizeof(group_linker), &grDesc, sizeof(group_descriptor));
-    wr = write(newMFS, buffer, sblock.block_size);
-    if(wr < sblock.block_size){
+    if(mfs_write(&image, buffer, 1) == -1){
         mfs_create_error(command[path], buffer, newMFS);
         return -1;
     }
     memset(buffer, 0, sblock.block_size);
 
     mfs_setBit(buffer, 0);
-    for(i = 0; i < 2; i++){
-        wr = write(newMFS, buffer, sblock.block_size);
-        if(wr < sblock.block_size){
-            mfs_create_error(command[path], buffer, newMFS);
-            return -1;
-        }
+    if(mfs_write(&image, buffer, 3) == -1){
+        mfs_create_error(command[path], buffer, newMFS);
+        return -1;
+    }
+    for(offset = 1; offset <= sblock.dedup_blocks; offset++) mfs_setBit(buffer, offset);
+    if(mfs_write(&image, buffer, 2) == -1){
+        mfs_create_error(command[path], buffer, newMFS);
+        return -1;
     }
     memset(buffer, 0, sblock.block_size);
 
@@ -318,25 +418,17 @@ int mfs_create(char** command, int argc){
     root.creation_time = time(NULL);
     root.access_time = time(NULL);
     root.modification_time = time(NULL);
-    memset(root.datablocks, 0, DATABLOCK_NUM);
+    memset(root.datablocks, 0, sizeof(root.datablocks));
     root.datablocks[0] = 4 + sblock.inode_blocks;
 
     memcpy(buffer, &root, sizeof(inode));
-    wr = write(newMFS, buffer, sblock.block_size);
-    if(wr < sblock.block_size){
+    if(mfs_write(&image, buffer, 4) == -1 ||
+       mfs_zeroBlocks(&image, 5, sblock.inode_blocks - 1) == -1){
         mfs_create_error(command[path], buffer, newMFS);
         return -1;
     }
     memset(buffer, 0, sblock.block_size);
 
-    for(i = 0; i < sblock.inode_blocks - 1; i++){
-        wr = write(newMFS, buffer, sblock.block_size);
-        if(wr < sblock.block_size){
-            mfs_create_error(command[path], buffer, newMFS);
-            return -1;
-        }
-    }
-
     offset = 2 * sizeof(directory_entry) + 7;
     memcpy(buffer, &offset, 4);
     entry.inodeptr = 1;
@@ -351,20 +443,11 @@ int mfs_create(char** command, int argc){
     buffer[5 + 2 * sizeof(directory_entry)] = '.';
     buffer[6 + 2 * sizeof(directory_entry)] = '.';
 
-    wr = write(newMFS, buffer, sblock.block_size);
-    if(wr < sblock.block_size){
+    if(mfs_write(&image, buffer, 4 + sblock.inode_blocks) == -1 ||
+       mfs_zeroBlocks(&image, 5 + sblock.inode_blocks, sblock.block_size * 8 - 1) == -1){
         mfs_create_error(command[path], buffer, newMFS);
         return -1;
     }
-    memset(buffer, 0, sblock.block_size);
-
-    for(i = 0; i < sblock.block_size * 8 - 1; i++){
-        wr = write(newMFS, buffer, sblock.block_size);
-        if(wr < sblock.block_size){
-            mfs_create_error(command[path], buffer, newMFS);
-            return -1;
-        }
-    }
 
     close(newMFS);
     free(buffer);
@@ -390,6 +473,31 @@ int mfs_validFilename(char *filename){
     return 0;
 }
 
+int mfs_parseFeatures(char *list, __u32 *features){
+    char    *token;
+
+    token = strtok(list, ",");
+    while(token != NULL){
+        if(!strcmp(token, "extents")){
+            *features |= MFS_FEATURE_EXTENTS;
+        }else if(!strcmp(token, "inline")){
+            *features |= MFS_FEATURE_INLINE;
+        }else if(!strcmp(token, "tails")){
+            *features |= MFS_FEATURE_TAILS;
+        }else if(!strcmp(token, "dedup")){
+            *features |= MFS_FEATURE_DEDUP;
+        }else if(!strcmp(token, "compress")){
+            *features |= MFS_FEATURE_COMPRESS;
+        }else{
+            fprintf(stderr, "mfs_create: Unknown feature %s.\n", token);
+            return -1;
+        }
+        token = strtok(NULL, ",");
+    }
+
+    return 0;
+}
+
 void mfs_checkValues(__u32 *bsize, __u32 *fname, __u64 *fsize, __u32 *dir){
     int flag = -1, i;
     for(i = 0; i < 5; i++){
@@ -408,47 +516,24 @@ void mfs_create_error(char *path, char *buffer, int fd){
     free(buffer);
 }
 
-int mfs_workwith(char** command, mfs_superblock *sblock, int *fd, char *fs,
-                 inode *root){
-    int     mfs;
-    ssize_t rd;
-    off_t   seek;
-    char    *buffer;
+int mfs_workwith(char** command, mfs_mount **mnt, char *fs, inode *root){
+    mfs_mount   *newMnt;
 
     if(get_filename(fs, command[1])){
         return -1;
     }
-    mfs = open(command[1], O_RDWR, 0);
-    if(mfs == -1){
+    newMnt = mfs_open(command[1], O_RDWR);
+    if(newMnt == NULL){
         perror("mfs_workwith open");
         return -1;
     }
-    rd = read(mfs, sblock, sizeof(mfs_superblock));
-    if(rd == -1){
+    if(mfs_stat(newMnt, MFS_ROOT_INO, root) == -1){
         perror("mfs_workwith read");
+        mfs_close(newMnt);
         return -1;
     }
-    seek = lseek(mfs, 4 * sblock->block_size, SEEK_SET);
-    if(seek == -1){
-        perror("mfs_workwith seek");
-        return -1;
-    }
-
-    buffer = malloc(sblock->block_size);
-    if(buffer == NULL){
-        perror("mfs_workwith malloc");
-        return -1;
-    }
-
-    rd = read(mfs, buffer, sblock->block_size);
-    if(rd < sblock->block_size){
-        perror("mfs_workwith read");
-        free(buffer);
-        return -1;
-    }
-    memcpy(root, buffer, sizeof(inode));
-    *fd = mfs;
-    free(buffer);
+    if(*mnt != NULL) mfs_close(*mnt);
+    *mnt = newMnt;
     return 0;
 }
 
@@ -484,1109 +569,672 @@ int get_filename(char *dest, char *source){
     return 0;
 }
 
-int mfs_import(char **command, int fd, mfs_superblock *sblock, inode *curDir, int argc){
-    int     i, foundFolder = -1, empty, j, dblock;
-    int     toCopy;
-    off64_t file_size;
-    __u32   reqBlocks, *indirectBlock, *dIndirectBlock, *tIndirectBlock,
-            blockNo = 1, grDescNo = 0;
-    char    *buffer, *impBuffer;
-    inode   targetFolder, newInode;
-
-    foundFolder = mfs_followPath(fd, *sblock, command[argc - 1], &targetFolder, 0);
-    if(foundFolder == -1 || targetFolder.mode != 0){
+int mfs_import(char **command, mfs_mount *mnt, inode *curDir, int argc){
+    int             i, toCopy;
+    char            *buffer, *filename;
+    off64_t         file_size;
+    inode           targetFolder, newInode;
+
+    memcpy(&targetFolder, curDir, sizeof(inode));
+    if(mfs_followPath(mnt, command[argc - 1], &targetFolder, 0) == -1 ||
+       targetFolder.mode != 0){
         fprintf(stderr, "Target not found or is not a directory.\n");
         return -1;
     }
 
-    buffer = malloc(sblock->block_size);
+    buffer = mfs_blockGet(mnt->sblock.block_size * MFS_CLUSTER_BLOCKS);
     if(buffer == NULL){
         perror("mfs_import malloc");
         return -1;
     }
 
-    impBuffer = malloc(sblock->block_size);
-    if(impBuffer == NULL){
-        perror("mfs_import malloc");
-        free(buffer);
-        return -1;
-    }
-
-    memcpy(&targetFolder, curDir, sizeof(inode));
-
     for(i = 1; i < argc - 1; i++){
+        filename = strrchr(command[i], '/');
+        filename = filename == NULL ? command[i] : filename + 1;
         toCopy = open(command[i], O_RDONLY, 0);
         if(toCopy == -1){
             fprintf(stderr, "%s failed to open.\n", command[i]);
-        }else if(mfs_findEntry(fd, *sblock, targetFolder, command[i], 1) != -1){
-            fprintf(stderr, "%s already exists at destination.\n", command[i]);
+            continue;
+        }
+        file_size = lseek64(toCopy, 0, SEEK_END);
+        if(mfs_findEntry(mnt, &targetFolder, filename, 1) != -1){
+            fprintf(stderr, "%s already exists at destination.\n", filename);
+        }else if(file_size == -1 && errno == ESPIPE){
+            mfs_importStream(mnt, &targetFolder, toCopy, filename);
+        }else if(file_size == -1 || lseek64(toCopy, 0, SEEK_SET) == -1){
+            fprintf(stderr, "%s:", command[i]);
+            perror("mfs_import seek");
+        }else if(file_size > mnt->sblock.max_file_size){
+            fprintf(stderr, "%s is too large for this filesystem.\n", command[i]);
         }else{
-            file_size = lseek64(toCopy, 0, SEEK_END);
-            if(file_size == -1){
-                fprintf(stderr, "%s:", command[i]);
-                perror("mfs_import seek");
-            }else if(file_size > sblock->max_file_size){
-                fprintf(stderr, "%s is too large for this filesystem.\n", command[1]);
-            }else{
-                reqBlocks = (__u32) ceil((double) file_size / sblock->block_size);
-
-                newInode.mode = 1;
-                newInode.file_size = file_size;
-                newInode.creation_time = time(NULL);
-                newInode.access_time = time(NULL);
-                newInode.modification_time = time(NULL);
-                memset(newInode.datablocks, 0, DATABLOCK_NUM);
-
-                if(lseek64(toCopy, 0, SEEK_SET) == -1){
-                    perror("mfs_import seek");
-                    continue;
-                }
+            memset(&newInode, 0, sizeof(inode));
+            mfs_fileInit(mnt, &newInode);
+            newInode.file_size = file_size;
+            newInode.creation_time = time(NULL);
+            newInode.access_time = newInode.creation_time;
+            newInode.modification_time = newInode.creation_time;
+            if(file_size > MFS_INLINE_SIZE){
+                newInode.mode &= ~MFS_MODE_INLINE;
+            }else if((newInode.mode & MFS_MODE_INLINE) &&
+                     read(toCopy, newInode.datablocks, file_size) < file_size){
+                perror("mfs_import read");
+                close(toCopy);
+                continue;
+            }
+            mfs_compressPrepare(mnt, &newInode);
+            mfs_tailPrepare(mnt, &newInode);
+            if(mfs_allocInode(mnt, &newInode, targetFolder.node_id) == -1){
+                fprintf(stderr, "%s: no space left.\n", command[i]);
+                close(toCopy);
+                continue;
+            }
 
-                mfs_copyFromFile(fd, toCopy, sblock, &blockNo, &grDescNo, 12,
-                                 reqBlocks, newInode.datablocks, 0, file_size);
-                if(reqBlocks > 12){
-                    indirectBlock = malloc(sblock->block_size);
-                    memset(indirectBlock, 0, sblock->block_size / 4);
-                    mfs_copyFromFile(fd, toCopy, sblock, &blockNo, &grDescNo,
-                                     sblock->block_size / 4, reqBlocks,
-                                     indirectBlock, 12, file_size);
-                    empty = mfs_findFree(fd, &blockNo, &grDescNo, sblock, 1);
-                    while(empty == -2){
-                        empty = mfs_findFree(fd, &blockNo, &grDescNo, sblock, 1);
-                    }
-                    memcpy(impBuffer, indirectBlock, sblock->block_size);
-                    mfs_writeData(fd, impBuffer, *sblock, blockNo, grDescNo,
-                                  newInode.datablocks, empty, 12);
-                }
-                if(reqBlocks > 12 + sblock->block_size / 4){
-                    memset(indirectBlock, 0, sblock->block_size / 4);
-                    dIndirectBlock = malloc(sblock->block_size);
-                    memset(dIndirectBlock, 0, sblock->block_size / 4);
-                    memset(impBuffer, 0, sblock->block_size);
-                    j = 0;
-                    dblock = 0;
-                    while(j + 12 + sblock->block_size / 4 < reqBlocks &&
-                        j < sblock->block_size * sblock->block_size / 16){
-                        mfs_copyFromFile(fd, toCopy, sblock, &blockNo, &grDescNo,
-                                         sblock->block_size / 4, reqBlocks,
-                                         dIndirectBlock, 12 + sblock->block_size
-                                         / 4 + j, file_size);
-                        empty = mfs_findFree(fd, &blockNo, &grDescNo, sblock, 1);
-                        while(empty == -2){
-                            empty = mfs_findFree(fd, &blockNo, &grDescNo, sblock, 1);
-                        }
-                        memcpy(impBuffer, dIndirectBlock, sblock->block_size);
-                        mfs_writeData(fd, impBuffer, *sblock, blockNo, grDescNo,
-                                      indirectBlock, empty, dblock);
-                        j += sblock->block_size / 4;
-                        if(j % (sblock->block_size / 4) == 0){
-                            dblock++;
-                            memset(dIndirectBlock, 0, sblock->block_size / 4);
-                        }
-                    }
-                    empty = mfs_findFree(fd, &blockNo, &grDescNo, sblock, 1);
-                    while(empty == -2){
-                        empty = mfs_findFree(fd, &blockNo, &grDescNo, sblock, 1);
-                    }
-                    memcpy(impBuffer, indirectBlock, sblock->block_size);
-                    mfs_writeData(fd, impBuffer, *sblock, blockNo, grDescNo,
-                                  newInode.datablocks, empty, 13);
-                }
-                if(reqBlocks > 12 + sblock->block_size / 4 +
-                   (sblock->block_size * sblock->block_size / 16)){
-                    memset(indirectBlock, 0, sblock->block_size / 4);
-                    tIndirectBlock = malloc(sblock->block_size);
-                    memset(dIndirectBlock, 0, sblock->block_size / 4);
-                    memset(tIndirectBlock, 0, sblock->block_size / 4);
-                    j = 0;
-                    while(j + 12 + sblock->block_size / 4 + sblock->block_size *
-                          sblock->block_size / 16 < reqBlocks){
-
-                    }
-                }
-                blockNo = 1;
-                grDescNo = 0;
-                empty = mfs_findFree(fd, &blockNo, &grDescNo, sblock, 0);
-                while(empty == -2){
-                    empty = mfs_findFree(fd, &blockNo, &grDescNo, sblock, 0);
+            if(!(newInode.mode & MFS_MODE_INLINE)){
+                if(mfs_copyFromFile(mnt, toCopy, &newInode, buffer) == -1){
+                    fprintf(stderr, "%s: import incomplete.\n", command[i]);
                 }
-                newInode.node_id = empty + 1;
-                mfs_writeInode(fd, &newInode, *sblock, blockNo, grDescNo, empty, 0);
-                mfs_insertEntry(fd, sblock, targetFolder, newInode, command[i]);
+                mfs_updateInode(mnt, &newInode);
+            }
+            if(mfs_insertEntry(mnt, &targetFolder, &newInode, filename) == -1){
+                fprintf(stderr, "%s: no room in the target directory.\n", command[i]);
+                mfs_freeInode(mnt, &newInode);
             }
         }
         close(toCopy);
     }
 
-    free(buffer);
-    free(impBuffer);
+    mfs_blockPut(buffer, mnt->sblock.block_size * MFS_CLUSTER_BLOCKS);
     return 0;
 }
 
-int mfs_copyFromFile(int fd, int toCopy, mfs_superblock *sblock, __u32 *blockNo,
-                     __u32 *grDescNo, __u32 limit, __u32 reqBlocks, __u32 *array,
-                     __u32 prevLimit, __u64 file_size){
-    int     empty;
-    char    *buffer;
-    __u32   i;
-
-    buffer = malloc(sblock->block_size);
-    if(buffer == NULL){
-        perror("mfs_copyFromFile malloc");
-        return -1;
-    }
+/* Reads until count bytes or the end of the input. */
+static ssize_t mfs_readFull(int fd, char *buffer, size_t count){
+    size_t  done = 0;
+    ssize_t rd;
 
-    i = 0;
-    while(i < limit && i < reqBlocks){
-        empty = mfs_findFree(fd, blockNo, grDescNo, sblock, 1);
-        while(empty == -2){
-            empty = mfs_findFree(fd, blockNo, grDescNo, sblock, 1);
-        }
-        memset(buffer, 0, sblock->block_size);
-        if(reqBlocks < limit + 1 && i + prevLimit == reqBlocks - 1){
-            read(toCopy, buffer, file_size - i * sblock->block_size);
-            mfs_writeData(fd, buffer, *sblock, *blockNo, *grDescNo,
-                          array, empty, i);
-        }else{
-            read(toCopy, buffer, sblock->block_size);
-            mfs_writeData(fd, buffer, *sblock, *blockNo, *grDescNo,
-                          array, empty, i);
+    while(done < count){
+        rd = read(fd, buffer + done, count - done);
+        if(rd == 0) break;
+        if(rd == -1){
+            if(errno == EINTR) continue;
+            return -1;
         }
-        i++;
+        done += rd;
     }
 
-    free(buffer);
-    return 0;
+    return done;
 }
 
-int mfs_insertEntry(int fd, mfs_superblock *sblock, inode folder, inode toInsert,
-                    char *path){
-    int                 i, wr = -1, empty;
-    __u32               blockNo, offset, curOffset, block = 1, grDesc = 0;
-    char                *buffer, *filename;
-    size_t              name_len;
-    directory_entry     entry, checkEntry;
+/* Stores the data of one block, or of one cluster of a compressed file, of
+ * which length bytes are left. */
+static int mfs_storeUnit(mfs_blockmap *map, __u64 logical, char *data, size_t length,
+                         __u32 *physical){
+    __u32   size;
 
-    buffer = malloc(sblock->block_size);
-    if(buffer == NULL){
-        perror("mfs_insertEntry malloc");
-        return -1;
+    if(!(map->file->mode & MFS_MODE_COMPRESS)){
+        return mfs_dedupStore(map, logical, physical, data) == -1 ? -1 : 0;
     }
-
-    filename = mfs_extractFilename(path);
-    name_len = strlen(filename);
-    if(name_len > sblock->max_filename_size) name_len = sblock->max_filename_size;
-    entry.inodeptr = toInsert.node_id;
-    entry.rec_len = sizeof(directory_entry) + name_len;
-    entry.name_len = name_len;
-    entry.file_type = toInsert.mode;
-    for(i = 0; i < DATABLOCK_NUM; i++){
-        blockNo = folder.datablocks[i];
-        if(blockNo == 0){
-            memset(buffer, 0, sblock->block_size);
-            offset = 4;
-            memcpy(buffer, &offset, 4);
-            empty = (__u32) mfs_findFree(fd, &block, &grDesc, sblock, 1);
-            while(empty == -2){
-                empty = (__u32) mfs_findFree(fd, &block, &grDesc, sblock, 1);
-            }
-            mfs_writeData(fd, buffer, *sblock, block, grDesc, folder.datablocks,
-                          empty, (__u32) i);
-            i--;
-        }else{
-            if(lseek64(fd, blockNo * sblock->block_size, SEEK_SET) == -1){
-                perror("mfs_insertEntry seek");
-                free(buffer);
-                return -1;
-            }
-            if(read(fd, buffer, sblock->block_size) < sblock->block_size){
-                perror("mfs_insertEntry read");
-                free(buffer);
-                return -1;
-            }
-            memcpy(&offset, buffer, 4);
-            if(offset + sizeof(directory_entry) + name_len < sblock->block_size){
-                memcpy(buffer + offset, &entry, sizeof(directory_entry));
-                memcpy(buffer + offset + sizeof(directory_entry), filename, name_len);
-                offset += sizeof(directory_entry) + name_len;
-                memcpy(buffer, &offset, 4);
-                wr = 0;
-            }else{
-                curOffset = 4;
-                while(wr && curOffset < offset){
-                    memcpy(&checkEntry, buffer + curOffset, sizeof(directory_entry));
-                    if(checkEntry.inodeptr == 0 && checkEntry.rec_len >=
-                       name_len + sizeof(directory_entry)){
-                        entry.rec_len = checkEntry.rec_len;
-                        memcpy(buffer + curOffset, &entry, sizeof(directory_entry));
-                        memcpy(buffer + curOffset + sizeof(directory_entry),
-                               filename, name_len);
-                        wr = 0;
-                    }
-                    curOffset += checkEntry.rec_len;
-                }
-            }
-            if(!wr){
-                if(lseek64(fd, blockNo * sblock->block_size, SEEK_SET) == -1){
-                    perror("mfs_insertEntry seek");
-                    free(buffer);
-                    return -1;
-                }
-                if(write(fd, buffer, sblock->block_size) < sblock->block_size){
-                    perror("mfs_insertEntry write");
-                    free(buffer);
-                    return -1;
-                }
-                free(buffer);
-                return 0;
-            }
-        }
-    }
-
-    return -1;
+    size = MFS_CLUSTER_BLOCKS << map->mnt->blockShift;
+    if(length < size) size = length;
+    return mfs_clusterStore(map, logical / MFS_CLUSTER_BLOCKS, data, size, physical);
 }
 
-char* mfs_extractFilename(char *path){
-    char *token, *returnToken;
-
-    if(path[strlen(path) - 1] == '/') return NULL;
-
-    token = strtok(path, "/");
-    while(token != NULL){
-        returnToken = token;
-        token = strtok(NULL, "/");
-    }
-
-    return returnToken;
+int mfs_copyFromFile(mfs_mount *mnt, int toCopy, inode *file, char *buffer){
+    int             error = 0;
+    __u32           physical, tail = 0, meta, step;
+    __u64           logical, blocks, length;
+    mfs_blockmap    map;
+
+    if(mfs_mapInit(&map, mnt, file) == -1) return -1;
+
+    blocks = (file->file_size + mnt->blockMask) >> mnt->blockShift;
+    if(file->mode & MFS_MODE_TAIL){
+        tail = file->file_size & mnt->blockMask;
+        blocks--;
+    }
+    /* Take the data and indirect blocks from one free run when a group has
+     * one, otherwise they are allocated one at a time. */
+    meta = mfs_metaBlocks(mnt, file, blocks);
+    if(blocks && mfs_findRun(mnt, blocks + meta, mfs_inodeGoal(mnt, file->node_id),
+                             &map.blockNo, &map.grDescNo, &map.goal) == 0){
+        map.goalLeft = blocks + meta;
+    }
+    step = file->mode & MFS_MODE_COMPRESS ? MFS_CLUSTER_BLOCKS : 1;
+    for(logical = 0; logical < blocks; logical += step){
+        length = file->file_size - (logical << mnt->blockShift);
+        if(length > (__u64) step << mnt->blockShift) length = step << mnt->blockShift;
+        memset(buffer, 0, (size_t) step << mnt->blockShift);
+        if(mfs_readFull(toCopy, buffer, length) < (ssize_t) length){
+            perror("mfs_copyFromFile read");
+            error = -1;
+            break;
+        }
+        if(mfs_storeUnit(&map, logical, buffer, length, &physical) == -1){
+            error = -1;
+            break;
+        }
+    }
+    mfs_mapDestroy(&map);
+
+    if(!error && tail){
+        if(read(toCopy, buffer, tail) < tail){
+            perror("mfs_copyFromFile read");
+            error = -1;
+        }else if(mfs_tailPack(mnt, file, buffer, tail) == -1){
+            error = -1;
+        }
+    }
+    if(error){
+        file->mode &= ~MFS_MODE_TAIL;
+        file->datablocks[MFS_TAIL_BLOCK] = 0;
+        file->datablocks[MFS_TAIL_WHERE] = 0;
+        file->file_size = logical * mnt->sblock.block_size;
+    }
+    return error;
 }
 
-int mfs_writeInode(int fd, inode *toInsert, mfs_superblock sblock, __u32 blockNo,
-                   __u32 grDescNo, __u32 pos, int mode){
-    char                *buffer = NULL, *buffer2 = NULL;
-    __u32               toWrite;
-    group_descriptor    grDesc;
-
-    buffer = malloc(sblock.block_size);
-    if(buffer == NULL){
-        mfs_write_error(buffer, buffer2, 0);
-        return -1;
-    }
-    memset(buffer, 0, sblock.block_size);
-    buffer2 = malloc(sblock.block_size);
-    if(buffer2 == NULL){
-        mfs_write_error(buffer, buffer2, 0);
-        return -1;
-    }
-    memset(buffer2, 0, sblock.block_size);
-
-    if(lseek64(fd, blockNo * sblock.block_size, SEEK_SET) == -1){
-        mfs_write_error(buffer, buffer2, 1);
-        return -1;
-    }
-    if(read(fd, buffer, sblock.block_size) < sblock.block_size){
-        mfs_write_error(buffer, buffer2, 2);
-        return -1;
-    }
-    memcpy(&grDesc, buffer + sizeof(group_linker) + grDescNo * sizeof(group_descriptor),
-           sizeof(group_descriptor));
-    if(!mode) grDesc.free_inodes--;
-
-    toWrite = grDesc.inode_table + pos / (sblock.block_size / sizeof(inode));
-
-    if(lseek64(fd, toWrite * sblock.block_size, SEEK_SET) == -1){
-        mfs_write_error(buffer, buffer2, 1);
+int mfs_importStream(mfs_mount *mnt, inode *folder, int toCopy, char *filename){
+    int             error = 0;
+    char            *chunk;
+    size_t          size, offset, tail = 0;
+    ssize_t         fill;
+    __u32           physical = 0, goal = 0, blocks, meta, step, i;
+    __u64           logical = 0;
+    inode           newInode;
+    mfs_blockmap    map;
+
+    size = (size_t) mnt->sblock.block_size * MFS_STREAM_BLOCKS;
+    chunk = mfs_blockGet(size);
+    if(chunk == NULL){
+        perror("mfs_importStream malloc");
         return -1;
     }
-    if(read(fd, buffer2, sblock.block_size) < sblock.block_size){
-        mfs_write_error(buffer, buffer2, 2);
+    fill = mfs_readFull(toCopy, chunk, size);
+    if(fill == -1){
+        perror("mfs_importStream read");
+        mfs_blockPut(chunk, size);
         return -1;
     }
 
-    memcpy(buffer2 + (pos % (sblock.block_size / sizeof(inode)) * sizeof(inode)),
-           toInsert, sizeof(inode));
-    if(lseek64(fd, toWrite * sblock.block_size, SEEK_SET) == -1){
-        mfs_write_error(buffer, buffer2, 1);
-        return -1;
+    /* A stream that ends within the first chunk is a file of known size, so it
+     * may still be stored inline or get a packed tail. */
+    memset(&newInode, 0, sizeof(inode));
+    mfs_fileInit(mnt, &newInode);
+    newInode.creation_time = time(NULL);
+    newInode.access_time = newInode.creation_time;
+    newInode.modification_time = newInode.creation_time;
+    if(fill < size){
+        newInode.file_size = fill;
+        if(fill > MFS_INLINE_SIZE) newInode.mode &= ~MFS_MODE_INLINE;
+        else if(newInode.mode & MFS_MODE_INLINE) memcpy(newInode.datablocks, chunk, fill);
+        mfs_compressPrepare(mnt, &newInode);
+        if(mfs_tailPrepare(mnt, &newInode)) tail = fill & mnt->blockMask;
+    }else{
+        newInode.mode &= ~MFS_MODE_INLINE;
+        mfs_compressPrepare(mnt, &newInode);
     }
-    if(write(fd, buffer2, sblock.block_size) < sblock.block_size){
-        mfs_write_error(buffer, buffer2, 3);
+    if(mfs_allocInode(mnt, &newInode, folder->node_id) == -1){
+        fprintf(stderr, "%s: no space left.\n", filename);
+        mfs_blockPut(chunk, size);
         return -1;
     }
+    goal = mfs_inodeGoal(mnt, newInode.node_id);
 
-    if(!mode){
-        if(lseek64(fd, grDesc.inode_bitmap * sblock.block_size, SEEK_SET) == -1){
-            mfs_write_error(buffer, buffer2, 1);
-            return -1;
-        }
-        if(read(fd, buffer2, sblock.block_size) < sblock.block_size){
-            mfs_write_error(buffer, buffer2, 2);
+    if(!(newInode.mode & MFS_MODE_INLINE)){
+        if(mfs_mapInit(&map, mnt, &newInode) == -1){
+            mfs_blockPut(chunk, size);
             return -1;
         }
-        mfs_setBit(buffer2, pos);
-        if(lseek64(fd, grDesc.inode_bitmap * sblock.block_size, SEEK_SET) == -1){
-            mfs_write_error(buffer, buffer2, 1);
-            return -1;
-        }
-        if(write(fd, buffer2, sblock.block_size) < sblock.block_size){
-            mfs_write_error(buffer, buffer2, 3);
-            return -1;
+        step = newInode.mode & MFS_MODE_COMPRESS ? MFS_CLUSTER_BLOCKS : 1;
+        while(fill > 0){
+            if((logical << mnt->blockShift) + fill > mnt->sblock.max_file_size){
+                fprintf(stderr, "%s is too large for this filesystem.\n", filename);
+                fill = mnt->sblock.max_file_size - (logical << mnt->blockShift);
+                error = -1;
+            }
+            blocks = (fill - tail + mnt->blockMask) >> mnt->blockShift;
+            memset(chunk + fill, 0, ((size_t) blocks << mnt->blockShift) - (fill - tail));
+
+            /* Allocation waits until a chunk is full or the stream ends, then
+             * takes the whole chunk from one run, right after the last one
+             * if that space is free. */
+            meta = mfs_metaBlocks(mnt, &newInode, logical + blocks) -
+                   mfs_metaBlocks(mnt, &newInode, logical);
+            map.goalLeft = 0;
+            if(blocks && mfs_findRun(mnt, blocks + meta, goal, &map.blockNo,
+                                     &map.grDescNo, &map.goal) == 0){
+                map.goalLeft = blocks + meta;
+            }
+            for(i = 0; i < blocks; i += step){
+                offset = (size_t) i << mnt->blockShift;
+                if(mfs_storeUnit(&map, logical + i, chunk + offset, fill - offset,
+                                 &physical) == -1){
+                    error = -1;
+                    break;
+                }
+            }
+            newInode.file_size = (logical << mnt->blockShift) + fill;
+            logical += i;
+            goal = physical + 1;
+            if(error || fill < size) break;
+
+            fill = mfs_readFull(toCopy, chunk, size);
+            if(fill == -1){
+                perror("mfs_importStream read");
+                error = -1;
+                break;
+            }
         }
+        mfs_mapDestroy(&map);
 
-        memcpy(buffer + sizeof(group_linker) + grDescNo * sizeof(group_descriptor),
-               &grDesc, sizeof(group_descriptor));
-        if(lseek64(fd, blockNo * sblock.block_size, SEEK_SET) == -1){
-            mfs_write_error(buffer, buffer2, 1);
-            return -1;
+        if(!error && tail &&
+           mfs_tailPack(mnt, &newInode, chunk + ((size_t) blocks << mnt->blockShift),
+                        tail) == -1){
+            error = -1;
         }
-        write(fd, buffer, sblock.block_size);
+        if(error){
+            newInode.mode &= ~MFS_MODE_TAIL;
+            newInode.datablocks[MFS_TAIL_BLOCK] = 0;
+            newInode.datablocks[MFS_TAIL_WHERE] = 0;
+            if(newInode.file_size > logical << mnt->blockShift){
+                newInode.file_size = logical << mnt->blockShift;
+            }
+            fprintf(stderr, "%s: import incomplete.\n", filename);
+        }
+        mfs_updateInode(mnt, &newInode);
+    }
+    if(mfs_insertEntry(mnt, folder, &newInode, filename) == -1){
+        fprintf(stderr, "%s: no room in the target directory.\n", filename);
+        mfs_freeInode(mnt, &newInode);
+        error = -1;
     }
 
-    free(buffer);
-    free(buffer2);
-    return 0;
+    mfs_blockPut(chunk, size);
+    return error;
 }
 
-int mfs_writeData(int fd, char *toCopy, mfs_superblock sblock, __u32 blockNo,
-                  __u32 grDescNo, __u32 *datablocks, __u32 pos, __u32 dataIndex){
-    char                *buffer = NULL, *buffer2 = NULL;
-    __u32               toWrite;
-    group_descriptor    grDesc;
+int mfs_importStdin(char *image, char *dir, char *filename){
+    int         err = -1;
+    mfs_mount   *mnt;
+    inode       folder;
 
-    buffer = malloc(sblock.block_size);
-    if(buffer == NULL){
-        mfs_write_error(buffer, buffer2, 0);
+    mnt = mfs_open(image, O_RDWR);
+    if(mnt == NULL){
+        perror("mfs_importStdin open");
         return -1;
     }
-    memset(buffer, 0, sblock.block_size);
-    buffer2 = malloc(sblock.block_size);
-    if(buffer2 == NULL){
-        mfs_write_error(buffer, buffer2, 0);
+    if(mfs_lock(mnt, MFS_LOCK_WRITE) == -1){
+        perror("mfs_importStdin lock");
+        mfs_close(mnt);
         return -1;
     }
-    memset(buffer2, 0, sblock.block_size);
 
-    if(lseek64(fd, blockNo * sblock.block_size, SEEK_SET) == -1){
-        mfs_write_error(buffer, buffer2, 1);
-        return -1;
-    }
-    if(read(fd, buffer, sblock.block_size) < sblock.block_size){
-        mfs_write_error(buffer, buffer2, 2);
-        return -1;
+    if(mfs_findInode(mnt, MFS_ROOT_INO, &folder) == -1 ||
+       mfs_followPath(mnt, dir, &folder, 0) == -1 || folder.mode != 0){
+        fprintf(stderr, "Target not found or is not a directory.\n");
+    }else if(mfs_findEntry(mnt, &folder, filename, 1) != -1){
+        fprintf(stderr, "%s already exists at destination.\n", filename);
+    }else{
+        err = mfs_importStream(mnt, &folder, 0, filename);
     }
-    memcpy(&grDesc, buffer + sizeof(group_linker) + grDescNo * sizeof(group_descriptor),
-           sizeof(group_descriptor));
-    grDesc.free_blocks--;
 
-    toWrite = grDesc.inode_table + sblock.inode_blocks + pos;
-    datablocks[dataIndex] = toWrite;
+    if(mfs_unlock(mnt) == -1) err = -1;
+    mfs_close(mnt);
+    return err;
+}
 
-    if(lseek64(fd, toWrite * sblock.block_size, SEEK_SET) == -1){
-        mfs_write_error(buffer, buffer2, 1);
-        return -1;
-    }
-    if(write(fd, toCopy, sblock.block_size) < sblock.block_size){
-        mfs_write_error(buffer, buffer2, 3);
-        return -1;
+/* Writes a compressed file out cluster by cluster. */
+static int mfs_exportClusters(mfs_blockmap *map, int fd, char *buffer){
+    __u32   size;
+    __u64   cluster, left, clusterSize;
+
+    clusterSize = (__u64) MFS_CLUSTER_BLOCKS << map->mnt->blockShift;
+    left = map->file->file_size;
+    for(cluster = 0; left > 0; cluster++){
+        size = left < clusterSize ? left : clusterSize;
+        if(mfs_clusterLoad(map, cluster, buffer, size) == -1) return -1;
+        if(write(fd, buffer, size) < (ssize_t) size){
+            perror("mfs_export write");
+            return -1;
+        }
+        left -= size;
     }
 
-    memset(buffer2, 0, sblock.block_size);
-    if(lseek64(fd, grDesc.block_bitmap * sblock.block_size, SEEK_SET) == -1){
-        mfs_write_error(buffer, buffer2, 1);
-        return -1;
-    }
-    if(read(fd, buffer2, sblock.block_size) < sblock.block_size){
-        mfs_write_error(buffer, buffer2, 2);
-        return -1;
-    }
+    return 0;
+}
 
-    mfs_setBit(buffer2, pos);
-    if(lseek64(fd, grDesc.block_bitmap * sblock.block_size, SEEK_SET) == -1){
-        mfs_write_error(buffer, buffer2, 1);
-        return -1;
-    }
-    if(write(fd, buffer2, sblock.block_size) < sblock.block_size){
-        mfs_write_error(buffer, buffer2, 3);
+int mfs_export(char **command, mfs_mount *mnt, inode *curDir, int argc){
+    int             i, newFile, error;
+    char            *buffer, *path, *filename;
+    __u32           physical, run;
+    __u64           logical, reqBlocks, toWrite, remSize;
+    DIR             *checkPath;
+    inode           target;
+    mfs_blockmap    map;
+
+    checkPath = opendir(command[argc - 1]);
+    if(checkPath == NULL){
+        perror("mfs_export opendir");
         return -1;
     }
-    memcpy(buffer + sizeof(group_linker) + grDescNo * sizeof(group_descriptor),
-           &grDesc, sizeof(group_descriptor));
-    if(lseek64(fd, blockNo * sblock.block_size, SEEK_SET) == -1){
-        mfs_write_error(buffer, buffer2, 1);
+    closedir(checkPath);
+
+    buffer = mfs_blockGet(mnt->sblock.block_size * MFS_RUN_BLOCKS);
+    path = mfs_arenaAlloc(&commandArena, strlen(command[argc - 1]) +
+                          mnt->sblock.max_filename_size + 2);
+    if(buffer == NULL || path == NULL){
+        perror("mfs_export malloc");
+        mfs_blockPut(buffer, mnt->sblock.block_size * MFS_RUN_BLOCKS);
         return -1;
     }
-    write(fd, buffer, sblock.block_size);
 
-    free(buffer);
-    free(buffer2);
-    return 0;
-}
-
-void mfs_write_error(char *buffer1, char *buffer2, int errorType){
-    if(errorType == 0) perror("mfs_write malloc");
-    else if(errorType == 1) perror("mfs_write seek");
-    else if(errorType == 1) perror("mfs_write read");
-    else perror("mfs_write write");
-
-    if(buffer1) free(buffer1);
-    if(buffer2) free(buffer2);
-}
-
-int mfs_followPath(int fd, mfs_superblock sblock, char *path, inode *ptr, int mode){
-    int     found;
-    char    *buffer, *token;
-    inode   curFolder;
+    for(i = 1; i < argc - 1; i++){
+        filename = strrchr(command[i], '/');
+        if(filename != NULL && filename[1] == '\0'){
+            fprintf(stderr, "No filename given.\n");
+            continue;
+        }
+        strcpy(path, command[argc - 1]);
+        if(path[strlen(path) - 1] != '/') strcat(path, "/");
+        strcat(path, filename == NULL ? command[i] : filename + 1);
 
-    if(path[0] == '/' || path[0] == '.' || (path[0] > 64 && path[0] < 91) ||
-       (path[0] > 96 && path[0] < 123)){
-        if(!strcmp(path, ".")){
-            return 0;
+        memcpy(&target, curDir, sizeof(inode));
+        if(mfs_followPath(mnt, command[i], &target, 1) == -1){
+            fprintf(stderr, "%s not found.\n", command[i]);
+            continue;
         }
-        buffer = malloc(sblock.block_size);
-        if(buffer == NULL){
-            perror("mfs_followPath malloc");
-            return -1;
+        newFile = open(path, O_WRONLY | O_CREAT | O_EXCL, 0666);
+        if(newFile == -1){
+            perror("mfs_export open");
+            continue;
         }
-        if(path[0] == '/'){
-            if(lseek(fd, 4 * sblock.block_size, SEEK_SET) == -1){
-                perror("mfs_followPath seek");
-                free(buffer);
-                return -1;
+        if(target.mode & MFS_MODE_INLINE){
+            if(write(newFile, target.datablocks, target.file_size) <
+               (ssize_t) target.file_size){
+                perror("mfs_export write");
+                unlink(path);
             }
-            if(read(fd, buffer, sblock.block_size) < sblock.block_size){
-                perror("mfs_followPath read");
-                free(buffer);
-                return -1;
+            close(newFile);
+            continue;
+        }
+        if(mfs_mapInit(&map, mnt, &target) == -1){
+            close(newFile);
+            unlink(path);
+            continue;
+        }
+
+        reqBlocks = (target.file_size + mnt->blockMask) >> mnt->blockShift;
+        if(target.mode & MFS_MODE_TAIL) reqBlocks--;
+        remSize = target.file_size;
+        logical = 0;
+        error = -1;
+        if(target.mode & MFS_MODE_COMPRESS){
+            error = mfs_exportClusters(&map, newFile, buffer) == -1 ? 0 : -1;
+            reqBlocks = 0;
+            remSize = 0;
+        }
+        while(error && logical < reqBlocks){
+            run = reqBlocks - logical < MFS_RUN_BLOCKS ? reqBlocks - logical :
+                                                         MFS_RUN_BLOCKS;
+            if(mfs_mapRun(&map, logical, run, &physical, &run) == -1){
+                error = 0;
+                break;
             }
-            if(strcmp(path, "/")){
-                memcpy(ptr, buffer, sizeof(inode));
-                free(buffer);
-                return 0;
-            }else{
-                memcpy(&curFolder, buffer, sizeof(inode));
+            if(physical == 0){
+                memset(buffer, 0, (size_t) run * mnt->sblock.block_size);
+            }else if(mfs_readBlocks(mnt, buffer, physical, run) == -1){
+                error = 0;
+                break;
             }
-        }else{
-            memcpy(&curFolder, ptr, sizeof(inode));
-        }
-        token = strtok(path, "/");
-        while(token != NULL){
-            found = mfs_findEntry(fd, sblock, curFolder, token, mode);
-            if(found == -1){
-                free(buffer);
-                return -1;
+            toWrite = (__u64) run * mnt->sblock.block_size;
+            if(toWrite > remSize) toWrite = remSize;
+            if(write(newFile, buffer, toWrite) < (ssize_t) toWrite){
+                perror("mfs_export write");
+                error = 0;
             }
-            if(mfs_findInode(fd, sblock, found, &curFolder) == -1){
-                free(buffer);
-                return -1;
+            remSize -= toWrite;
+            logical += run;
+        }
+        mfs_mapDestroy(&map);
+        if(error && remSize){
+            if(mfs_tailRead(mnt, &target, buffer) == -1 ||
+               write(newFile, buffer, remSize) < (ssize_t) remSize){
+                perror("mfs_export write");
+                error = 0;
             }
-            token = strtok(NULL, "/");
         }
-        memcpy(ptr, &curFolder, sizeof(inode));
-        return 0;
-    }else{
-        fprintf(stderr, "Invalid path.\n");
-        return -1;
+
+        close(newFile);
+        if(!error) unlink(path);
     }
 
-    return -1;
+    mfs_blockPut(buffer, mnt->sblock.block_size * MFS_RUN_BLOCKS);
+    return 0;
 }
 
-int mfs_findEntry(int fd, mfs_superblock sblock, inode curFolder, char *name,
-                  int file_type){
-    char            *buffer, curName[256];
-    int             i = 0;
-    int             curOffset, offset, namelen;
-    directory_entry entry;
+int mfs_mkdirCommand(char **command, mfs_mount *mnt, inode *curDir, int argc){
+    int     i;
+    __u32   parent;
+    char    *name, *parentPath;
 
-    buffer = malloc(sblock.block_size);
-    if(buffer == NULL){
-        perror("mfs_findEntry malloc");
-        return -1;
-    }
-    namelen = strlen(name);
-    while(curFolder.datablocks[i] != 0){
-        if(lseek(fd, curFolder.datablocks[i] * sblock.block_size, SEEK_SET) == -1){
-            perror("mfs_findEntry seek");
-            free(buffer);
-            return -1;
+    for(i = 1; i < argc; i++){
+        parentPath = mfs_extractPath(command[i]);
+        name = mfs_extractFilename(command[i]);
+        if(name == NULL){
+            fprintf(stderr, "No filename given.\n");
+            free(parentPath);
+            continue;
         }
-        if(read(fd, buffer, sblock.block_size) < sblock.block_size){
-            perror("mfs_findEntry read");
-            free(buffer);
-            return -1;
+        if(parentPath[0] == '\0') strcpy(parentPath, "/");
+        if(mfs_lookup(mnt, curDir->node_id, parentPath, &parent) == -1 ||
+           mfs_mkdir(mnt, parent, name, NULL) == -1){
+            fprintf(stderr, "mfs_mkdir: %s: %s\n", name, strerror(errno));
         }
-        memcpy(&offset, buffer, 4);
-        curOffset = 4;
-        while(curOffset < offset){
-            memcpy(&entry, buffer + curOffset, sizeof(directory_entry));
-            if(entry.inodeptr != 0 && namelen == entry.name_len){
-                memcpy(curName, buffer + curOffset + sizeof(directory_entry),
-                       entry.name_len);
-                if(!strncmp(name, curName, namelen)){
-                    free(buffer);
-                    if(entry.file_type == file_type){
-                        return entry.inodeptr;
-                    }else{
-                        fprintf(stderr, "%s not the requested file type\n", name);
-                        return -1;
-                    }
-                }
-            }
-            curOffset += entry.rec_len;
-        }
-        i++;
+        free(parentPath);
     }
 
-    return -1;
+    return 0;
 }
 
-int mfs_findInode(int fd, mfs_superblock sblock, __u32 inodeptr, inode *requested){
-    int                 block_group, index, desc_block, dpos, i, block = 1,
-                        inode_block, ipos;
-    char                *buffer;
-    group_linker        link;
-    group_descriptor    grDesc;
-
-    block_group = (inodeptr - 1) / sblock.inodes_per_group;
-    index = (inodeptr - 1) % sblock.inodes_per_group;
-    desc_block = block_group / ((sblock.block_size - sizeof(group_linker)) /
-                 sizeof(group_descriptor));
-    dpos = block_group % ((sblock.block_size - sizeof(group_linker)) /
-                 sizeof(group_descriptor));
-    inode_block = index / (sblock.block_size / sizeof(inode));
-    ipos = index % (sblock.block_size / sizeof(inode));
+int mfs_cat(char **command, mfs_mount *mnt, inode *curDir, int argc){
+    int     i;
+    char    *buffer;
+    __u32   ino;
+    __u64   offset;
+    size_t  size;
+    ssize_t rd;
 
-    buffer = malloc(sblock.block_size);
+    size = (size_t) mfs_getSuperblock(mnt)->block_size * MFS_RUN_BLOCKS;
+    buffer = mfs_blockGet(size);
     if(buffer == NULL){
-        perror("mfs_findInode malloc");
+        perror("mfs_cat malloc");
         return -1;
     }
 
-    for(i = 0; i < desc_block + 1; i++){
-        if(lseek(fd, block * sblock.block_size, SEEK_SET) == -1){
-            perror("mfs_findInode seek");
-            free(buffer);
-            return -1;
+    for(i = 1; i < argc; i++){
+        if(mfs_lookup(mnt, curDir->node_id, command[i], &ino) == -1){
+            fprintf(stderr, "mfs_cat: %s: %s\n", command[i], strerror(errno));
+            continue;
         }
-        if(read(fd, buffer, sblock.block_size) < sblock.block_size){
-            perror("mfs_findInode read");
-            free(buffer);
-            return -1;
+        offset = 0;
+        while((rd = mfs_read_at(mnt, ino, buffer, size, offset)) > 0){
+            fwrite(buffer, 1, rd, stdout);
+            offset += rd;
+        }
+        if(rd == -1){
+            fprintf(stderr, "mfs_cat: %s: %s\n", command[i], strerror(errno));
         }
-        memcpy(&link, buffer, sizeof(group_linker));
-        block = link.next_block;
-    }
-
-    memcpy(&grDesc, buffer + sizeof(group_linker) + dpos * sizeof(group_descriptor),
-           sizeof(group_descriptor));
-    if(lseek(fd, (grDesc.inode_table + inode_block) * sblock.block_size, SEEK_SET) == -1){
-        perror("mfs_findInode seek");
-        free(buffer);
-        return -1;
-    }
-    if(read(fd, buffer, sblock.block_size) < sblock.block_size){
-        perror("mfs_findInode read");
-        free(buffer);
-        return -1;
     }
-    memcpy(requested, buffer + ipos * sizeof(inode), sizeof(inode));
 
-    free(buffer);
+    mfs_blockPut(buffer, size);
     return 0;
 }
 
-int mfs_findFree(int fd, __u32 *blockNo, __u32 *grDescNo, mfs_superblock *sblock,
-                 int mode){
-    int                 empty = -1, i, freeptr;
-    char                *buffer;
-    group_descriptor    grDesc;
-    group_linker        grlink;
-    ssize_t             rd;
-    off_t               seek;
-
-    buffer = malloc(sblock->block_size);
-    if(buffer == NULL){
-        perror("mfs_findFree malloc");
-        return -1;
-    }
-
-    seek = lseek(fd, (*blockNo) * sblock->block_size, SEEK_SET);
-    if(seek == -1){
-        perror("mfs_findFree seek");
-        return -1;
-    }
-
-    rd = read(fd, buffer, sblock->block_size);
-    if(rd < sblock-> block_size){
-        perror("mfs_findFree read");
-        return -1;
-    }
-
-    memcpy(&grlink, buffer, sizeof(group_linker));
-    for(i = *grDescNo; i < grlink.no_descriptors; i++){
-        memcpy(&grDesc, buffer + sizeof(group_linker) + i * sizeof(group_descriptor),
-               sizeof(group_descriptor));
-        if(!mode) freeptr = grDesc.free_inodes;
-        else freeptr = grDesc.free_blocks;
-        if(freeptr != 0){
-            if(!mode) empty = mfs_fzeroBit(fd, *sblock, grDesc.inode_bitmap);
-            else empty = mfs_fzeroBit(fd, *sblock, grDesc.block_bitmap);
-            *grDescNo = i;
-            free(buffer);
-            return empty;
+int mfs_compactCommand(char **command, mfs_mount *mnt, inode *curDir, int argc){
+    int     i, freed;
+    char    *path, *name;
+    __u32   reclaimed;
+    inode   dir;
+
+    for(i = 1; i < argc || i == 1; i++){
+        name = argc > 1 ? command[i] : ".";
+        path = mfs_arenaStrdup(&commandArena, name);
+        if(path == NULL){
+            perror("mfs_compact malloc");
+            return -1;
         }
-    }
-
-    if(grlink.next_block != 0){
-        *blockNo = grlink.next_block;
-        *grDescNo = 0;
-        free(buffer);
-        return -2;
-    }else{
-        if(i == grlink.max_descriptors){
-            if(!mfs_newGroupDescriptor(fd, sblock, blockNo, grDescNo, &grlink, 0)){
-                *blockNo = grlink.next_block;
-                *grDescNo = 0;
-                free(buffer);
-                return -2;
-            }
+        memcpy(&dir, curDir, sizeof(inode));
+        if(mfs_followPath(mnt, path, &dir, 0) == -1 || dir.mode != 0){
+            fprintf(stderr, "%s not found or is not a directory.\n", name);
         }else{
-            if(!mfs_newGroupDescriptor(fd, sblock, blockNo, grDescNo, &grlink, i)){
-                *grDescNo += 1;
-                free(buffer);
-                return -2;
+            freed = mfs_compactDir(mnt, &dir, &reclaimed);
+            if(freed == -1){
+                fprintf(stderr, "mfs_compact: %s: failed.\n", name);
+            }else{
+                printf("%s: %u bytes reclaimed, %d blocks released\n", name,
+                       reclaimed, freed);
             }
         }
     }
 
-    return -1;
+    return 0;
 }
 
-__u32 mfs_fzeroBit(int fd, mfs_superblock sblock, __u32 offset){
-    int     i, pos = 0;
-    char    *buffer;
-    __u32   returnValue = 0, bitpack, invBitpack;
-    off_t   seek;
-    ssize_t rd;
-
-    buffer = malloc(sblock.block_size);
-    if(buffer == NULL){
-        perror("mfs_fzeroBit malloc");
-        return 0;
-    }
+int mfs_defragCommand(char **command, mfs_mount *mnt, inode *curDir, int argc){
+    int     i, budget = 0, result;
+    char    *path = ".", *copy, *argCheck;
+    __u32   counts[3] = {0, 0, 0};
+    __u64   deadline = 0;
+    inode   target;
 
-    seek = lseek(fd, offset * sblock.block_size, SEEK_SET);
-    if(seek == -1){
-        free(buffer);
-        perror("mfs_fzeroBit seek");
-        return 0;
-    }
-
-    rd = read(fd, buffer, sblock.block_size);
-    if(rd < sblock.block_size){
-        free(buffer);
-        perror("mfs_fzeroBit read");
-        return 0;
-    }
-
-    for(i = 0; i < sblock.block_size / 4; i++){
-        memcpy(&bitpack, buffer + i * 4, 4);
-        if(bitpack == 0){
-            free(buffer);
-            return returnValue;
-        }else{
-            invBitpack = ~bitpack;
-            while(invBitpack >>= 1){
-                pos++;
-            }
-            if(bitpack != 0xffffffff){
-                free(buffer);
-                return returnValue + 31 - pos;
-            }else{
-                returnValue += 32;
+    for(i = 1; i < argc; i++){
+        if(!strcmp(command[i], "-t") && i + 1 < argc && !budget){
+            budget = (int) strtol(command[++i], &argCheck, 0);
+            if(*argCheck != '\0' || budget <= 0){
+                fprintf(stderr, "mfs_defrag: Invalid time budget.\n");
+                return -1;
             }
+            deadline = mfs_clock() + (__u64) budget * 1000000;
+        }else{
+            path = command[i];
         }
     }
 
-    return 0;
-}
-
-void mfs_setBit(char *buffer, __u32 index){
-    __u32     whichInt, whichBit;
-    __u32     number = 0;
-
-    whichInt = index / 32;
-    whichBit = index % 32;
-
-    memcpy(&number, buffer + whichInt * 4, 4);
-    number |= 1 << (31 - whichBit);
-
-    memcpy(buffer + whichInt * 4, &number, 4);
-}
-
-int mfs_newGroupDescriptor(int fd, mfs_superblock *sblock, __u32 *blockNo,
-                           __u32 *grDescNo, group_linker *grlink, __u32 pos){
-    int                 i, ptr;
-    char                *buffer;
-    group_descriptor    grDesc;
-    group_linker        newGrlink;
-    off_t               seek;
-
-    buffer = malloc(sblock->block_size);
-    if(buffer == NULL){
-        perror("mfs_newGroupDescriptor malloc");
+    copy = mfs_arenaStrdup(&commandArena, path);
+    if(copy == NULL){
+        perror("mfs_defrag malloc");
         return -1;
     }
-    memset(buffer, 0, sblock->block_size);
-
-    seek = lseek(fd, 0 , SEEK_END);
-    if(seek == -1){
-        perror("mfs_newGroupDescriptor seek");
-        free(buffer);
+    memcpy(&target, curDir, sizeof(inode));
+    if(mfs_followPath(mnt, copy, &target, -1) == -1){
+        fprintf(stderr, "%s not found.\n", path);
         return -1;
     }
 
-    ptr = seek / sblock->block_size;
-    grDesc.free_blocks = sblock->block_size * 8;
-    grDesc.free_inodes = grDesc.free_blocks;
-
-    if(!pos){
-        grlink->next_block = ptr;
-        newGrlink.next_block = 0;
-        newGrlink.no_descriptors = 1;
-        newGrlink.max_descriptors = grlink->max_descriptors;
-        grDesc.block_bitmap = ptr + 1;
-        grDesc.inode_bitmap = ptr + 2;
-        grDesc.inode_table = ptr + 3;
-        memcpy(buffer, &newGrlink, sizeof(group_linker));
-        memcpy(buffer + sizeof(group_linker), &grDesc, sizeof(group_descriptor));
-        if(write(fd, buffer, sblock->block_size) < sblock->block_size){
-            perror("mfs_newGroupDescriptor write");
-            free(buffer);
-            return -1;
-        }
+    if(target.mode == 0){
+        result = mfs_defragDir(mnt, &target, path, deadline, counts);
     }else{
-        grlink->no_descriptors++;
-        grDesc.block_bitmap = ptr;
-        grDesc.inode_bitmap = ptr + 1;
-        grDesc.inode_table = ptr + 2;
-        seek = lseek(fd, (*blockNo) * sblock->block_size, sblock->block_size);
-        if(seek == -1){
-            perror("mfs_newGroupDescriptor seek");
-            free(buffer);
-            return -1;
-        }
-        if(read(fd, buffer, sblock->block_size)){
-
-        }
-        memcpy(buffer, grlink, sizeof(group_linker));
-        memcpy(buffer + sizeof(group_linker) + pos * sizeof(group_descriptor),
-               &grDesc, sizeof(group_descriptor));
-        if(lseek(fd, (*blockNo) * sblock->block_size, sblock->block_size) == -1){
-            perror("mfs_newGroupDescriptor seek");
-            free(buffer);
-            return -1;
-        }
-        if(write(fd, buffer, sblock->block_size) < sblock->block_size){
-            perror("mfs_newGroupDescriptor write");
-            free(buffer);
-            return -1;
-        }
-        if(lseek(fd, 0, SEEK_END) == -1){
-            perror("mfs_newGroupDescriptor seek");
-            free(buffer);
-            return -1;
-        }
-    }
-    memset(buffer, 0, sblock->block_size);
-    for(i = 0; i < 2 + sblock->block_size * 8 + sblock->block_size * 8 /
-        (sblock->block_size / sizeof(inode)); i++){
-        if(write(fd, buffer, sblock->block_size) < sblock->block_size){
-            perror("mfs_newGroupDescriptor write");
-            free(buffer);
-            return -1;
-        }
+        result = mfs_defragReport(mnt, &target, path, counts);
     }
+    printf("%u files checked, %u defragmented\n", counts[0], counts[1]);
+    if(result == 1) printf("Time budget exhausted, run again to continue.\n");
 
-    free(buffer);
-    return 0;
+    return result == -1 ? -1 : 0;
 }
 
-int mfs_export(char **command, int fd, mfs_superblock sblock, inode *curDir, int argc){
-    int         i, newFile, error;
-    char        *buffer, *path, *filename;
-    __u32       j, reqBlocks, toWrite, *indirectBlock = NULL,
-                *sIndirectBlock = NULL, *tIndirectBlock = NULL;
-    __u64       remSize;
-    DIR         *checkPath;
-    inode       target;
-
-    checkPath = opendir(command[argc - 1]);
-    if(checkPath == NULL){
-        perror("mfs_export opendir");
-        return -1;
-    }
-
-    buffer = malloc(sblock.block_size);
-    if(buffer == NULL){
-        perror("mfs_export malloc");
-        return -1;
-    }
-    path = malloc(strlen(command[argc - 1]) + sblock.max_filename_size + 1);
-    if(path == NULL){
-        perror("mfs_export malloc");
-        mfs_export_clean(buffer, indirectBlock, sIndirectBlock, tIndirectBlock);
-        return -1;
-    }
-
-    indirectBlock = malloc(sblock.block_size);
-    if(indirectBlock == NULL){
-        perror("mfs_export malloc");
-        mfs_export_clean(buffer, indirectBlock, sIndirectBlock, tIndirectBlock);
-        return -1;
-    }
-
-    sIndirectBlock = malloc(sblock.block_size);
-    if(sIndirectBlock == NULL){
-        perror("mfs_export malloc");
-        mfs_export_clean(buffer, indirectBlock, sIndirectBlock, tIndirectBlock);
+int mfs_defragDir(mfs_mount *mnt, inode *dir, char *path, __u64 deadline, __u32 *counts){
+    int             i, result = 0;
+    char            *buffer, *name;
+    __u32           offset, curOffset;
+    directory_entry entry;
+    inode           cur;
+
+    buffer = mfs_blockGet(mnt->sblock.block_size);
+    name = mfs_arenaAlloc(&commandArena, strlen(path) +
+                          mnt->sblock.max_filename_size + 2);
+    if(buffer == NULL || name == NULL){
+        perror("mfs_defrag malloc");
+        mfs_blockPut(buffer, mnt->sblock.block_size);
         return -1;
     }
 
-    memcpy(&target, curDir, sizeof(inode));
-
-    for(i = 1; i < argc - 1; i++){
-        if(mfs_followPath(fd, sblock, command[i], &target, 1) == -1){
-            fprintf(stderr, "%s not found.\n", command[i]);
-        }else{
-            filename = mfs_extractFilename(command[i]);
-            if(filename == NULL){
-                fprintf(stderr, "No filename given.\n");
+    for(i = 0; i < DATABLOCK_NUM && dir->datablocks[i] != 0 && result != 1; i++){
+        if(mfs_read(mnt, buffer, dir->datablocks[i]) == -1) break;
+        memcpy(&offset, buffer, 4);
+        for(curOffset = 4; curOffset < offset && result != 1;
+            curOffset += entry.rec_len){
+            memcpy(&entry, buffer + curOffset, sizeof(directory_entry));
+            if(entry.rec_len == 0) break;
+            if(entry.inodeptr == 0 || entry.inodeptr == dir->node_id) continue;
+            if(entry.name_len == 2 &&
+               !strncmp(buffer + curOffset + sizeof(directory_entry), "..", 2)){
                 continue;
             }
-            strcpy(path, command[argc - 1]);
-            if(path[strlen(path) - 1] != '/') strcat(path, "/");
-            strcat(path, filename);
-            newFile = open(path, O_WRONLY | O_CREAT | O_EXCL, 0666);
-            if(newFile == -1){
-                perror("mfs_export open");
+            sprintf(name, "%s%s%.*s", path, path[strlen(path) - 1] == '/' ? "" : "/",
+                    entry.name_len, buffer + curOffset + sizeof(directory_entry));
+            if(mfs_findInode(mnt, entry.inodeptr, &cur) == -1) continue;
+
+            if(deadline && mfs_clock() > deadline){
+                result = 1;
+            }else if(cur.mode == 0){
+                result = mfs_defragDir(mnt, &cur, name, deadline, counts);
             }else{
-                reqBlocks = (__u32) ceil((double) target.file_size / sblock.block_size);
-                remSize = target.file_size;
-                j = 0;
-                error = -1;
-                while(error && j < DATABLOCK_NUM - 3 && j < reqBlocks){
-                    memset(buffer, 0, sblock.block_size);
-                    if(mfs_read(fd, sblock, buffer, target.datablocks[j]) == -1){
-                        error = 0;
-                    }else{
-                        if(remSize >= sblock.block_size){
-                            toWrite = sblock.block_size;
-                            remSize -= sblock.block_size;
-                        }else{
-                            toWrite = remSize;
-                            remSize = 0;
-                        }
-                        if(write(newFile, buffer, toWrite) < toWrite){
-                            perror("mfs_export write");
-                            error = 0;
-                        }
-                    }
-                    j++;
-                }
-                if(remSize){
-                    mfs_read(fd, sblock, buffer, target.datablocks[12]);
-                    memcpy(indirectBlock, buffer, sblock.block_size);
-                    j = 0;
-                    while(j < sblock.block_size / 4 && j + 12 < reqBlocks){
-                        mfs_read(fd, sblock, buffer, indirectBlock[j]);
-                        if(remSize >= sblock.block_size){
-                            toWrite = sblock.block_size;
-                            remSize -= sblock.block_size;
-                        }else{
-                            toWrite = remSize;
-                            remSize = 0;
-                        }
-                        if(write(newFile, buffer, toWrite) < toWrite){
-                            perror("mfs_export write");
-                            error = 0;
-                        }
-                        j++;
-                    }
-                }
-                if(remSize){
-                    mfs_read(fd, sblock, buffer, target.datablocks[13]);
-                    memcpy(indirectBlock, buffer, sblock.block_size);
-                    j = 0;
-                    while(j < sblock.block_size * sblock.block_size / 16 &&
-                          j + 12 + sblock.block_size / 4 < reqBlocks){
-                        if(j % (sblock.block_size / 4) == 0){
-                            mfs_read(fd, sblock, buffer,
-                                     indirectBlock[j / (sblock.block_size / 4)]);
-                            memcpy(sIndirectBlock, buffer, sblock.block_size);
-                        }
-                        mfs_read(fd, sblock, buffer,
-                                 sIndirectBlock[j % (sblock.block_size / 4)]);
-                        if(remSize >= sblock.block_size){
-                            toWrite = sblock.block_size;
-                            remSize -= sblock.block_size;
-                        }else{
-                            toWrite = remSize;
-                            remSize = 0;
-                        }
-                        if(write(newFile, buffer, toWrite) < toWrite){
-                            perror("mfs_export write");
-                            error = 0;
-                        }
-                        j++;
-                    }
-                }
-                if(remSize){
-                    mfs_read(fd, sblock, buffer, target.datablocks[14]);
-                    memcpy(indirectBlock, buffer, sblock.block_size);
-                    j = 0;
-                    while(j < sblock.block_size * sblock.block_size * sblock.block_size
-                          && j + 12 + sblock.block_size / 4 + sblock.block_size *
-                          sblock.block_size / 16){
-                        if(j % (sblock.block_size * sblock.block_size / 16) == 0){
-                            mfs_read(fd, sblock, buffer,
-                                     indirectBlock[j / (sblock.block_size * sblock.block_size / 16)]);
-                            memcpy(sIndirectBlock, buffer, sblock.block_size);
-                        }
-                        if(j % (sblock.block_size / 4) == 0){
-                            mfs_read(fd, sblock, buffer,
-                                     sIndirectBlock[j / (sblock.block_size / 4)]);
-                            memcpy(tIndirectBlock, buffer, sblock.block_size);
-                        }
-                        mfs_read(fd, sblock, buffer,
-                                 tIndirectBlock[j % (sblock.block_size / 4)]);
-                        if(remSize >= sblock.block_size){
-                            toWrite = sblock.block_size;
-                            remSize -= sblock.block_size;
-                        }else{
-                            toWrite = remSize;
-                            remSize = 0;
-                        }
-                        if(write(newFile, buffer, toWrite) < toWrite){
-                            perror("mfs_export write");
-                            error = 0;
-                        }
-                        j++;
-                    }
-                }
-                close(newFile);
-                if(!error) unlink(path);
+                mfs_defragReport(mnt, &cur, name, counts);
             }
         }
     }
 
-    mfs_export_clean(buffer, indirectBlock, sIndirectBlock, tIndirectBlock);
-    return 0;
+    mfs_blockPut(buffer, mnt->sblock.block_size);
+    return result;
 }
 
-void mfs_export_clean(char *buffer, __u32 *array1, __u32 *array2, __u32 *array3){
-    if(buffer != NULL) free(buffer);
-    if(array1 != NULL) free(array1);
-    if(array2 != NULL) free(array2);
-    if(array3 != NULL) free(array3);
-}
+int mfs_defragReport(mfs_mount *mnt, inode *file, char *path, __u32 *counts){
+    int     result;
+    __u32   before, after;
+    __u64   blocks;
 
-int mfs_read(int fd, mfs_superblock sblock, char *buffer, __u32 block){
-    if(lseek64(fd, block * sblock.block_size, SEEK_SET) == -1){
-        perror("mfs_read seek");
-        return -1;
-    }
-    if(read(fd, buffer, sblock.block_size) < sblock.block_size){
-        perror("mfs_read read");
-        return -1;
+    counts[0]++;
+    if(mfs_fragments(mnt, file, &before, &blocks) == -1) return -1;
+    result = mfs_defragFile(mnt, file);
+    if(result == -1){
+        fprintf(stderr, "mfs_defrag: %s: failed.\n", path);
+    }else if(result == 1){
+        counts[1]++;
+        mfs_fragments(mnt, file, &after, &blocks);
+        printf("%s: %u -> %u fragments\n", path, before, after);
     }
 
-    return 0;
+    return result;
 }
 
-int mfs_mkdir(int fd, mfs_superblock *sblock, char **command, inode curDir,
-              int argc){
-    int                 i, entry, error;
-    __u32               iblock, igrDesc, empty, offset, block, grDesc;
-    char                *toInsert, *token, *buffer;
-    inode               dir, newDir;
-    directory_entry     dirEntry;
+int mfs_resizeCommand(char **command, mfs_mount *mnt, int argc){
+    int         err;
+    char        *argCheck;
+    long long   value, target;
+    __u32       groups;
 
-    buffer = malloc(sblock->block_size);
-    if(buffer == NULL){
-        perror("mfs_mkdir malloc");
+    value = strtoll(command[1], &argCheck, 0);
+    if(*argCheck != '\0' || command[1][0] == '\0'){
+        fprintf(stderr, "mfs_resize: Invalid group count.\n");
         return -1;
     }
-
-    offset = 2 * sizeof(directory_entry) + 3 + 4;
-
-    for(i = 1; i < argc; i++){
-        toInsert = mfs_extractFilename(command[i]);
-        if(toInsert == NULL){
-            fprintf(stderr, "No filename given.\n");
-            continue;
-        }
-        entry = 0;
-        error = 0;
-        iblock = 1;
-        igrDesc = 0;
-        if(command[i][0] == '/'){
-            mfs_findInode(fd, *sblock, 1, &dir);
-        }else{
-            memcpy(&dir, &curDir, sizeof(inode));
-        }
-        token = strtok(command[i], "/");
-        while(!error && entry != -1 && token != NULL){
-            if(!strcmp(toInsert, token)) break;
-            entry = mfs_findEntry(fd, *sblock, dir, token, 0);
-            if(entry != -1){
-                error = mfs_findInode(fd, *sblock, entry, &dir);
-            }
-            token = strtok(NULL, "/");
-        }
-        empty = mfs_findFree(fd, &iblock, &igrDesc, sblock, 0);
-        while(empty == -2){
-            empty = mfs_findFree(fd, &iblock, &igrDesc, sblock, 0);
-        }
-        newDir.node_id = empty;
-        newDir.mode = 0;
-        newDir.creation_time = time(NULL);
-        newDir.access_time = time(NULL);
-        newDir.modification_time = time(NULL);
-        memset(newDir.datablocks, 0, DATABLOCK_NUM);
-        block = 1;
-        grDesc = 0;
-        empty = mfs_findFree(fd, &block, &grDesc, sblock, 1);
-        while(empty == -2){
-            empty = mfs_findFree(fd, &block, &grDesc, sblock, 1);
-        }
-        memcpy(buffer, &offset, 4);
-        dirEntry.inodeptr = newDir.node_id;
-        dirEntry.rec_len = sizeof(directory_entry) + 1;
-        dirEntry.name_len = 1;
-        dirEntry.file_type = 0;
-        memcpy(buffer + 4, &dirEntry, sizeof(directory_entry));
-        buffer[4 + sizeof(directory_entry)] = '.';
-        dirEntry.inodeptr = dir.node_id;
-        dirEntry.rec_len = sizeof(directory_entry) + 2;
-        dirEntry.name_len = 2;
-        memcpy(buffer + 4 + sizeof(directory_entry) + 1, &dirEntry,
-               sizeof(directory_entry));
-        buffer[4 + 2 * sizeof(directory_entry) + 1] = '.';
-        buffer[4 + 2 * sizeof(directory_entry) + 2] = '.';
-        if(mfs_writeData(fd, buffer, *sblock, block, grDesc, newDir.datablocks,
-                      empty, 0) != -1){
-            mfs_writeInode(fd, &newDir, *sblock, iblock, igrDesc,
-                           newDir.node_id % (sblock->block_size * 8), 0);
-            mfs_insertEntry(fd, sblock, dir, newDir, command[i]);
-        }
+    if(mfs_groupCount(mnt, &groups) == -1) return -1;
+    target = command[1][0] == '+' || command[1][0] == '-' ? groups + value : value;
+    if(target < 1 || target > 0xffffffffLL){
+        fprintf(stderr, "mfs_resize: Invalid group count.\n");
+        return -1;
     }
 
-    free(buffer);
+    if(target > groups) err = mfs_growGroups(mnt, target - groups);
+    else err = mfs_shrinkGroups(mnt, groups - target);
+    if(err) return -1;
+    printf("%u -> %lld groups\n", groups, target);
+
     return 0;
 }
 
-int mfs_touch(char **command, int fd, mfs_superblock sblock, int argc, inode *curDir){
-    __u32   newTime, block, grDesc;
+int mfs_touch(char **command, mfs_mount *mnt, int argc, inode *curDir){
+    __u32   newTime;
     int     mode = 0, i, j = 0;
     inode   cur;
 
@@ -1603,7 +1251,7 @@ int mfs_touch(char **command, int fd, mfs_superblock sblock, int argc, inode *cu
     memcpy(&cur, curDir, sizeof(inode));
 
     for(i = 1 + j; i < argc; i++){
-        if(mfs_followPath(fd, sblock, command[i], &cur, 1) != -1){
+        if(mfs_followPath(mnt, command[i], &cur, 1) != -1){
             if(!mode){
                 cur.access_time = newTime;
                 cur.modification_time = newTime;
@@ -1612,11 +1260,7 @@ int mfs_touch(char **command, int fd, mfs_superblock sblock, int argc, inode *cu
             }else{
                 cur.modification_time = newTime;
             }
-            grDesc = cur.node_id / (sblock.block_size * 8);
-            block = grDesc / (sblock.block_size / sizeof(group_descriptor));
-            grDesc = grDesc % (sblock.block_size / sizeof(group_descriptor));
-            mfs_writeInode(fd, &cur, sblock, block, grDesc,
-                           cur.node_id % (sblock.block_size * 8), 1);
+            mfs_updateInode(mnt, &cur);
         }else{
             fprintf(stderr, "%s not found.\n", command[i]);
         }
@@ -1633,24 +1277,31 @@ void mfs_goUp(char *buffer){
     buffer[i + 1] = '\0';
 }
 
-int mfs_ls(char **command, int fd, mfs_superblock sblock, int argc, inode *curDir){
+/* Prints one directory of a recursive listing, every directory but the first
+ * under a header with its path. state holds the -l flag and whether this is
+ * the first directory. */
+static void mfs_lsVisit(const char *path, mfs_list *list, void *arg){
+    int     *state = arg;
+
+    if(!state[1]) printf("\n%s:\n", path);
+    state[1] = 0;
+    mfs_listPrint(list, state[0]);
+}
+
+int mfs_ls(char **command, mfs_mount *mnt, int argc, inode *curDir){
     int             aFlag = -1, rFlag = -1, lFlag = -1, uFlag = -1, dFlag = -1,
-                    error = -1, argCount = 0, i, j, flags, k;
-    __u32           offset, curOffset;
-    char            *buffer, filename[255], **recursiveArray;
-    list_root       *list;
-    list_node       *curNode;
-    inode           cur, reqInode;
-    directory_entry entry;
+                    error = -1, argCount = 0, i, j, count, state[2];
+    char            *buffer, *path;
+    mfs_list        list;
+    inode           cur;
+    mfs_direntPlus  *entries;
 
-    buffer = malloc(sblock.block_size);
+    buffer = mfs_blockGet(DATABLOCK_NUM * mnt->sblock.block_size);
     if(buffer == NULL){
         perror("mfs_ls malloc");
         return -1;
     }
 
-    memcpy(&cur, curDir, sizeof(inode));
-
     for(i = 1; i < 6; i++){
         if(i == argc) break;
         if(!strcmp(command[i], "-a")){
@@ -1697,79 +1348,51 @@ int mfs_ls(char **command, int fd, mfs_superblock sblock, int argc, inode *curDi
     }
     if(!error){
         fprintf(stderr, "Duplicate argument.\n");
+        mfs_blockPut(buffer, DATABLOCK_NUM * mnt->sblock.block_size);
         return -1;
     }
 
     for(i = 1 + argCount; i < argc; i++){
-        if(mfs_followPath(fd, sblock, command[i], &cur, 1) != -1){
-            list = mfs_listCreate();
-            if(list == NULL){
-                continue;
-            }
-            j = 0;
-            while(cur.datablocks[j] != 0 && j < DATABLOCK_NUM){
-                mfs_read(fd, sblock, buffer, cur.datablocks[j]);
-                memcpy(&offset, buffer, 4);
-                curOffset = 4;
-                while(curOffset < offset){
-                    memcpy(&entry, buffer + curOffset, sizeof(directory_entry));
-                    if(entry.inodeptr != 0){
-                        mfs_findInode(fd, sblock, entry.inodeptr, &reqInode);
-                        memcpy(filename, buffer + curOffset + sizeof(directory_entry),
-                               entry.name_len);
-                        if((buffer[curOffset + sizeof(directory_entry)] != '.' ||
-                           !aFlag) && (entry.file_type == 0 || dFlag)){
-                            if(uFlag){
-                                mfs_listAddNodeAB(list, reqInode, filename,
-                                                  entry.name_len);
-                            }else{
-                                mfs_listAddNodeCT(list, reqInode, filename,
-                                                  entry.name_len);
-                            }
-                        }
-                    }
-                    curOffset += entry.rec_len;
-                }
-                j++;
-            }
-            mfs_listPrint(*list, lFlag);
-            if(!rFlag){
-                flags = aFlag + dFlag + uFlag + lFlag + rFlag;
-                flags += 5;
-                recursiveArray = malloc((2 + flags) * sizeof(char*));
-                recursiveArray[0] = malloc(1);
-                for(k = 1; k < flags; k++){
-                    recursiveArray[k] = malloc(3);
-                }
-                recursiveArray[1 + flags] = malloc(sblock.max_filename_size);
-                curNode = list->root;
-                while(curNode != NULL){
-                    if(curNode->mds.mode == 0){
-                        mfs_ls(recursiveArray, fd, sblock, argc, &(curNode->mds));
-                    }
-                }
-            }
-            mfs_listDestroy(list);
+        memcpy(&cur, curDir, sizeof(inode));
+        path = mfs_arenaStrdup(&commandArena, command[i]);
+        if(path == NULL){
+            perror("mfs_ls malloc");
+            break;
+        }
+        if(mfs_followPath(mnt, command[i], &cur, 0) == -1){
+            fprintf(stderr, "%s not found.\n", path);
+        }else if(!rFlag){
+            state[0] = lFlag;
+            state[1] = 1;
+            mfs_walk(mnt, &cur, path, 0, (aFlag ? 0 : MFS_WALK_ALL) |
+                     (dFlag ? 0 : MFS_WALK_DIRS) | (uFlag ? 0 : MFS_WALK_CTIME),
+                     mfs_lsVisit, state);
         }else{
-            fprintf(stderr, "%s not found.\n", command[i]);
+            mfs_listInit(&list);
+            count = mfs_readdirPlus(mnt, &cur, buffer, (aFlag ? 0 : MFS_DIRENT_ALL) |
+                                    (dFlag ? 0 : MFS_DIRENT_DIRS), &entries);
+            for(j = 0; j < count; j++){
+                mfs_listAdd(&list, &entries[j].attr, entries[j].name,
+                            entries[j].name_len);
+            }
+            if(count != -1) free(entries);
+            mfs_listSort(&list, !uFlag);
+            mfs_listPrint(&list, lFlag);
+            mfs_listDestroy(&list);
         }
     }
 
-    for(k = 0; k < 2 + flags; k++){
-        free(recursiveArray[k]);
-    }
-    free(recursiveArray);
-    free(buffer);
+    mfs_blockPut(buffer, DATABLOCK_NUM * mnt->sblock.block_size);
     return 0;
 }
 
-int mfs_move(char ** command, int fd, mfs_superblock sblock, int argc, inode *curDir){
+int mfs_mv(char ** command, mfs_mount *mnt, int argc, inode *curDir){
     int         iFlag = 1, i;
-    char        c, *newFilename, *targetPath, *sourcePath;
+    char        c, *newFilename, *targetPath, *sourcePath, *sourceName;
     inode       source, sourceDir, target;
 
     if(command[argc - 1][0] == '/'){
-        mfs_findInode(fd, sblock, 1, &target);
+        mfs_findInode(mnt, 1, &target);
     }else{
         memcpy(&target, curDir, sizeof(inode));
     }
@@ -1780,34 +1403,47 @@ int mfs_move(char ** command, int fd, mfs_superblock sblock, int argc, inode *cu
 
     if((!iFlag && argc == 4) || argc == 3){
         if(command[argc - 2][0] == '/'){
-            mfs_findInode(fd, sblock, 1, &sourceDir);
+            mfs_findInode(mnt, 1, &sourceDir);
         }else{
             memcpy(&sourceDir, curDir, sizeof(inode));
         }
 
+        /* The paths are split before they are followed: both tokenize the
+         * command in place. */
         sourcePath = mfs_extractPath(command[argc - 2]);
-        if(mfs_followPath(fd, sblock, sourcePath, &sourceDir, 0) == -1){
-            fprintf(stderr, "Source directory does not exist.\n");
+        targetPath = mfs_extractPath(command[argc - 1]);
+        sourceName = mfs_extractFilename(command[argc - 2]);
+        newFilename = mfs_extractFilename(command[argc - 1]);
+        if(sourceName == NULL || newFilename == NULL){
+            fprintf(stderr, "No filename given.\n");
+            free(sourcePath);
+            free(targetPath);
             return -1;
         }
-        if(mfs_followPath(fd, sblock, command[argc - 2], &source, 1) == -1){
-            fprintf(stderr, "Source does not exist.\n");
+        if(sourcePath[0] == '\0') strcpy(sourcePath, "/");
+        if(targetPath[0] == '\0') strcpy(targetPath, "/");
+        if(mfs_followPath(mnt, sourcePath, &sourceDir, 0) == -1){
+            fprintf(stderr, "Source directory does not exist.\n");
+            free(sourcePath);
+            free(targetPath);
             return -1;
         }
-
-        newFilename = mfs_extractFilename(command[argc - 1]);
-        if(newFilename == NULL){
-            fprintf(stderr, "No filename given.\n");
+        memcpy(&source, &sourceDir, sizeof(inode));
+        if(mfs_followPath(mnt, sourceName, &source, 1) == -1){
+            fprintf(stderr, "Source does not exist.\n");
+            free(sourcePath);
+            free(targetPath);
             return -1;
         }
-        targetPath = mfs_extractPath(command[argc - 1]);
 
-        if(mfs_followPath(fd, sblock, targetPath, &target, 0) == -1){
+        if(mfs_followPath(mnt, targetPath, &target, 0) == -1){
             fprintf(stderr,"%s does not exist.\n", targetPath);
+            free(sourcePath);
+            free(targetPath);
             return -1;
         }
         if(!iFlag){
-            printf("Move %s to %s? (y/n) ", command[argc - 2], command[argc - 1]);
+            printf("Move %s to %s? (y/n) ", sourceName, newFilename);
             c = getcharSilent();
             while(c != 'y' && c != 'n'){
                 c = getcharSilent();
@@ -1815,8 +1451,11 @@ int mfs_move(char ** command, int fd, mfs_superblock sblock, int argc, inode *cu
             putchar(c);
         }
         if(iFlag || c == 'y'){
-            if(mfs_insertEntry(fd, &sblock, target, source, command[argc - 1]) != -1){
-                if(mfs_clearEntry(fd, sblock, sourceDir, source) == -1){
+            /* The insert may have grown sourceDir when it is also the target,
+             * and clearing can compact it: work on its current inode. */
+            if(mfs_insertEntry(mnt, &target, &source, newFilename) != -1 &&
+               mfs_findInode(mnt, sourceDir.node_id, &sourceDir) != -1){
+                if(mfs_clearEntry(mnt, &sourceDir, &source) == -1){
                     fprintf(stderr, "Failed to clear entry. Possible duplicate entries\n");
                 }
             }
@@ -1825,29 +1464,46 @@ int mfs_move(char ** command, int fd, mfs_superblock sblock, int argc, inode *cu
         free(targetPath);
         return 0;
     }else{
-        if(mfs_followPath(fd, sblock, command[argc - 1], &target, 0) == -1){
+        targetPath = strdup(command[argc - 1]);
+        if(targetPath == NULL){
+            perror("mfs_mv strdup");
+            return -1;
+        }
+        if(mfs_followPath(mnt, targetPath, &target, 0) == -1){
             fprintf(stderr,"%s does not exist.\n", command[argc - 1]);
+            free(targetPath);
             return -1;
         }
+        free(targetPath);
     }
-    for(i = 2 + iFlag; i < argc - 1; i++){
+    for(i = 2 - iFlag; i < argc - 1; i++){
         if(command[i][0] == '/'){
-            mfs_findInode(fd, sblock, 1, &sourceDir);
+            mfs_findInode(mnt, 1, &sourceDir);
         }else{
             memcpy(&sourceDir, curDir, sizeof(inode));
         }
 
         sourcePath = mfs_extractPath(command[i]);
-        if(mfs_followPath(fd, sblock, sourcePath, &sourceDir, 0) == -1){
+        sourceName = mfs_extractFilename(command[i]);
+        if(sourceName == NULL){
+            fprintf(stderr, "No filename given.\n");
+            free(sourcePath);
+            continue;
+        }
+        if(sourcePath[0] == '\0') strcpy(sourcePath, "/");
+        if(mfs_followPath(mnt, sourcePath, &sourceDir, 0) == -1){
             fprintf(stderr, "Source directory does not exist.\n");
+            free(sourcePath);
             continue;
         }
-        if(mfs_followPath(fd, sblock, command[i], &source, 1) == -1){
+        free(sourcePath);
+        memcpy(&source, &sourceDir, sizeof(inode));
+        if(mfs_followPath(mnt, sourceName, &source, 1) == -1){
             fprintf(stderr, "Source does not exist.\n");
             continue;
         }
         if(!iFlag){
-            printf("Move %s to %s? (y/n) ", command[i], command[argc - 1]);
+            printf("Move %s to %s? (y/n) ", sourceName, command[argc - 1]);
             c = getcharSilent();
             while(c != 'y' && c != 'n'){
                 c = getcharSilent();
@@ -1855,89 +1511,135 @@ int mfs_move(char ** command, int fd, mfs_superblock sblock, int argc, inode *cu
             putchar(c);
         }
         if(iFlag || c == 'y'){
-            if(mfs_insertEntry(fd, &sblock, target, source, command[argc - 1]) != -1){
-                if(mfs_clearEntry(fd, sblock, sourceDir, source) == -1){
+            if(mfs_insertEntry(mnt, &target, &source, sourceName) != -1 &&
+               mfs_findInode(mnt, sourceDir.node_id, &sourceDir) != -1){
+                if(mfs_clearEntry(mnt, &sourceDir, &source) == -1){
                     fprintf(stderr, "Failed to clear entry. Possible duplicate entries\n");
                 }
             }
         }
     }
-    free(sourcePath);
     return 0;
 }
 
-int mfs_clearEntry(int fd, mfs_superblock sblock, inode dir, inode toClear){
-    char            *buffer;
-    int             i = 0;
-    int             curOffset, offset;
-    directory_entry entry;
+void mfs_statsBegin(){
+    memcpy(&statsBefore, &mfs_counters, sizeof(mfs_stats));
+    statsStart = mfs_clock();
+}
 
-    buffer = malloc(sblock.block_size);
-    if(buffer == NULL){
-        perror("mfs_clearEntry malloc");
-        return -1;
-    }
+void mfs_statsEnd(int commandType){
+    if(commandType < 0) return;
+    mfs_histRecord(&statsLatency[commandType], mfs_clock() - statsStart);
+    if(commandType == STATS || commandType == LATENCY) return;
+    mfs_statsDiff(&statsLast, &mfs_counters, &statsBefore);
+    mfs_statsAdd(&statsCommand[commandType], &statsLast);
+}
 
-    while(dir.datablocks[i] != 0){
-        if(lseek(fd, dir.datablocks[i] * sblock.block_size, SEEK_SET) == -1){
-            perror("mfs_clearEntry seek");
-            free(buffer);
-            return -1;
-        }
-        if(read(fd, buffer, sblock.block_size) < sblock.block_size){
-            perror("mfs_clearEntry read");
-            free(buffer);
+int mfs_statsCommand(char **command, int argc){
+    int         i;
+    mfs_stats   total;
+
+    if(argc == 2){
+        if(strcmp(command[1], "reset")){
+            fprintf(stderr, "mfs_stats: Invalid argument.\n");
             return -1;
         }
-        memcpy(&offset, buffer, 4);
-        curOffset = 4;
-        while(curOffset < offset){
-            memcpy(&entry, buffer + curOffset, sizeof(directory_entry));
-            if(entry.inodeptr == toClear.node_id){
-                entry.inodeptr = 0;
-                memcpy(buffer + curOffset, &entry, sizeof(directory_entry));
-                if(lseek(fd, dir.datablocks[i] * sblock.block_size, SEEK_SET) == -1){
-                    perror("mfs_clearEntry seek");
-                    free(buffer);
-                    return -1;
-                }
-                if(write(fd, buffer, sblock.block_size) < sblock.block_size){
-                    perror("mfs_clearEntry write");
-                    free(buffer);
-                    return -1;
-                }
-                return 0;
-            }
-            curOffset += entry.rec_len;
+        memset(&statsLast, 0, sizeof(mfs_stats));
+        memset(statsCommand, 0, sizeof(statsCommand));
+        return 0;
+    }
+
+    memset(&total, 0, sizeof(mfs_stats));
+    mfs_statsPrint(stdout, "last", &statsLast);
+    for(i = 0; i < COMMAND_COUNT; i++){
+        if(!mfs_statsEmpty(&statsCommand[i])){
+            mfs_statsPrint(stdout, COMMAND_NAMES[i], &statsCommand[i]);
+            mfs_statsAdd(&total, &statsCommand[i]);
         }
-        i++;
     }
+    mfs_statsPrint(stdout, "total", &total);
 
-    return -1;
+    return 0;
 }
 
-char* mfs_extractPath(char *buffer){
-    int     len, i, flag = -1;
-    char    *path;
+int mfs_statsDump(const char *path){
+    int         i;
+    FILE        *out;
+    mfs_stats   total;
 
-    len = strlen(buffer);
-    path = malloc(len + 1);
+    out = fopen(path, "w");
+    if(out == NULL){
+        perror("mfs_statsDump fopen");
+        return -1;
+    }
+
+    memset(&total, 0, sizeof(mfs_stats));
+    fprintf(out, "{\"commands\": {");
+    for(i = 0; i < COMMAND_COUNT; i++){
+        if(i) fprintf(out, ", ");
+        mfs_statsJson(out, COMMAND_NAMES[i], &statsCommand[i]);
+        mfs_statsAdd(&total, &statsCommand[i]);
+    }
+    fprintf(out, "}, ");
+    mfs_statsJson(out, "total", &total);
+    fprintf(out, ", \"latency\": ");
+    mfs_latencyJson(out);
+    fprintf(out, "}\n");
+
+    fclose(out);
+    return 0;
+}
 
-    i = len - 1;
-    while(i >= 0){
-        if(!flag){
-            path[i] = buffer[i];
-        }else if(buffer[i] == '/'){
-            flag = 0;
-            path[i] = '\0';
+int mfs_latencyCommand(char **command, int argc){
+    int     i;
+    FILE    *out;
+
+    if(argc == 2 && !strcmp(command[1], "reset")){
+        memset(statsLatency, 0, sizeof(statsLatency));
+        memset(mfs_primitiveLatency, 0, sizeof(mfs_histogram) * HIST_PRIMITIVES);
+        return 0;
+    }else if(argc == 3 && !strcmp(command[1], "-j")){
+        out = fopen(command[2], "w");
+        if(out == NULL){
+            perror("mfs_latency fopen");
+            return -1;
         }
-        i--;
+        mfs_latencyJson(out);
+        fprintf(out, "\n");
+        fclose(out);
+        return 0;
+    }else if(argc != 1){
+        fprintf(stderr, "mfs_latency: Invalid argument.\n");
+        return -1;
     }
 
-    if(flag){
-        path[0] = '.';
-        path[1] = '\0';
+    printf("%-15s %8s %10s %10s %10s %10s\n", "(us)", "count", "p50", "p99", "p999",
+           "max");
+    for(i = 0; i < COMMAND_COUNT; i++){
+        if(statsLatency[i].count) mfs_histPrint(stdout, COMMAND_NAMES[i],
+                                                &statsLatency[i]);
+    }
+    for(i = 0; i < HIST_PRIMITIVES; i++){
+        if(mfs_primitiveLatency[i].count){
+            mfs_histPrint(stdout, HIST_PRIMITIVE_NAMES[i], &mfs_primitiveLatency[i]);
+        }
     }
 
-    return path;
+    return 0;
 }
+
+void mfs_latencyJson(FILE *out){
+    int i;
+
+    fprintf(out, "{\"commands\": {");
+    for(i = 0; i < COMMAND_COUNT; i++){
+        if(i) fprintf(out, ", ");
+        mfs_histJson(out, COMMAND_NAMES[i], &statsLatency[i]);
+    }
+    fprintf(out, "}, \"primitives\": {");
+    for(i = 0; i < HIST_PRIMITIVES; i++){
+        if(i) fprintf(out, ", ");
+        mfs_histJson(out, HIST_PRIMITIVE_NAMES[i], &mfs_primitiveLatency[i]);
+    }
+    fprintf(out, "}}");
+}
\ No newline at end of file
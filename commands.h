@@ -2,6 +2,7 @@
 #define _COMMANDS_H_
 
 #define COMMAND_SIZE 4096
+#define MFS_STREAM_BLOCKS 1024
 
 #define WORKWITH 0
 #define LS 1
@@ -16,8 +17,25 @@
 #define EXPORT 10
 #define CAT 11
 #define CREATE 12
-
-#include "filesystem.h"
+#define STATS 13
+#define LATENCY 14
+#define COMPACT 15
+#define DEFRAG 16
+#define RESIZE 17
+
+#define COMMAND_COUNT 18
+
+#include "libmfs.h"
+#include "stats.h"
+#include "defrag.h"
+#include "dedup.h"
+#include "compress.h"
+#include "overlay.h"
+#include "resize.h"
+#include "walk.h"
+
+/* Scratch memory for the command being run, reset after every command. */
+extern mfs_arena commandArena;
 
 int readCommand(char *command);
 
@@ -25,82 +43,73 @@ char** splitCommand(int wordCount, char *command, int *commandType);
 
 int isValidCommand(char *command, int wordCount);
 
-int mfs_workwith(char **command, mfs_superblock *sblock, int *fd, char *fs,
-                 inode *root);
+int mfs_commandLock(int commandType);
+
+int mfs_workwith(char **command, mfs_mount **mnt, char *fs, inode *root);
 
 int get_filename(char *dest, char *source);
 
-int mfs_ls(char **command, int fd, mfs_superblock sblock, int argc, inode *curDir);
+int mfs_ls(char **command, mfs_mount *mnt, int argc, inode *curDir);
 
 int mfs_cp();
 
-int mfs_mv(char ** command, int fd, mfs_superblock sblock, int argc, inode *curDir);
+int mfs_mv(char ** command, mfs_mount *mnt, int argc, inode *curDir);
 
 int mfs_rm();
 
-int mfs_mkdir(int fd, mfs_superblock *sblock, char **command, inode curDir,
-              int argc);
-
-int mfs_touch(char **command, int fd, mfs_superblock sblock, int argc, inode *curDir);
-
-int mfs_import(char **command, int fd, mfs_superblock *sblock, inode *curDir, int argc);
-
-int mfs_copyFromFile(int fd, int toCopy, mfs_superblock *sblock, __u32 *blockNo,
-                     __u32 *grDescNo, __u32 limit, __u32 reqBlocks, __u32 *array,
-                     __u32 prevLimit, __u64 file_size);
-
-int mfs_insertEntry(int fd, mfs_superblock *sblock, inode folder, inode toInsert,
-                    char *path);
-
-char* mfs_extractFilename(char *path);
+int mfs_mkdirCommand(char **command, mfs_mount *mnt, inode *curDir, int argc);
 
-int mfs_writeInode(int fd, inode *toInsert, mfs_superblock sblock, __u32 blockNo,
-                   __u32 grDescNo, __u32 pos, int mode);
+int mfs_touch(char **command, mfs_mount *mnt, int argc, inode *curDir);
 
-int mfs_writeData(int fd, char *toCopy, mfs_superblock sblock, __u32 blockNo,
-                  __u32 grDescNo, __u32 *datablocks, __u32 pos, __u32 dataIndex);
+int mfs_import(char **command, mfs_mount *mnt, inode *curDir, int argc);
 
-void mfs_write_error(char *buffer1, char *buffer2, int errorType);
+int mfs_copyFromFile(mfs_mount *mnt, int toCopy, inode *file, char *buffer);
 
-int mfs_followPath(int fd, mfs_superblock sblock, char *path, inode *ptr, int mode);
+/* Imports a pipe or other stream whose size is not known up front. The data
+ * is collected MFS_STREAM_BLOCKS blocks at a time before any block of it is
+ * allocated. */
+int mfs_importStream(mfs_mount *mnt, inode *folder, int toCopy, char *filename);
 
-int mfs_findEntry(int fd, mfs_superblock sblock, inode curFolder, char *name,
-                  int file_type);
+/* Imports standard input as dir/filename of image, without a login. */
+int mfs_importStdin(char *image, char *dir, char *filename);
 
-int mfs_findInode(int fd, mfs_superblock sblock, __u32 inodeptr, inode *requested);
+int mfs_export(char **command, mfs_mount *mnt, inode *curDir, int argc);
 
-int mfs_findFree(int fd, __u32 *blockNo, __u32 *grDescNo, mfs_superblock *sblock,
-                 int mode);
+int mfs_cat(char **command, mfs_mount *mnt, inode *curDir, int argc);
 
-void mfs_setBit(char *buffer, __u32 index);
+int mfs_compactCommand(char **command, mfs_mount *mnt, inode *curDir, int argc);
 
-__u32 mfs_fzeroBit(int fd, mfs_superblock sblock, __u32 offset);
+int mfs_defragCommand(char **command, mfs_mount *mnt, inode *curDir, int argc);
 
-int mfs_newGroupDescriptor(int fd, mfs_superblock *sblock, __u32 *blockNo,
-                           __u32 *grDescNo, group_linker *grlink, __u32 pos);
+int mfs_defragDir(mfs_mount *mnt, inode *dir, char *path, __u64 deadline, __u32 *counts);
 
-int mfs_export(char **command, int fd, mfs_superblock sblock, inode *curDir, int argc);
+int mfs_defragReport(mfs_mount *mnt, inode *file, char *path, __u32 *counts);
 
-void mfs_export_clean(char *buffer, __u32 *array1, __u32 *array2, __u32 *array3);
-
-int mfs_read(int fd, mfs_superblock sblock, char *buffer, __u32 block);
-
-int mfs_cat();
+/* mfs_resize N sets the number of block groups, +N and -N add or remove N. */
+int mfs_resizeCommand(char **command, mfs_mount *mnt, int argc);
 
 int mfs_create(char **command, int argc);
 
 int mfs_validFilename(char *filename);
 
+int mfs_parseFeatures(char *list, __u32 *features);
+
 void mfs_checkValues(__u32 *bsize, __u32 *fname, __u64 *fsize, __u32 *dir);
 
 void mfs_create_error(char *path, char *buffer, int fd);
 
 void mfs_goUp(char *buffer);
 
-int mfs_ls(char **command, int fd, mfs_superblock sblock, int argc, inode *curDir);
+void mfs_statsBegin();
+
+void mfs_statsEnd(int commandType);
+
+int mfs_statsCommand(char **command, int argc);
+
+int mfs_statsDump(const char *path);
 
-int mfs_clearEntry(int fd, mfs_superblock sblock, inode dir, inode toClear);
+int mfs_latencyCommand(char **command, int argc);
 
-char* mfs_extractPath(char *buffer);
+void mfs_latencyJson(FILE *out);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,302 @@
+#define _LARGEFILE64_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "compress.h"
+#include "dedup.h"
+
+#define MFS_LZ_MIN_MATCH        4
+#define MFS_LZ_HASH_BITS        12
+#define MFS_LZ_MAX_OFFSET       65535
+/* The last match must end this many bytes before the end of the input. */
+#define MFS_LZ_END              5
+
+/* A sequence is a token, literals and a match: the token holds the literal
+ * count and the match length - MFS_LZ_MIN_MATCH, 4 bits each, a value of 15
+ * being continued in bytes of 255 and a last byte below it. The match offset
+ * follows the literals as 2 bytes, low first. The last sequence has no match. */
+static __u32 mfs_lzHash(__u32 value){
+    return (value * 2654435761U) >> (32 - MFS_LZ_HASH_BITS);
+}
+
+static unsigned char* mfs_lzLength(unsigned char *op, __u32 length){
+    for(; length >= 255; length -= 255) *op++ = 255;
+    *op++ = length;
+    return op;
+}
+
+static unsigned char* mfs_lzSequence(unsigned char *op, unsigned char *end,
+                                     const unsigned char *literals, __u32 count,
+                                     __u32 offset, __u32 match){
+    unsigned char   *token;
+
+    if((size_t) (end - op) < 1 + count / 255 + 1 + count + 2 + match / 255 + 1){
+        return NULL;
+    }
+    token = op++;
+    *token = (count < 15 ? count : 15) << 4;
+    if(count >= 15) op = mfs_lzLength(op, count - 15);
+    memcpy(op, literals, count);
+    op += count;
+    if(offset == 0) return op;
+
+    *op++ = offset & 0xff;
+    *op++ = offset >> 8;
+    match -= MFS_LZ_MIN_MATCH;
+    *token |= match < 15 ? match : 15;
+    if(match >= 15) op = mfs_lzLength(op, match - 15);
+
+    return op;
+}
+
+__u32 mfs_lzCompress(const char *src, __u32 size, char *dst, __u32 capacity){
+    __u32               table[1 << MFS_LZ_HASH_BITS], ip = 0, anchor = 0, cand, length;
+    __u32               value, slot, misses = 0;
+    const unsigned char *in = (const unsigned char *) src;
+    unsigned char       *op = (unsigned char *) dst, *end = op + capacity;
+
+    memset(table, 0, sizeof(table));
+    while(size > 2 * MFS_LZ_END + MFS_LZ_MIN_MATCH &&
+          ip < size - 2 * MFS_LZ_END - MFS_LZ_MIN_MATCH){
+        memcpy(&value, in + ip, sizeof(__u32));
+        slot = mfs_lzHash(value);
+        cand = table[slot];
+        table[slot] = ip;
+        if(cand >= ip || ip - cand > MFS_LZ_MAX_OFFSET ||
+           memcmp(in + cand, in + ip, MFS_LZ_MIN_MATCH)){
+            /* Skip faster through data that does not compress. */
+            ip += 1 + (misses++ >> 6);
+            continue;
+        }
+        misses = 0;
+
+        while(ip > anchor && cand > 0 && in[ip - 1] == in[cand - 1]){
+            ip--;
+            cand--;
+        }
+        for(length = MFS_LZ_MIN_MATCH; ip + length < size - MFS_LZ_END &&
+            in[cand + length] == in[ip + length]; length++);
+
+        op = mfs_lzSequence(op, end, in + anchor, ip - anchor, ip - cand, length);
+        if(op == NULL) return 0;
+        ip += length;
+        anchor = ip;
+    }
+
+    op = mfs_lzSequence(op, end, in + anchor, size - anchor, 0, 0);
+    if(op == NULL) return 0;
+
+    return op - (unsigned char *) dst;
+}
+
+static int mfs_lzRead(const unsigned char *in, __u32 size, __u32 *ip, __u32 *length){
+    unsigned char   byte;
+
+    do{
+        if(*ip >= size) return -1;
+        byte = in[(*ip)++];
+        *length += byte;
+    }while(byte == 255);
+
+    return 0;
+}
+
+int mfs_lzDecompress(const char *src, __u32 size, char *dst, __u32 capacity){
+    __u32               ip = 0, op = 0, count, offset, length, i;
+    unsigned char       token;
+    const unsigned char *in = (const unsigned char *) src;
+    unsigned char       *out = (unsigned char *) dst;
+
+    while(ip < size){
+        token = in[ip++];
+        count = token >> 4;
+        if(count == 15 && mfs_lzRead(in, size, &ip, &count) == -1) return -1;
+        if(count > size - ip || count > capacity - op) return -1;
+        memcpy(out + op, in + ip, count);
+        ip += count;
+        op += count;
+        if(ip == size) break;
+
+        if(size - ip < 2) return -1;
+        offset = in[ip] | in[ip + 1] << 8;
+        ip += 2;
+        length = token & 15;
+        if(length == 15 && mfs_lzRead(in, size, &ip, &length) == -1) return -1;
+        length += MFS_LZ_MIN_MATCH;
+        if(offset == 0 || offset > op || length > capacity - op) return -1;
+        if(offset >= length){
+            memcpy(out + op, out + op - offset, length);
+        }else{
+            for(i = 0; i < length; i++) out[op + i] = out[op - offset + i];
+        }
+        op += length;
+    }
+
+    return op;
+}
+
+void mfs_compressPrepare(mfs_mount *mnt, inode *file){
+    if((mnt->sblock.feature_incompat & MFS_FEATURE_COMPRESS) &&
+       !(file->mode & MFS_MODE_INLINE)){
+        file->mode |= MFS_MODE_COMPRESS;
+    }
+}
+
+int mfs_clusterStore(mfs_blockmap *map, __u64 cluster, char *data, __u32 size,
+                     __u32 *physical){
+    int         err = 0;
+    char        *packed, *from = data;
+    __u32       blocks, stored, length = 0, i;
+    __u64       first = cluster * MFS_CLUSTER_BLOCKS;
+    mfs_mount   *mnt = map->mnt;
+
+    blocks = (size + mnt->blockMask) >> mnt->blockShift;
+    stored = blocks;
+    packed = mfs_blockGet((size_t) blocks << mnt->blockShift);
+    if(packed == NULL){
+        perror("mfs_clusterStore malloc");
+        return -1;
+    }
+
+    /* Only worth it when at least one block is saved. */
+    if(blocks > 1){
+        length = mfs_lzCompress(data, size, packed + sizeof(__u32),
+                                ((blocks - 1) << mnt->blockShift) - sizeof(__u32));
+    }
+    if(length){
+        memcpy(packed, &length, sizeof(__u32));
+        stored = (length + sizeof(__u32) + mnt->blockMask) >> mnt->blockShift;
+        memset(packed + sizeof(__u32) + length, 0,
+               ((size_t) stored << mnt->blockShift) - sizeof(__u32) - length);
+        from = packed;
+    }
+    for(i = 0; i < stored && !err; i++){
+        if(mfs_dedupStore(map, first + i, physical,
+                          from + ((size_t) i << mnt->blockShift)) == -1){
+            err = -1;
+        }
+    }
+
+    mfs_blockPut(packed, (size_t) blocks << mnt->blockShift);
+    return err;
+}
+
+static int mfs_clusterRead(mfs_blockmap *map, __u64 logical, __u32 count, char *buffer){
+    __u32   physical, run;
+
+    for(; count > 0; count -= run, logical += run){
+        if(mfs_mapRun(map, logical, count, &physical, &run) == -1) return -1;
+        if(physical == 0){
+            memset(buffer, 0, (size_t) run << map->mnt->blockShift);
+        }else if(mfs_readBlocks(map->mnt, buffer, physical, run) == -1){
+            return -1;
+        }
+        buffer += (size_t) run << map->mnt->blockShift;
+    }
+
+    return 0;
+}
+
+int mfs_clusterLoad(mfs_blockmap *map, __u64 cluster, char *data, __u32 size){
+    int         err = 0;
+    char        *packed;
+    __u32       blocks, stored, length, last;
+    __u64       first = cluster * MFS_CLUSTER_BLOCKS;
+    mfs_mount   *mnt = map->mnt;
+
+    blocks = (size + mnt->blockMask) >> mnt->blockShift;
+    if(mfs_mapResolve(map, first + blocks - 1, &last, NULL) == -1) return -1;
+    if(last != 0) return mfs_clusterRead(map, first, blocks, data);
+
+    packed = mfs_blockGet((size_t) blocks << mnt->blockShift);
+    if(packed == NULL){
+        perror("mfs_clusterLoad malloc");
+        return -1;
+    }
+    if(mfs_clusterRead(map, first, 1, packed) == -1){
+        err = -1;
+    }else{
+        memcpy(&length, packed, sizeof(__u32));
+        stored = (length + sizeof(__u32) + mnt->blockMask) >> mnt->blockShift;
+        if(length == 0 || stored >= blocks ||
+           mfs_clusterRead(map, first + 1, stored - 1,
+                           packed + mnt->sblock.block_size) == -1 ||
+           mfs_lzDecompress(packed + sizeof(__u32), length, data, size) != (int) size){
+            fprintf(stderr, "mfs_clusterLoad: cluster %llu is damaged.\n",
+                    (unsigned long long) cluster);
+            err = -1;
+        }
+    }
+
+    mfs_blockPut(packed, (size_t) blocks << mnt->blockShift);
+    return err;
+}
+
+int mfs_compressUnpack(mfs_mount *mnt, inode *file){
+    int                 err = 0;
+    char                *buffer;
+    __u32               size, blocks, physical, i;
+    __u64               cluster, clusters, clusterSize;
+    inode               plain;
+    mfs_blockmap        oldMap, newMap;
+    mfs_extent_header   *hdr;
+
+    if(!(file->mode & MFS_MODE_COMPRESS)) return 0;
+
+    memcpy(&plain, file, sizeof(inode));
+    plain.mode &= ~(MFS_MODE_COMPRESS | MFS_MODE_DEDUP);
+    if(plain.mode & MFS_MODE_EXTENTS){
+        hdr = (mfs_extent_header *) plain.datablocks;
+        hdr->entries = 0;
+        hdr->depth = 0;
+    }else{
+        memset(plain.datablocks, 0, sizeof(plain.datablocks));
+    }
+
+    clusterSize = (__u64) MFS_CLUSTER_BLOCKS << mnt->blockShift;
+    buffer = mfs_blockGet(clusterSize);
+    if(buffer == NULL){
+        perror("mfs_compressUnpack malloc");
+        return -1;
+    }
+    if(mfs_mapInit(&oldMap, mnt, file) == -1){
+        mfs_blockPut(buffer, clusterSize);
+        return -1;
+    }
+    if(mfs_mapInit(&newMap, mnt, &plain) == -1){
+        mfs_mapDestroy(&oldMap);
+        mfs_blockPut(buffer, clusterSize);
+        return -1;
+    }
+
+    clusters = (file->file_size + clusterSize - 1) / clusterSize;
+    for(cluster = 0; cluster < clusters && !err; cluster++){
+        size = clusterSize;
+        if(cluster + 1 == clusters) size = file->file_size - cluster * clusterSize;
+        blocks = (size + mnt->blockMask) >> mnt->blockShift;
+        memset(buffer, 0, (size_t) blocks << mnt->blockShift);
+        if(mfs_clusterLoad(&oldMap, cluster, buffer, size) == -1){
+            err = -1;
+            break;
+        }
+        for(i = 0; i < blocks && !err; i++){
+            if(mfs_mapResolve(&newMap, cluster * MFS_CLUSTER_BLOCKS + i, &physical,
+                              buffer + ((size_t) i << mnt->blockShift)) == -1){
+                err = -1;
+            }
+        }
+    }
+    mfs_mapDestroy(&oldMap);
+    mfs_mapDestroy(&newMap);
+    mfs_blockPut(buffer, clusterSize);
+
+    if(err || mfs_updateInode(mnt, &plain) == -1){
+        mfs_mapRelease(mnt, &plain);
+        return -1;
+    }
+    mfs_mapRelease(mnt, file);
+    memcpy(file, &plain, sizeof(inode));
+
+    return 0;
+}
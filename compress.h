@@ -0,0 +1,38 @@
+#ifndef _COMPRESS_H_
+#define _COMPRESS_H_
+
+#include "filesystem.h"
+
+/* Files with MFS_MODE_COMPRESS are stored in clusters of MFS_CLUSTER_BLOCKS
+ * logical blocks. Cluster c covers logical blocks c * MFS_CLUSTER_BLOCKS on. A
+ * cluster that compresses into fewer blocks than it holds maps only those: the
+ * first starts with the compressed length as a __u32 and the remaining logical
+ * blocks of the cluster are holes. Other clusters are stored as they are. */
+#define MFS_CLUSTER_BLOCKS      16
+
+/* Compresses size bytes of src into dst with a byte-oriented LZ77 codec.
+ * Returns the compressed length, or 0 if it would not fit in capacity. */
+__u32 mfs_lzCompress(const char *src, __u32 size, char *dst, __u32 capacity);
+
+/* Reverses mfs_lzCompress. Returns the length written to dst, or -1 if src is
+ * damaged or does not fit in capacity. */
+int mfs_lzDecompress(const char *src, __u32 size, char *dst, __u32 capacity);
+
+/* Sets MFS_MODE_COMPRESS on a file about to be imported into an image with
+ * MFS_FEATURE_COMPRESS, unless it is stored inline. */
+void mfs_compressPrepare(mfs_mount *mnt, inode *file);
+
+/* Stores size bytes of data as cluster of the file of map. data must hold
+ * whole blocks, zero padded after size. physical is set to the last block
+ * written. */
+int mfs_clusterStore(mfs_blockmap *map, __u64 cluster, char *data, __u32 size,
+                     __u32 *physical);
+
+/* Reads cluster, which holds size bytes of the file, into data, which must hold
+ * whole blocks. */
+int mfs_clusterLoad(mfs_blockmap *map, __u64 cluster, char *data, __u32 size);
+
+/* Rewrites a compressed file uncompressed, so it can be written in place. */
+int mfs_compressUnpack(mfs_mount *mnt, inode *file);
+
+#endif
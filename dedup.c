@@ -0,0 +1,245 @@
+#define _LARGEFILE64_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "dedup.h"
+#include "defrag.h"
+
+#define MFS_PRIME32_1   0x9e3779b1U
+#define MFS_PRIME32_2   0x85ebca77U
+#define MFS_PRIME64_1   0x9e3779b185ebca87ULL
+#define MFS_PRIME64_2   0xc2b2ae3d27d4eb4fULL
+
+/* Eight lanes of 32 bits, processed together with SIMD instructions. */
+typedef __u32 mfs_lanes __attribute__((vector_size(32)));
+
+__u64 mfs_hashBlock(const char *data, __u32 size){
+    __u32       i;
+    __u64       hash = size;
+    mfs_lanes   lane, acc = {MFS_PRIME32_1, MFS_PRIME32_2, 1, 2, 3, 4, 5, 6};
+
+    for(i = 0; i + sizeof(mfs_lanes) <= size; i += sizeof(mfs_lanes)){
+        memcpy(&lane, data + i, sizeof(mfs_lanes));
+        acc += lane * MFS_PRIME32_2;
+        acc = (acc << 13) | (acc >> 19);
+        acc *= MFS_PRIME32_1;
+    }
+    for(i = 0; i < 8; i++){
+        hash = (hash ^ acc[i]) * MFS_PRIME64_1;
+        hash = (hash << 27) | (hash >> 37);
+    }
+    hash ^= hash >> 33;
+    hash *= MFS_PRIME64_2;
+    hash ^= hash >> 29;
+
+    return hash;
+}
+
+static int mfs_dedupLoad(mfs_mount *mnt){
+    size_t      size;
+    mfs_dedup   *dedup;
+
+    if(mnt->dedup != NULL) return 0;
+    if(!(mnt->sblock.feature_incompat & MFS_FEATURE_DEDUP) ||
+       mnt->sblock.dedup_blocks == 0){
+        return -1;
+    }
+
+    size = (size_t) mnt->sblock.dedup_blocks << mnt->blockShift;
+    dedup = malloc(sizeof(mfs_dedup));
+    if(dedup == NULL){
+        perror("mfs_dedupLoad malloc");
+        return -1;
+    }
+    dedup->table = malloc(size);
+    dedup->dirty = calloc(mnt->sblock.dedup_blocks, 1);
+    if(dedup->table == NULL || dedup->dirty == NULL){
+        perror("mfs_dedupLoad malloc");
+        free(dedup->table);
+        free(dedup->dirty);
+        free(dedup);
+        return -1;
+    }
+    if(mfs_readBlocks(mnt, (char *) dedup->table, mnt->sblock.dedup_block,
+                      mnt->sblock.dedup_blocks) == -1){
+        free(dedup->table);
+        free(dedup->dirty);
+        free(dedup);
+        return -1;
+    }
+    dedup->mask = size / sizeof(mfs_fingerprint) - 1;
+    mnt->dedup = dedup;
+
+    return 0;
+}
+
+static void mfs_dedupTouch(mfs_mount *mnt, __u32 slot){
+    mnt->dedup->dirty[(slot * sizeof(mfs_fingerprint)) >> mnt->blockShift] = 1;
+}
+
+/* Slot of a block with the contents of data, compared byte by byte, or -1. */
+static int mfs_dedupFind(mfs_mount *mnt, __u64 hash, char *data, __u32 *slot){
+    int             found = 0;
+    char            *buffer;
+    __u32           i, cur;
+    mfs_fingerprint *fp;
+
+    buffer = mfs_blockGet(mnt->sblock.block_size);
+    if(buffer == NULL){
+        perror("mfs_dedupFind malloc");
+        return -1;
+    }
+
+    for(i = 0; i < MFS_DEDUP_PROBE && !found; i++){
+        cur = (hash + i) & mnt->dedup->mask;
+        fp = &mnt->dedup->table[cur];
+        if(fp->block == 0) break;
+        if(fp->block == MFS_DEDUP_REMOVED || fp->hash != hash) continue;
+        if(mfs_read(mnt, buffer, fp->block) == -1){
+            found = -1;
+            break;
+        }
+        if(!memcmp(buffer, data, mnt->sblock.block_size)){
+            *slot = cur;
+            found = 1;
+        }
+    }
+
+    mfs_blockPut(buffer, mnt->sblock.block_size);
+    return found;
+}
+
+/* A block that finds no free slot near its hash is simply not indexed. */
+static void mfs_dedupInsert(mfs_mount *mnt, __u64 hash, __u32 block){
+    __u32           i, cur;
+    mfs_fingerprint *fp;
+
+    for(i = 0; i < MFS_DEDUP_PROBE; i++){
+        cur = (hash + i) & mnt->dedup->mask;
+        fp = &mnt->dedup->table[cur];
+        if(fp->block == 0 || fp->block == MFS_DEDUP_REMOVED){
+            fp->hash = hash;
+            fp->block = block;
+            fp->refs = 1;
+            mfs_dedupTouch(mnt, cur);
+            return;
+        }
+    }
+}
+
+int mfs_dedupStore(mfs_blockmap *map, __u64 logical, __u32 *physical, char *data){
+    int         found, err;
+    __u32       slot = 0;
+    __u64       hash;
+    mfs_mount   *mnt = map->mnt;
+
+    if(!(mnt->sblock.feature_incompat & MFS_FEATURE_DEDUP) || mfs_dedupLoad(mnt) == -1){
+        return mfs_mapResolve(map, logical, physical, data);
+    }
+
+    map->file->mode |= MFS_MODE_DEDUP;
+    hash = mfs_hashBlock(data, mnt->sblock.block_size);
+    found = mfs_dedupFind(mnt, hash, data, &slot);
+    if(found == -1) return -1;
+    if(found) map->link = mnt->dedup->table[slot].block;
+
+    err = mfs_mapResolve(map, logical, physical, data);
+    map->link = 0;
+    if(err != 1) return err;
+
+    if(found){
+        mnt->dedup->table[slot].refs++;
+        mfs_dedupTouch(mnt, slot);
+    }else{
+        mfs_dedupInsert(mnt, hash, *physical);
+    }
+
+    return 1;
+}
+
+int mfs_dedupFree(mfs_mount *mnt, __u32 block, __u32 count){
+    int             err = 0;
+    char            *buffer;
+    __u32           i, j, cur, start = 0, run = 0;
+    __u64           hash;
+    mfs_fingerprint *fp;
+
+    if(mfs_dedupLoad(mnt) == -1) return mfs_freeBlocks(mnt, block, count);
+    buffer = mfs_blockGet(mnt->sblock.block_size);
+    if(buffer == NULL){
+        perror("mfs_dedupFree malloc");
+        return -1;
+    }
+
+    /* Blocks are found by their contents, which do not change while shared. */
+    for(i = block; i < block + count && !err; i++){
+        if(mfs_read(mnt, buffer, i) == -1){
+            err = -1;
+            break;
+        }
+        hash = mfs_hashBlock(buffer, mnt->sblock.block_size);
+        for(j = 0; j < MFS_DEDUP_PROBE; j++){
+            cur = (hash + j) & mnt->dedup->mask;
+            fp = &mnt->dedup->table[cur];
+            if(fp->block == 0 || fp->block == i) break;
+        }
+        if(j < MFS_DEDUP_PROBE && fp->block == i){
+            mfs_dedupTouch(mnt, cur);
+            if(--fp->refs > 0) continue;
+            fp->block = MFS_DEDUP_REMOVED;
+        }
+
+        if(run && start + run == i){
+            run++;
+            continue;
+        }
+        if(run) err = mfs_freeBlocks(mnt, start, run);
+        start = i;
+        run = 1;
+    }
+    if(!err && run) err = mfs_freeBlocks(mnt, start, run);
+
+    mfs_blockPut(buffer, mnt->sblock.block_size);
+    return err;
+}
+
+int mfs_dedupUnshare(mfs_mount *mnt, inode *file){
+    __u32   runs;
+    __u64   blocks;
+
+    if(!(file->mode & MFS_MODE_DEDUP)) return 0;
+    if(mfs_fragments(mnt, file, &runs, &blocks) == -1) return -1;
+
+    return mfs_moveFile(mnt, file, blocks, 0) == -1 ? -1 : 0;
+}
+
+int mfs_dedupFlush(mfs_mount *mnt){
+    char    *table;
+    __u32   i, run;
+
+    if(mnt->dedup == NULL) return 0;
+    for(i = 0; i < mnt->sblock.dedup_blocks; i += run){
+        for(run = 0; i + run < mnt->sblock.dedup_blocks && mnt->dedup->dirty[i + run];
+            run++);
+        if(run == 0){
+            run = 1;
+            continue;
+        }
+        table = (char *) mnt->dedup->table + ((size_t) i << mnt->blockShift);
+        if(mfs_writeBlocks(mnt, table, mnt->sblock.dedup_block + i, run) == -1){
+            return -1;
+        }
+        memset(mnt->dedup->dirty + i, 0, run);
+    }
+
+    return 0;
+}
+
+void mfs_dedupDrop(mfs_mount *mnt){
+    if(mnt->dedup == NULL) return;
+    free(mnt->dedup->table);
+    free(mnt->dedup->dirty);
+    free(mnt->dedup);
+    mnt->dedup = NULL;
+}
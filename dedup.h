@@ -0,0 +1,50 @@
+#ifndef _DEDUP_H_
+#define _DEDUP_H_
+
+#include "filesystem.h"
+
+/* Size of the fingerprint table of an image created with -o dedup. */
+#define MFS_DEDUP_TABLE_SIZE    (1 << 20)
+#define MFS_DEDUP_PROBE         64
+#define MFS_DEDUP_REMOVED       0xffffffff
+
+/* One slot of the fingerprint table: a data block, the hash of its contents
+ * and the number of file blocks that map it. Empty slots have block 0, slots
+ * whose block was released MFS_DEDUP_REMOVED. */
+typedef struct{
+    __u64           hash;
+    __u32           block;
+    __u32           refs;
+}mfs_fingerprint;
+
+/* The table of a mount, read on first use. Changed table blocks are written
+ * back by mfs_dedupFlush when the write lock is released. */
+typedef struct mfs_dedup{
+    mfs_fingerprint *table;
+    __u32           mask;
+    char            *dirty;
+}mfs_dedup;
+
+/* 64-bit hash of one block, computed over eight 32-bit lanes at a time. */
+__u64 mfs_hashBlock(const char *data, __u32 size);
+
+/* mfs_mapResolve for a new block of a file being imported. In an image with
+ * MFS_FEATURE_DEDUP a block with the same contents is shared instead of
+ * writing a new one, and new blocks are entered in the table. */
+int mfs_dedupStore(mfs_blockmap *map, __u64 logical, __u32 *physical, char *data);
+
+/* Drops one reference to each of count blocks from block on. Blocks that are
+ * not in the table or lose their last reference are released. */
+int mfs_dedupFree(mfs_mount *mnt, __u32 block, __u32 count);
+
+/* Gives a file with MFS_MODE_DEDUP private copies of its blocks, so they can
+ * be written in place. */
+int mfs_dedupUnshare(mfs_mount *mnt, inode *file);
+
+/* Writes the changed blocks of the table back. */
+int mfs_dedupFlush(mfs_mount *mnt);
+
+/* Throws the table away without writing it. */
+void mfs_dedupDrop(mfs_mount *mnt);
+
+#endif
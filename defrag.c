@@ -0,0 +1,150 @@
+#define _LARGEFILE64_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "defrag.h"
+
+int mfs_fragments(mfs_mount *mnt, inode *file, __u32 *runs, __u64 *blocks){
+    __u32           physical, run, last = 0;
+    __u64           logical, length;
+    mfs_blockmap    map;
+
+    *runs = 0;
+    *blocks = 0;
+    if(file->mode & MFS_MODE_INLINE) return 0;
+    if(mfs_mapInit(&map, mnt, file) == -1) return -1;
+
+    length = (file->file_size + mnt->blockMask) >> mnt->blockShift;
+    if(file->mode & MFS_MODE_TAIL) length--;
+    for(logical = 0; logical < length; logical += run){
+        if(mfs_mapRun(&map, logical, length - logical < MFS_RUN_BLOCKS ?
+                      length - logical : MFS_RUN_BLOCKS, &physical, &run) == -1){
+            mfs_mapDestroy(&map);
+            return -1;
+        }
+        if(physical == 0) continue;
+        if(physical != last) (*runs)++;
+        *blocks += run;
+        last = physical + run;
+    }
+
+    mfs_mapDestroy(&map);
+    return 0;
+}
+
+__u32 mfs_metaBlocks(mfs_mount *mnt, inode *file, __u64 length){
+    __u64   ptrs, meta = 0;
+
+    if(file->mode & (MFS_MODE_EXTENTS | MFS_MODE_INLINE)) return 0;
+
+    ptrs = mnt->sblock.block_size / 4;
+    if(length <= DATABLOCK_NUM - 3) return 0;
+    length -= DATABLOCK_NUM - 3;
+    meta++;
+    if(length <= ptrs) return meta;
+    length -= ptrs;
+    if(length <= ptrs * ptrs) return meta + 1 + (length + ptrs - 1) / ptrs;
+    meta += 1 + ptrs;
+    length -= ptrs * ptrs;
+    meta += 1 + (length + ptrs * ptrs - 1) / (ptrs * ptrs) + (length + ptrs - 1) / ptrs;
+
+    return meta;
+}
+
+int mfs_defragFile(mfs_mount *mnt, inode *file){
+    __u32   runs, meta;
+    __u64   blocks, length;
+
+    /* Moving a deduplicated file would give it private copies of its blocks. */
+    if(MFS_TYPE(file->mode) != 1 || (file->mode & (MFS_MODE_INLINE | MFS_MODE_DEDUP))){
+        return 0;
+    }
+    if(mfs_fragments(mnt, file, &runs, &blocks) == -1) return -1;
+
+    length = (file->file_size + mnt->blockMask) >> mnt->blockShift;
+    if(file->mode & MFS_MODE_TAIL) length--;
+    meta = mfs_metaBlocks(mnt, file, length);
+    if(runs <= 1 + meta) return 0;
+
+    return mfs_moveFile(mnt, file, blocks, 1);
+}
+
+int mfs_moveFile(mfs_mount *mnt, inode *file, __u64 blocks, int whole){
+    int                 err = 0;
+    char                *buffer;
+    __u32               meta, physical, newPhysical, run, i;
+    __u64               length, logical;
+    inode               moved;
+    mfs_blockmap        oldMap, newMap;
+    mfs_extent_header   *hdr;
+
+    length = (file->file_size + mnt->blockMask) >> mnt->blockShift;
+    if(file->mode & MFS_MODE_TAIL) length--;
+    meta = mfs_metaBlocks(mnt, file, length);
+
+    memcpy(&moved, file, sizeof(inode));
+    moved.mode &= ~MFS_MODE_DEDUP;
+    if(moved.mode & MFS_MODE_EXTENTS){
+        hdr = (mfs_extent_header *) moved.datablocks;
+        hdr->entries = 0;
+        hdr->depth = 0;
+    }else{
+        memset(moved.datablocks, 0, (moved.mode & MFS_MODE_TAIL ? MFS_TAIL_BLOCK :
+               DATABLOCK_NUM) * sizeof(__u32));
+    }
+
+    buffer = mfs_blockGet(mnt->sblock.block_size * MFS_RUN_BLOCKS);
+    if(buffer == NULL){
+        perror("mfs_moveFile malloc");
+        return -1;
+    }
+    if(mfs_mapInit(&oldMap, mnt, file) == -1){
+        mfs_blockPut(buffer, mnt->sblock.block_size * MFS_RUN_BLOCKS);
+        return -1;
+    }
+    if(mfs_mapInit(&newMap, mnt, &moved) == -1){
+        mfs_mapDestroy(&oldMap);
+        mfs_blockPut(buffer, mnt->sblock.block_size * MFS_RUN_BLOCKS);
+        return -1;
+    }
+    if(mfs_findRun(mnt, blocks + meta, mfs_inodeGoal(mnt, file->node_id),
+                   &newMap.blockNo, &newMap.grDescNo, &newMap.goal) == 0){
+        newMap.goalLeft = blocks + meta;
+    }else if(whole){
+        mfs_mapDestroy(&oldMap);
+        mfs_mapDestroy(&newMap);
+        mfs_blockPut(buffer, mnt->sblock.block_size * MFS_RUN_BLOCKS);
+        return 0;
+    }
+
+    for(logical = 0; logical < length && !err; logical += run){
+        if(mfs_mapRun(&oldMap, logical, length - logical < MFS_RUN_BLOCKS ?
+                      length - logical : MFS_RUN_BLOCKS, &physical, &run) == -1){
+            err = -1;
+            break;
+        }
+        if(physical == 0) continue;
+        if(mfs_readBlocks(mnt, buffer, physical, run) == -1){
+            err = -1;
+            break;
+        }
+        for(i = 0; i < run && !err; i++){
+            err = mfs_mapResolve(&newMap, logical + i, &newPhysical,
+                                 buffer + (size_t) i * mnt->sblock.block_size);
+            if(err > 0) err = 0;
+        }
+    }
+    mfs_mapDestroy(&oldMap);
+    mfs_mapDestroy(&newMap);
+    mfs_blockPut(buffer, mnt->sblock.block_size * MFS_RUN_BLOCKS);
+
+    if(err || mfs_updateInode(mnt, &moved) == -1){
+        mfs_mapRelease(mnt, &moved);
+        return -1;
+    }
+    mfs_mapRelease(mnt, file);
+    memcpy(file, &moved, sizeof(inode));
+
+    return 1;
+}
@@ -0,0 +1,24 @@
+#ifndef _DEFRAG_H_
+#define _DEFRAG_H_
+
+#include "filesystem.h"
+
+/* Counts the physically contiguous runs of data blocks of file and the
+ * number of data blocks it maps. */
+int mfs_fragments(mfs_mount *mnt, inode *file, __u32 *runs, __u64 *blocks);
+
+/* Number of indirect blocks a classic file of the given length needs. */
+__u32 mfs_metaBlocks(mfs_mount *mnt, inode *file, __u64 length);
+
+/* Moves the blocks of file into one free run if it is fragmented. The new
+ * blocks are written first and the inode is switched over with a single write
+ * before the old blocks are released. Returns 1 if the file was moved, 0 if it
+ * did not need or could not get a run. */
+int mfs_defragFile(mfs_mount *mnt, inode *file);
+
+/* Moves file, which maps blocks data blocks, to new blocks the same way,
+ * taking them from one free run when there is one. With whole set, a file that
+ * does not fit a run is left alone and 0 returned. */
+int mfs_moveFile(mfs_mount *mnt, inode *file, __u64 blocks, int whole);
+
+#endif
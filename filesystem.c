@@ -3,150 +3,2369 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include "filesystem.h"
+#include "freemap.h"
+#include "dedup.h"
+#include "overlay.h"
+#include "stats.h"
 
-list_root* mfs_listCreate(){
-    list_root   *root;
+void mfs_arenaInit(mfs_arena *arena, size_t chunkSize){
+    arena->chunks = NULL;
+    arena->chunkSize = chunkSize;
+}
 
-    root = malloc(sizeof(list_root));
-    if(root == NULL){
-        perror("mfs_listCreate malloc");
-    }else{
-        root->size = 0;
-        root->root = NULL;
+void* mfs_arenaAlloc(mfs_arena *arena, size_t size){
+    size_t          chunkSize;
+    mfs_arenaChunk  *chunk = arena->chunks;
+
+    size = (size + 7) & ~(size_t) 7;
+    if(chunk == NULL || chunk->size - chunk->used < size){
+        chunkSize = arena->chunkSize;
+        if(chunkSize < size + sizeof(mfs_arenaChunk)){
+            chunkSize = size + sizeof(mfs_arenaChunk);
+        }
+        chunk = malloc(chunkSize);
+        if(chunk == NULL){
+            perror("mfs_arenaAlloc malloc");
+            return NULL;
+        }
+        chunk->next = arena->chunks;
+        chunk->size = chunkSize;
+        chunk->used = sizeof(mfs_arenaChunk);
+        arena->chunks = chunk;
+    }
+    chunk->used += size;
+
+    return (char *) chunk + chunk->used - size;
+}
+
+char* mfs_arenaStrdup(mfs_arena *arena, const char *string){
+    char    *copy;
+
+    copy = mfs_arenaAlloc(arena, strlen(string) + 1);
+    if(copy != NULL) strcpy(copy, string);
+    return copy;
+}
+
+/* Keeps the newest chunk so that reusing the arena does not go back to malloc. */
+void mfs_arenaReset(mfs_arena *arena){
+    mfs_arenaChunk  *chunk, *next;
+
+    if(arena->chunks == NULL) return;
+    for(chunk = arena->chunks->next; chunk != NULL; chunk = next){
+        next = chunk->next;
+        free(chunk);
+    }
+    arena->chunks->next = NULL;
+    arena->chunks->used = sizeof(mfs_arenaChunk);
+}
+
+void mfs_arenaDestroy(mfs_arena *arena){
+    mfs_arenaChunk  *chunk, *next;
+
+    for(chunk = arena->chunks; chunk != NULL; chunk = next){
+        next = chunk->next;
+        free(chunk);
+    }
+    arena->chunks = NULL;
+}
+
+/* Free block buffers kept per thread, one stack per power of two block size
+ * from 512 bytes up. */
+static __thread void    *mfs_pool[MFS_POOL_CLASSES][MFS_POOL_BLOCKS];
+static __thread int     mfs_poolCount[MFS_POOL_CLASSES];
+
+static int mfs_poolClass(__u32 size){
+    int sizeClass = 0;
+
+    if(size < 512 || (size & (size - 1))) return -1;
+    while((512U << sizeClass) < size) sizeClass++;
+    return sizeClass < MFS_POOL_CLASSES ? sizeClass : -1;
+}
+
+void* mfs_blockGet(__u32 size){
+    int     sizeClass;
+    void    *buffer;
+
+    sizeClass = mfs_poolClass(size);
+    if(sizeClass != -1 && mfs_poolCount[sizeClass] > 0){
+        return mfs_pool[sizeClass][--mfs_poolCount[sizeClass]];
+    }
+    if(posix_memalign(&buffer, MFS_BLOCK_ALIGN, size)){
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    return buffer;
+}
+
+void* mfs_blockZero(__u32 size){
+    void    *buffer;
+
+    buffer = mfs_blockGet(size);
+    if(buffer != NULL) memset(buffer, 0, size);
+    return buffer;
+}
+
+void mfs_blockPut(void *buffer, __u32 size){
+    int     sizeClass;
+
+    if(buffer == NULL) return;
+    sizeClass = mfs_poolClass(size);
+    if(sizeClass != -1 && mfs_poolCount[sizeClass] < MFS_POOL_BLOCKS){
+        mfs_pool[sizeClass][mfs_poolCount[sizeClass]++] = buffer;
+        return;
+    }
+    free(buffer);
+}
+
+void mfs_blockDrain(){
+    int     i;
+
+    for(i = 0; i < MFS_POOL_CLASSES; i++){
+        while(mfs_poolCount[i] > 0) free(mfs_pool[i][--mfs_poolCount[i]]);
+    }
+}
+
+void mfs_listInit(mfs_list *list){
+    list->entries = NULL;
+    list->count = 0;
+    list->size = 0;
+    mfs_arenaInit(&list->names, MFS_ARENA_CHUNK);
+}
+
+int mfs_listAdd(mfs_list *list, inode *toAdd, char *filename, int name_len){
+    int             size;
+    mfs_listEntry   *entries, *entry;
+
+    if(list->count == list->size){
+        size = list->size ? 2 * list->size : 64;
+        entries = realloc(list->entries, size * sizeof(mfs_listEntry));
+        if(entries == NULL){
+            perror("mfs_listAdd realloc");
+            return -1;
+        }
+        list->entries = entries;
+        list->size = size;
+    }
+
+    entry = &list->entries[list->count];
+    entry->name = mfs_arenaAlloc(&list->names, name_len + 1);
+    if(entry->name == NULL) return -1;
+    memcpy(entry->name, filename, name_len);
+    entry->name[name_len] = '\0';
+    entry->file_size = toAdd->file_size;
+    entry->creation_time = toAdd->creation_time;
+    entry->access_time = toAdd->access_time;
+    entry->modification_time = toAdd->modification_time;
+    entry->node_id = toAdd->node_id;
+    entry->mode = toAdd->mode;
+    list->count++;
+
+    return 0;
+}
+
+static int mfs_listByName(const void *a, const void *b){
+    return strcmp(((mfs_listEntry *) a)->name, ((mfs_listEntry *) b)->name);
+}
+
+static int mfs_listByTime(const void *a, const void *b){
+    const mfs_listEntry *x = a, *y = b;
+
+    if(x->creation_time != y->creation_time){
+        return x->creation_time < y->creation_time ? -1 : 1;
+    }
+    return strcmp(x->name, y->name);
+}
+
+void mfs_listSort(mfs_list *list, int byTime){
+    qsort(list->entries, list->count, sizeof(mfs_listEntry),
+          byTime ? mfs_listByTime : mfs_listByName);
+}
+
+void mfs_listPrint(mfs_list *list, int lFlag){
+    int             i;
+    mfs_listEntry   *cur;
+
+    for(i = 0; i < list->count; i++){
+        cur = &list->entries[i];
+        if(lFlag){
+            printf("%s\n", cur->name);
+        }else{
+            printf("%s ct: %u at: %u mt: %u %llu\n", cur->name, cur->creation_time,
+                   cur->access_time, cur->modification_time, cur->file_size);
+        }
     }
+}
 
-    return root;
+void mfs_listDestroy(mfs_list *list){
+    free(list->entries);
+    list->entries = NULL;
+    list->count = 0;
+    list->size = 0;
+    mfs_arenaDestroy(&list->names);
 }
 
-int mfs_listAddNodeAB(list_root *root, inode toAdd, char *filename, int name_len){
-    list_node   *node, *cur;
+/* n / d where recip is 2^32 / d rounded up. The error stays below one for
+ * every n below 2^32 / d, which covers inode and group numbers. */
+static inline __u32 mfs_divide(__u32 n, __u32 recip){
+    return (__u64) n * recip >> 32;
+}
+
+static __u32 mfs_shift(__u32 value){
+    __u32   shift = 0;
+
+    while((1U << shift) < value) shift++;
+    return shift;
+}
+
+void mfs_mountGeometry(mfs_mount *mnt){
+    mnt->blockShift = mfs_shift(mnt->sblock.block_size);
+    mnt->blockMask = mnt->sblock.block_size - 1;
+    mnt->groupShift = mfs_shift(mnt->sblock.inodes_per_group);
+    mnt->groupMask = mnt->sblock.inodes_per_group - 1;
+    mnt->ptrShift = mnt->blockShift - 2;
+    mnt->inodesPerBlock = mnt->sblock.block_size / sizeof(inode);
+    mnt->inodeRecip = (0x100000000ULL + mnt->inodesPerBlock - 1) / mnt->inodesPerBlock;
+    mnt->descPerBlock = (mnt->sblock.block_size - sizeof(group_linker)) /
+                        sizeof(group_descriptor);
+    mnt->descRecip = (0x100000000ULL + mnt->descPerBlock - 1) / mnt->descPerBlock;
+}
+
+/* Policies of mfs_groupPick: a block, an inode near its parent, or an inode
+ * in a group of its own. */
+#define MFS_PICK_BLOCK      0
+#define MFS_PICK_INODE      1
+#define MFS_PICK_SPREAD     2
+
+/* Orders groups for mfs_groupPick, 0 never matches. */
+static __u32 mfs_groupRank(group_descriptor *grDesc, int policy, __u32 total,
+                           __u32 groups){
+    if(policy == MFS_PICK_BLOCK) return grDesc->free_blocks != 0;
+    if(grDesc->free_inodes == 0) return 0;
+    if(policy == MFS_PICK_INODE) return 1 + (grDesc->free_blocks != 0);
+    if((__u64) grDesc->free_inodes * groups < total) return 1;
+    return 2 + grDesc->free_blocks;
+}
+
+/* Chooses the group an allocation starts in from the descriptors alone. The
+ * best ranked group wins, ties go to the first one from group first on,
+ * wrapping around. MFS_PICK_SPREAD ranks groups with at least the average of
+ * free inodes by their free blocks. Only groups whose inode numbers fit in a
+ * node_id take inodes. Without a match the result is the first group, where
+ * mfs_findFree grows the image once all groups are full. */
+static int mfs_groupPick(mfs_mount *mnt, __u32 first, int policy, __u32 *blockNo,
+                         __u32 *grDescNo){
+    int                 pass;
+    __u32               block, group, i, rank, best = 0, bestGroup = 0, total = 0,
+                        groups = 0;
+    char                *buffer;
+    group_linker        link;
+    group_descriptor    grDesc;
 
-    node = malloc(sizeof(list_node));
-    if(node == NULL){
-        perror("mfs_listAddNode malloc");
+    buffer = mfs_blockGet(mnt->sblock.block_size);
+    if(buffer == NULL){
+        perror("mfs_groupPick malloc");
         return -1;
     }
 
-    memcpy(&(node->mds), &toAdd, sizeof(inode));
-    node->filename = malloc(name_len + 1);
-    if(node->filename == NULL){
-        perror("mfs_listAddNode malloc");
-        free(node);
+    *blockNo = 1;
+    *grDescNo = 0;
+    for(pass = policy == MFS_PICK_SPREAD ? 0 : 1; pass < 2; pass++){
+        block = 1;
+        group = 0;
+        while(block != 0){
+            if(mfs_read(mnt, buffer, block) == -1){
+                mfs_blockPut(buffer, mnt->sblock.block_size);
+                return -1;
+            }
+            memcpy(&link, buffer, sizeof(group_linker));
+            for(i = 0; i < link.no_descriptors; i++, group++){
+                memcpy(&grDesc, buffer + sizeof(group_linker) +
+                       i * sizeof(group_descriptor), sizeof(group_descriptor));
+                if((mnt->limit != 0 && grDesc.block_bitmap >= mnt->limit) ||
+                   (policy != MFS_PICK_BLOCK &&
+                    ((__u64) (group + 1) << mnt->groupShift) > 0xffff)){
+                    link.next_block = 0;
+                    break;
+                }
+                if(pass == 0){
+                    total += grDesc.free_inodes;
+                    groups++;
+                    continue;
+                }
+                rank = mfs_groupRank(&grDesc, policy, total, groups);
+                if(rank > best || (rank == best && rank != 0 && bestGroup < first &&
+                                   group >= first)){
+                    best = rank;
+                    bestGroup = group;
+                    *blockNo = block;
+                    *grDescNo = i;
+                }
+            }
+            block = link.next_block;
+        }
+    }
+
+    mfs_blockPut(buffer, mnt->sblock.block_size);
+    return 0;
+}
+
+static __u32 mfs_inodeGroup(mfs_mount *mnt, __u32 ino){
+    return ino ? (ino - 1) >> mnt->groupShift : 0;
+}
+
+int mfs_insertEntry(mfs_mount *mnt, inode *folder, inode *toInsert, char *path){
+    int                 i, wr = -1, empty;
+    __u32               blockNo, offset, curOffset, block = 1, grDesc = 0;
+    char                *buffer, *filename;
+    size_t              name_len;
+    directory_entry     entry, checkEntry;
+
+    buffer = mfs_blockGet(mnt->sblock.block_size);
+    if(buffer == NULL){
+        perror("mfs_insertEntry malloc");
         return -1;
     }
-    strncpy(node->filename, filename, name_len);
-    node->filename[name_len] = '\0';
 
-    if(root->root == NULL){
-        node->previous = NULL;
-        node->next = NULL;
-        root->root = node;
+    filename = mfs_extractFilename(path);
+    name_len = strlen(filename);
+    if(name_len > mnt->sblock.max_filename_size){
+        name_len = mnt->sblock.max_filename_size;
+    }
+    entry.inodeptr = toInsert->node_id;
+    entry.rec_len = sizeof(directory_entry) + name_len;
+    entry.name_len = name_len;
+    entry.file_type = MFS_TYPE(toInsert->mode);
+    for(i = 0; i < DATABLOCK_NUM; i++){
+        blockNo = folder->datablocks[i];
+        if(blockNo == 0){
+            memset(buffer, 0, mnt->sblock.block_size);
+            offset = 4;
+            memcpy(buffer, &offset, 4);
+            if(mfs_groupPick(mnt, mfs_inodeGroup(mnt, folder->node_id), MFS_PICK_BLOCK,
+                             &block, &grDesc) == -1){
+                mfs_blockPut(buffer, mnt->sblock.block_size);
+                return -1;
+            }
+            empty = mfs_findFree(mnt, &block, &grDesc, 1);
+            while(empty == -2){
+                empty = mfs_findFree(mnt, &block, &grDesc, 1);
+            }
+            if(empty == -1 || mfs_writeData(mnt, buffer, block, grDesc,
+                                            folder->datablocks, empty, (__u32) i) == -1){
+                mfs_blockPut(buffer, mnt->sblock.block_size);
+                return -1;
+            }
+            folder->file_size += mnt->sblock.block_size;
+            if(mfs_updateInode(mnt, folder) == -1){
+                mfs_blockPut(buffer, mnt->sblock.block_size);
+                return -1;
+            }
+            i--;
+        }else{
+            if(mfs_read(mnt, buffer, blockNo) == -1){
+                mfs_blockPut(buffer, mnt->sblock.block_size);
+                return -1;
+            }
+            memcpy(&offset, buffer, 4);
+            if(offset + sizeof(directory_entry) + name_len < mnt->sblock.block_size){
+                memcpy(buffer + offset, &entry, sizeof(directory_entry));
+                memcpy(buffer + offset + sizeof(directory_entry), filename, name_len);
+                offset += sizeof(directory_entry) + name_len;
+                memcpy(buffer, &offset, 4);
+                wr = 0;
+            }else{
+                curOffset = 4;
+                while(wr && curOffset < offset){
+                    memcpy(&checkEntry, buffer + curOffset, sizeof(directory_entry));
+                    if(checkEntry.inodeptr == 0 && checkEntry.rec_len >=
+                       name_len + sizeof(directory_entry)){
+                        entry.rec_len = checkEntry.rec_len;
+                        memcpy(buffer + curOffset, &entry, sizeof(directory_entry));
+                        memcpy(buffer + curOffset + sizeof(directory_entry),
+                               filename, name_len);
+                        wr = 0;
+                    }
+                    curOffset += checkEntry.rec_len;
+                }
+            }
+            if(!wr){
+                if(mfs_write(mnt, buffer, blockNo) == -1){
+                    mfs_blockPut(buffer, mnt->sblock.block_size);
+                    return -1;
+                }
+                mfs_blockPut(buffer, mnt->sblock.block_size);
+                return 0;
+            }
+        }
+    }
+
+    mfs_blockPut(buffer, mnt->sblock.block_size);
+    return -1;
+}
+
+char* mfs_extractFilename(char *path){
+    char *token, *returnToken;
+
+    if(path[strlen(path) - 1] == '/') return NULL;
+
+    token = strtok(path, "/");
+    while(token != NULL){
+        returnToken = token;
+        token = strtok(NULL, "/");
+    }
+
+    return returnToken;
+}
+
+int mfs_writeInode(mfs_mount *mnt, inode *toInsert, __u32 blockNo,
+                   __u32 grDescNo, __u32 pos, int mode){
+    int                 err = -1, count = mode ? 1 : 2;
+    char                *buffer, *table, *bitmap, *buffers[3];
+    __u32               toWrite, blocks[3], size = mnt->sblock.block_size;
+    group_descriptor    grDesc;
+
+    buffer = mfs_blockGet(size);
+    table = mfs_blockGet(size);
+    bitmap = mfs_blockGet(size);
+    if(buffer == NULL || table == NULL || bitmap == NULL){
+        perror("mfs_write malloc");
+    }else if(mfs_read(mnt, buffer, blockNo) == 0){
+        memcpy(&grDesc, buffer + sizeof(group_linker) +
+               grDescNo * sizeof(group_descriptor), sizeof(group_descriptor));
+        toWrite = grDesc.inode_table + mfs_divide(pos, mnt->inodeRecip);
+
+        /* The inode bitmap sits right before the inode table, so the first
+         * table block and the bitmap usually come in with one call. */
+        buffers[0] = table;
+        blocks[0] = toWrite;
+        buffers[1] = bitmap;
+        blocks[1] = grDesc.inode_bitmap;
+        if(mfs_readVec(mnt, buffers, blocks, count) == 0){
+            memcpy(table + (pos - (toWrite - grDesc.inode_table) * mnt->inodesPerBlock) *
+                   sizeof(inode), toInsert, sizeof(inode));
+            if(!mode){
+                grDesc.free_inodes--;
+                mfs_setBit(bitmap, pos);
+                memcpy(buffer + sizeof(group_linker) + grDescNo *
+                       sizeof(group_descriptor), &grDesc, sizeof(group_descriptor));
+                buffers[2] = buffer;
+                blocks[2] = blockNo;
+                count = 3;
+            }
+            err = mfs_writeVec(mnt, buffers, blocks, count);
+        }
+    }
+
+    mfs_blockPut(buffer, size);
+    mfs_blockPut(table, size);
+    mfs_blockPut(bitmap, size);
+    return err;
+}
+
+static int mfs_writeDataImpl(mfs_mount *mnt, char *toCopy, __u32 blockNo,
+                             __u32 grDescNo, __u32 *datablocks, __u32 pos,
+                             __u32 dataIndex){
+    int                 err = -1;
+    char                *buffer, *bitmap, *buffers[3];
+    __u32               toWrite, blocks[3], size = mnt->sblock.block_size;
+    group_descriptor    grDesc;
+
+    buffer = mfs_blockGet(size);
+    bitmap = mfs_blockGet(size);
+    if(buffer == NULL || bitmap == NULL){
+        perror("mfs_write malloc");
+    }else if(mfs_read(mnt, buffer, blockNo) == 0){
+        memcpy(&grDesc, buffer + sizeof(group_linker) +
+               grDescNo * sizeof(group_descriptor), sizeof(group_descriptor));
+        toWrite = grDesc.inode_table + mnt->sblock.inode_blocks + pos;
+        if(mfs_read(mnt, bitmap, grDesc.block_bitmap) == 0){
+            grDesc.free_blocks--;
+            mfs_setBit(bitmap, pos);
+            memcpy(buffer + sizeof(group_linker) + grDescNo * sizeof(group_descriptor),
+                   &grDesc, sizeof(group_descriptor));
+
+            /* Data, bitmap and descriptor go out together, the first group's
+             * bitmap directly follows its descriptor block. */
+            buffers[0] = toCopy;
+            blocks[0] = toWrite;
+            buffers[1] = bitmap;
+            blocks[1] = grDesc.block_bitmap;
+            buffers[2] = buffer;
+            blocks[2] = blockNo;
+            err = mfs_writeVec(mnt, buffers, blocks, 3);
+            if(!err){
+                datablocks[dataIndex] = toWrite;
+                mfs_freemapMark(mnt, toWrite, 1, 1);
+            }
+        }
+    }
+
+    mfs_blockPut(buffer, size);
+    mfs_blockPut(bitmap, size);
+    return err;
+}
+
+int mfs_writeData(mfs_mount *mnt, char *toCopy, __u32 blockNo,
+                  __u32 grDescNo, __u32 *datablocks, __u32 pos, __u32 dataIndex){
+    int     result;
+    __u64   start;
+
+    start = mfs_clock();
+    result = mfs_writeDataImpl(mnt, toCopy, blockNo, grDescNo, datablocks, pos,
+                               dataIndex);
+    mfs_histRecord(&mfs_primitiveLatency[HIST_WRITEDATA], mfs_clock() - start);
+    return result;
+}
+
+static int mfs_followPathImpl(mfs_mount *mnt, char *path, inode *ptr, int mode){
+    int     found;
+    char    *buffer, *token, *next;
+    inode   curFolder;
+
+    if(path[0] == '/' || path[0] == '.' || (path[0] > 64 && path[0] < 91) ||
+       (path[0] > 96 && path[0] < 123)){
+        if(!strcmp(path, ".")){
+            return 0;
+        }
+        buffer = mfs_blockGet(mnt->sblock.block_size);
+        if(buffer == NULL){
+            perror("mfs_followPath malloc");
+            return -1;
+        }
+        if(path[0] == '/'){
+            if(mfs_read(mnt, buffer, 4) == -1){
+                mfs_blockPut(buffer, mnt->sblock.block_size);
+                return -1;
+            }
+            if(!strcmp(path, "/")){
+                memcpy(ptr, buffer, sizeof(inode));
+                mfs_blockPut(buffer, mnt->sblock.block_size);
+                return 0;
+            }else{
+                memcpy(&curFolder, buffer, sizeof(inode));
+            }
+        }else{
+            memcpy(&curFolder, ptr, sizeof(inode));
+        }
+        token = strtok(path, "/");
+        while(token != NULL){
+            next = strtok(NULL, "/");
+            found = mfs_findEntry(mnt, &curFolder, token, next == NULL ? mode : 0);
+            if(found == -1){
+                mfs_blockPut(buffer, mnt->sblock.block_size);
+                return -1;
+            }
+            if(mfs_findInode(mnt, found, &curFolder) == -1){
+                mfs_blockPut(buffer, mnt->sblock.block_size);
+                return -1;
+            }
+            token = next;
+        }
+        memcpy(ptr, &curFolder, sizeof(inode));
+        mfs_blockPut(buffer, mnt->sblock.block_size);
+        return 0;
     }else{
-        cur = root->root;
-        while(cur != NULL){
-            if(strcmp(node->filename, cur->filename) < 0){
-                root->size++;
-                node->previous = cur->previous;
-                if(cur->previous == NULL){
-                    root->root = node;
-                }else{
-                    cur->previous->next = node;
+        fprintf(stderr, "Invalid path.\n");
+        return -1;
+    }
+
+    return -1;
+}
+
+int mfs_followPath(mfs_mount *mnt, char *path, inode *ptr, int mode){
+    int     result;
+    __u64   start;
+
+    start = mfs_clock();
+    result = mfs_followPathImpl(mnt, path, ptr, mode);
+    mfs_histRecord(&mfs_primitiveLatency[HIST_FOLLOWPATH], mfs_clock() - start);
+    return result;
+}
+
+static int mfs_findEntryImpl(mfs_mount *mnt, inode *curFolder, char *name, int file_type){
+    char            *buffer, curName[256];
+    int             i = 0;
+    int             curOffset, offset, namelen;
+    directory_entry entry;
+
+    buffer = mfs_blockGet(mnt->sblock.block_size);
+    if(buffer == NULL){
+        perror("mfs_findEntry malloc");
+        return -1;
+    }
+    namelen = strlen(name);
+    while(i < DATABLOCK_NUM && curFolder->datablocks[i] != 0){
+        if(mfs_read(mnt, buffer, curFolder->datablocks[i]) == -1){
+            mfs_blockPut(buffer, mnt->sblock.block_size);
+            return -1;
+        }
+        MFS_STAT_ADD(dir_blocks, 1);
+        memcpy(&offset, buffer, 4);
+        curOffset = 4;
+        while(curOffset < offset){
+            memcpy(&entry, buffer + curOffset, sizeof(directory_entry));
+            if(entry.inodeptr != 0 && namelen == entry.name_len){
+                memcpy(curName, buffer + curOffset + sizeof(directory_entry),
+                       entry.name_len);
+                if(!strncmp(name, curName, namelen)){
+                    mfs_blockPut(buffer, mnt->sblock.block_size);
+                    if(file_type == -1 || entry.file_type == file_type){
+                        return entry.inodeptr;
+                    }else{
+                        fprintf(stderr, "%s not the requested file type\n", name);
+                        return -1;
+                    }
                 }
-                node->next = cur;
-                cur->previous = node;
-                break;
-            }else if(cur->next == NULL){
-                node->previous = cur;
-                node->next = NULL;
-                cur->next = node;
-                break;
             }
-            cur = cur->next;
+            curOffset += entry.rec_len;
         }
+        i++;
     }
 
-    return 0;
+    mfs_blockPut(buffer, mnt->sblock.block_size);
+    return -1;
+}
+
+int mfs_findEntry(mfs_mount *mnt, inode *curFolder, char *name, int file_type){
+    int     result;
+    __u64   start;
+
+    start = mfs_clock();
+    result = mfs_findEntryImpl(mnt, curFolder, name, file_type);
+    mfs_histRecord(&mfs_primitiveLatency[HIST_FINDENTRY], mfs_clock() - start);
+    return result;
 }
 
-int mfs_listAddNodeCT(list_root *root, inode toAdd, char *filename, int name_len){
-    list_node   *node, *cur;
+static int mfs_findInodeImpl(mfs_mount *mnt, __u32 inodeptr, inode *requested){
+    int                 block_group, index, desc_block, dpos, i, inode_block, ipos;
+    __u32               block = 1;
+    char                *buffer;
+    group_linker        link;
+    group_descriptor    grDesc;
+
+    block_group = (inodeptr - 1) >> mnt->groupShift;
+    index = (inodeptr - 1) & mnt->groupMask;
+    desc_block = mfs_divide(block_group, mnt->descRecip);
+    dpos = block_group - desc_block * mnt->descPerBlock;
+    inode_block = mfs_divide(index, mnt->inodeRecip);
+    ipos = index - inode_block * mnt->inodesPerBlock;
+
+    buffer = mfs_blockGet(mnt->sblock.block_size);
+    if(buffer == NULL){
+        perror("mfs_findInode malloc");
+        return -1;
+    }
+
+    /* The group may be gone, e.g. after mfs_resize. */
+    for(i = 0; i < desc_block + 1; i++){
+        if(block == 0 || mfs_read(mnt, buffer, block) == -1){
+            mfs_blockPut(buffer, mnt->sblock.block_size);
+            return -1;
+        }
+        memcpy(&link, buffer, sizeof(group_linker));
+        block = link.next_block;
+    }
+    if(dpos >= link.no_descriptors){
+        mfs_blockPut(buffer, mnt->sblock.block_size);
+        return -1;
+    }
 
-    node = malloc(sizeof(list_node));
-    if(node == NULL){
-        perror("mfs_listAddNode malloc");
+    memcpy(&grDesc, buffer + sizeof(group_linker) + dpos * sizeof(group_descriptor),
+           sizeof(group_descriptor));
+    if(mfs_read(mnt, buffer, grDesc.inode_table + inode_block) == -1){
+        mfs_blockPut(buffer, mnt->sblock.block_size);
         return -1;
     }
+    memcpy(requested, buffer + ipos * sizeof(inode), sizeof(inode));
+
+    mfs_blockPut(buffer, mnt->sblock.block_size);
+    return 0;
+}
+
+int mfs_findInode(mfs_mount *mnt, __u32 inodeptr, inode *requested){
+    int     result;
+    __u64   start;
+
+    start = mfs_clock();
+    result = mfs_findInodeImpl(mnt, inodeptr, requested);
+    mfs_histRecord(&mfs_primitiveLatency[HIST_FINDINODE], mfs_clock() - start);
+    return result;
+}
+
+/* A position of an mfs_findInodes batch, ordered by inode number, which is
+ * the order of the inode table blocks. */
+typedef struct{
+    __u32       ino;
+    int         pos;
+}mfs_inodeRef;
+
+static int mfs_inodeRefCmp(const void *a, const void *b){
+    const mfs_inodeRef  *x = a, *y = b;
+
+    if(x->ino != y->ino) return x->ino < y->ino ? -1 : 1;
+    return x->pos - y->pos;
+}
 
-    memcpy(&(node->mds), &toAdd, sizeof(inode));
-    node->filename = malloc(name_len + 1);
-    if(node->filename == NULL){
-        perror("mfs_listAddNode malloc");
-        free(node);
+int mfs_findInodes(mfs_mount *mnt, __u32 *inodeptrs, inode *inodes, int count){
+    int                 i, found = 0, err = 0;
+    __u32               group, index, want, next = 1, loaded = 0, curGroup = 0xffffffff,
+                        tableBlock, cached = 0, inode_block;
+    char                *buffer, *table;
+    group_linker        link;
+    group_descriptor    grDesc;
+    mfs_inodeRef        *refs;
+
+    if(count <= 0) return 0;
+    refs = malloc(count * sizeof(mfs_inodeRef));
+    buffer = mfs_blockGet(mnt->sblock.block_size);
+    table = mfs_blockGet(mnt->sblock.block_size);
+    if(refs == NULL || buffer == NULL || table == NULL){
+        perror("mfs_findInodes malloc");
+        free(refs);
+        mfs_blockPut(buffer, mnt->sblock.block_size);
+        mfs_blockPut(table, mnt->sblock.block_size);
         return -1;
     }
-    strncpy(node->filename, filename, name_len);
-    node->filename[name_len] = '\0';
+    for(i = 0; i < count; i++){
+        refs[i].ino = inodeptrs[i];
+        refs[i].pos = i;
+        inodes[i].node_id = 0;
+    }
+    qsort(refs, count, sizeof(mfs_inodeRef), mfs_inodeRefCmp);
 
-    if(root->root == NULL){
-        node->previous = NULL;
-        node->next = NULL;
-        root->root = node;
-    }else{
-        cur = root->root;
-        while(cur != NULL){
-            if(node->mds.creation_time < cur->mds.creation_time){
-                root->size++;
-                node->previous = cur->previous;
-                if(cur->previous == NULL){
-                    root->root = node;
-                }else{
-                    cur->previous->next = node;
+    /* Groups only ascend, so the descriptor chain is walked once and every
+     * table block is read once. */
+    for(i = 0; i < count && !err; i++){
+        if(refs[i].ino == 0) continue;
+        group = (refs[i].ino - 1) >> mnt->groupShift;
+        index = (refs[i].ino - 1) & mnt->groupMask;
+        if(group != curGroup){
+            want = mfs_divide(group, mnt->descRecip);
+            while(loaded <= want && next != 0){
+                if(mfs_read(mnt, buffer, next) == -1){
+                    err = -1;
+                    break;
                 }
-                node->next = cur;
-                cur->previous = node;
+                memcpy(&link, buffer, sizeof(group_linker));
+                next = link.next_block;
+                loaded++;
+            }
+            if(err || loaded <= want ||
+               group - want * mnt->descPerBlock >= link.no_descriptors){
                 break;
-            }else if(cur->next == NULL){
-                node->previous = cur;
-                node->next = NULL;
-                cur->next = node;
+            }
+            memcpy(&grDesc, buffer + sizeof(group_linker) + (group - want *
+                   mnt->descPerBlock) * sizeof(group_descriptor),
+                   sizeof(group_descriptor));
+            curGroup = group;
+        }
+
+        inode_block = mfs_divide(index, mnt->inodeRecip);
+        tableBlock = grDesc.inode_table + inode_block;
+        if(tableBlock != cached){
+            if(mfs_read(mnt, table, tableBlock) == -1){
+                err = -1;
                 break;
             }
-            cur = cur->next;
+            cached = tableBlock;
         }
+        memcpy(&inodes[refs[i].pos], table + (index - inode_block *
+               mnt->inodesPerBlock) * sizeof(inode), sizeof(inode));
+        found++;
     }
 
-    return 0;
+    free(refs);
+    mfs_blockPut(buffer, mnt->sblock.block_size);
+    mfs_blockPut(table, mnt->sblock.block_size);
+    return err ? -1 : found;
 }
 
-void mfs_listPrint(list_root root, int lFlag){
-    list_node   *cur;
+int mfs_readdirPlus(mfs_mount *mnt, inode *dir, char *buffer, int flags,
+                    mfs_direntPlus **entries){
+    int             i, run, count = 0, kept = 0, pass;
+    __u32           bsize, offset, curOffset, *ptrs = NULL;
+    char            *block, *name;
+    inode           *attrs = NULL;
+    directory_entry entry;
+    mfs_direntPlus  *list = NULL;
 
-    cur = root.root;
-    while(cur != NULL){
-        if(lFlag){
-            printf("%s\n", cur->filename);
+    bsize = mnt->sblock.block_size;
+    for(i = 0; i < DATABLOCK_NUM && dir->datablocks[i] != 0; i += run){
+        for(run = 1; i + run < DATABLOCK_NUM && dir->datablocks[i + run] ==
+            dir->datablocks[i] + run; run++);
+        if(mfs_readBlocks(mnt, buffer + i * bsize, dir->datablocks[i], run) == -1){
+            return -1;
+        }
+        MFS_STAT_ADD(dir_blocks, run);
+    }
+
+    /* The first pass counts the entries, the second one collects them. */
+    for(pass = 0; pass < 2; pass++){
+        for(i = 0; i < DATABLOCK_NUM && dir->datablocks[i] != 0; i++){
+            block = buffer + i * bsize;
+            memcpy(&offset, block, 4);
+            for(curOffset = 4; curOffset < offset; curOffset += entry.rec_len){
+                memcpy(&entry, block + curOffset, sizeof(directory_entry));
+                name = block + curOffset + sizeof(directory_entry);
+                if(entry.inodeptr == 0) continue;
+                if(name[0] == '.' && !(flags & MFS_DIRENT_ALL)) continue;
+                if(entry.file_type != 0 && (flags & MFS_DIRENT_DIRS)) continue;
+                if(pass == 1){
+                    list[kept].name = name;
+                    list[kept].name_len = entry.name_len;
+                    list[kept].file_type = entry.file_type;
+                    ptrs[kept] = entry.inodeptr;
+                }
+                kept++;
+            }
+        }
+        if(pass == 1) break;
+
+        count = kept;
+        kept = 0;
+        list = malloc((count ? count : 1) * sizeof(mfs_direntPlus));
+        ptrs = malloc((count ? count : 1) * sizeof(__u32));
+        attrs = malloc((count ? count : 1) * sizeof(inode));
+        if(list == NULL || ptrs == NULL || attrs == NULL){
+            perror("mfs_readdirPlus malloc");
+            free(list);
+            free(ptrs);
+            free(attrs);
+            return -1;
+        }
+    }
+
+    if(mfs_findInodes(mnt, ptrs, attrs, count) == -1){
+        free(list);
+        free(ptrs);
+        free(attrs);
+        return -1;
+    }
+    for(i = 0, kept = 0; i < count; i++){
+        if(attrs[i].node_id == 0) continue;
+        list[kept] = list[i];
+        memcpy(&list[kept].attr, &attrs[i], sizeof(inode));
+        kept++;
+    }
+
+    free(ptrs);
+    free(attrs);
+    *entries = list;
+    return kept;
+}
+
+static int mfs_findFreeImpl(mfs_mount *mnt, __u32 *blockNo, __u32 *grDescNo, int mode){
+    int                 empty = -1, i, freeptr;
+    __u32               block, desc, pos;
+    char                *buffer;
+    group_descriptor    grDesc;
+    group_linker        grlink;
+
+    MFS_STAT_ADD(findfree_calls, 1);
+    buffer = mfs_blockGet(mnt->sblock.block_size);
+    if(buffer == NULL){
+        perror("mfs_findFree malloc");
+        return -1;
+    }
+
+    if(mfs_read(mnt, buffer, *blockNo) == -1){
+        mfs_blockPut(buffer, mnt->sblock.block_size);
+        return -1;
+    }
+
+    memcpy(&grlink, buffer, sizeof(group_linker));
+    for(i = *grDescNo; i < grlink.no_descriptors; i++){
+        memcpy(&grDesc, buffer + sizeof(group_linker) + i * sizeof(group_descriptor),
+               sizeof(group_descriptor));
+        if(mnt->limit != 0 && grDesc.block_bitmap >= mnt->limit) break;
+        if(!mode) freeptr = grDesc.free_inodes;
+        else freeptr = grDesc.free_blocks;
+        if(freeptr != 0){
+            if(!mode){
+                empty = mfs_fzeroBit(mnt, grDesc.inode_bitmap);
+            }else if(mfs_freemapFind(mnt, 1, grDesc.inode_table +
+                                     mnt->sblock.inode_blocks, &block, &desc,
+                                     &pos) == 0 && block == *blockNo && desc == i){
+                empty = pos;
+            }else{
+                empty = mfs_fzeroBit(mnt, grDesc.block_bitmap);
+            }
+            *grDescNo = i;
+            mfs_blockPut(buffer, mnt->sblock.block_size);
+            return empty;
+        }
+    }
+
+    /* The groups past the limit are being emptied and the image must not grow
+     * meanwhile. */
+    if(mnt->limit != 0 && (i < grlink.no_descriptors || grlink.next_block == 0 ||
+                           grlink.next_block >= mnt->limit)){
+        mfs_blockPut(buffer, mnt->sblock.block_size);
+        return -1;
+    }
+
+    if(grlink.next_block != 0){
+        *blockNo = grlink.next_block;
+        *grDescNo = 0;
+        mfs_blockPut(buffer, mnt->sblock.block_size);
+        MFS_STAT_ADD(findfree_retries, 1);
+        return -2;
+    }else{
+        if(i == grlink.max_descriptors){
+            if(!mfs_newGroupDescriptor(mnt, blockNo, grDescNo, &grlink, 0)){
+                *blockNo = grlink.next_block;
+                *grDescNo = 0;
+                mfs_blockPut(buffer, mnt->sblock.block_size);
+                MFS_STAT_ADD(findfree_retries, 1);
+                return -2;
+            }
         }else{
-            printf("%s ct: %u at: %u mt: %u %llu", cur->filename,
-                   cur->mds.creation_time, cur->mds.access_time,
-                   cur->mds.modification_time, cur->mds.file_size);
+            if(!mfs_newGroupDescriptor(mnt, blockNo, grDescNo, &grlink, i)){
+                *grDescNo += 1;
+                mfs_blockPut(buffer, mnt->sblock.block_size);
+                MFS_STAT_ADD(findfree_retries, 1);
+                return -2;
+            }
         }
-        cur = cur->next;
     }
+
+    mfs_blockPut(buffer, mnt->sblock.block_size);
+    return -1;
+}
+
+int mfs_findFree(mfs_mount *mnt, __u32 *blockNo, __u32 *grDescNo, int mode){
+    int     result;
+    __u64   start;
+
+    start = mfs_clock();
+    result = mfs_findFreeImpl(mnt, blockNo, grDescNo, mode);
+    mfs_histRecord(&mfs_primitiveLatency[HIST_FINDFREE], mfs_clock() - start);
+    return result;
 }
 
-void mfs_listDestroy(list_root *root){
-    list_node   *cur, *toDelete;
+__u32 mfs_fzeroBit(mfs_mount *mnt, __u32 offset){
+    int     i, pos = 0;
+    char    *buffer;
+    __u32   returnValue = 0, bitpack, invBitpack;
+
+    buffer = mfs_blockGet(mnt->sblock.block_size);
+    if(buffer == NULL){
+        perror("mfs_fzeroBit malloc");
+        return 0;
+    }
+
+    if(mfs_read(mnt, buffer, offset) == -1){
+        mfs_blockPut(buffer, mnt->sblock.block_size);
+        return 0;
+    }
 
-    if(root != NULL){
-        cur = root->root;
-        while(cur != NULL){
-            toDelete = cur;
-            cur = cur->next;
-            free(toDelete->filename);
-            free(toDelete);
+    for(i = 0; i < mnt->sblock.block_size / 4; i++){
+        MFS_STAT_ADD(bitmap_words, 1);
+        memcpy(&bitpack, buffer + i * 4, 4);
+        if(bitpack == 0){
+            mfs_blockPut(buffer, mnt->sblock.block_size);
+            return returnValue;
+        }else{
+            invBitpack = ~bitpack;
+            while(invBitpack >>= 1){
+                pos++;
+            }
+            if(bitpack != 0xffffffff){
+                mfs_blockPut(buffer, mnt->sblock.block_size);
+                return returnValue + 31 - pos;
+            }else{
+                returnValue += 32;
+            }
         }
-        free(root);
-        root = NULL;
     }
+
+    mfs_blockPut(buffer, mnt->sblock.block_size);
+    return 0;
+}
+
+void mfs_setBit(char *buffer, __u32 index){
+    __u32     whichInt, whichBit;
+    __u32     number = 0;
+
+    whichInt = index / 32;
+    whichBit = index % 32;
+
+    memcpy(&number, buffer + whichInt * 4, 4);
+    number |= 1 << (31 - whichBit);
+
+    memcpy(buffer + whichInt * 4, &number, 4);
+}
+
+void mfs_clearBit(char *buffer, __u32 index){
+    __u32     whichInt, whichBit;
+    __u32     number = 0;
+
+    whichInt = index / 32;
+    whichBit = index % 32;
+
+    memcpy(&number, buffer + whichInt * 4, 4);
+    number &= ~(1 << (31 - whichBit));
+
+    memcpy(buffer + whichInt * 4, &number, 4);
+}
+
+int mfs_testBit(char *buffer, __u32 index){
+    __u32     number = 0;
+
+    memcpy(&number, buffer + index / 32 * 4, 4);
+    return (number >> (31 - index % 32)) & 1;
+}
+
+int mfs_newGroupDescriptor(mfs_mount *mnt, __u32 *blockNo,
+                           __u32 *grDescNo, group_linker *grlink, __u32 pos){
+    __u32               ptr, end, descBlock;
+    char                *buffer;
+    group_descriptor    grDesc;
+    group_linker        newGrlink;
+    __u64               size;
+
+    buffer = mfs_blockGet(mnt->sblock.block_size);
+    if(buffer == NULL){
+        perror("mfs_newGroupDescriptor malloc");
+        return -1;
+    }
+    memset(buffer, 0, mnt->sblock.block_size);
+
+    if(mfs_imageBlocks(mnt, &size) == -1){
+        mfs_blockPut(buffer, mnt->sblock.block_size);
+        return -1;
+    }
+    if(size + 3 + mnt->sblock.inode_blocks + mnt->sblock.block_size * 8 > 0xffffffffULL){
+        fprintf(stderr, "mfs_newGroupDescriptor: block numbers exhausted.\n");
+        mfs_blockPut(buffer, mnt->sblock.block_size);
+        return -1;
+    }
+    ptr = size;
+    grDesc.free_blocks = mnt->sblock.block_size * 8 > 0xffff ? 0xffff :
+                         mnt->sblock.block_size * 8;
+    grDesc.free_inodes = grDesc.free_blocks;
+
+    if(!pos){
+        grlink->next_block = ptr;
+        newGrlink.next_block = 0;
+        newGrlink.no_descriptors = 1;
+        newGrlink.max_descriptors = grlink->max_descriptors;
+        grDesc.block_bitmap = ptr + 1;
+        grDesc.inode_bitmap = ptr + 2;
+        grDesc.inode_table = ptr + 3;
+        memcpy(buffer, &newGrlink, sizeof(group_linker));
+        memcpy(buffer + sizeof(group_linker), &grDesc, sizeof(group_descriptor));
+        if(mfs_write(mnt, buffer, ptr) == -1){
+            mfs_blockPut(buffer, mnt->sblock.block_size);
+            return -1;
+        }
+        descBlock = ptr;
+        ptr++;
+        if(mfs_read(mnt, buffer, *blockNo) == -1){
+            mfs_blockPut(buffer, mnt->sblock.block_size);
+            return -1;
+        }
+        memcpy(buffer, grlink, sizeof(group_linker));
+    }else{
+        grlink->no_descriptors++;
+        descBlock = *blockNo;
+        grDesc.block_bitmap = ptr;
+        grDesc.inode_bitmap = ptr + 1;
+        grDesc.inode_table = ptr + 2;
+        if(mfs_read(mnt, buffer, *blockNo) == -1){
+            mfs_blockPut(buffer, mnt->sblock.block_size);
+            return -1;
+        }
+        memcpy(buffer, grlink, sizeof(group_linker));
+        memcpy(buffer + sizeof(group_linker) + pos * sizeof(group_descriptor),
+               &grDesc, sizeof(group_descriptor));
+    }
+    if(mfs_write(mnt, buffer, *blockNo) == -1){
+        mfs_blockPut(buffer, mnt->sblock.block_size);
+        return -1;
+    }
+
+    end = ptr + 2 + mnt->sblock.inode_blocks + mnt->sblock.block_size * 8;
+    if(mfs_zeroBlocks(mnt, ptr, end - ptr) == -1){
+        mfs_blockPut(buffer, mnt->sblock.block_size);
+        return -1;
+    }
+    mfs_freemapAdd(mnt, descBlock, pos, grDesc.inode_table + mnt->sblock.inode_blocks);
+
+    if((__u64) end * mnt->sblock.block_size > 0xffffffffULL &&
+       !(mnt->sblock.feature_incompat & MFS_FEATURE_LARGE_IMAGE)){
+        mnt->sblock.feature_incompat |= MFS_FEATURE_LARGE_IMAGE;
+        if(mfs_writeSuperblock(mnt) == -1){
+            mfs_blockPut(buffer, mnt->sblock.block_size);
+            return -1;
+        }
+    }
+
+    mfs_blockPut(buffer, mnt->sblock.block_size);
+    return 0;
+}
+
+/* All block I/O is positional: no call depends on or moves the file offset,
+ * so threads may share a descriptor. Overlay images translate every block. */
+int mfs_read(mfs_mount *mnt, char *buffer, __u32 block){
+    if(mnt->overlay != NULL){
+        if(mfs_overlayRead(mnt, buffer, block, 1) == -1) return -1;
+    }else if(pread64(mnt->fd, buffer, mnt->sblock.block_size,
+                     (off64_t) block << mnt->blockShift) < mnt->sblock.block_size){
+        perror("mfs_read read");
+        return -1;
+    }
+    MFS_STAT_ADD(block_reads, 1);
+    MFS_STAT_ADD(bytes_read, mnt->sblock.block_size);
+
+    return 0;
+}
+
+int mfs_write(mfs_mount *mnt, char *buffer, __u32 block){
+    if(mnt->overlay != NULL){
+        if(mfs_overlayWrite(mnt, buffer, block, 1) == -1) return -1;
+    }else if(pwrite64(mnt->fd, buffer, mnt->sblock.block_size,
+                      (off64_t) block << mnt->blockShift) < mnt->sblock.block_size){
+        perror("mfs_write write");
+        return -1;
+    }
+    MFS_STAT_ADD(block_writes, 1);
+    MFS_STAT_ADD(bytes_written, mnt->sblock.block_size);
+
+    return 0;
+}
+
+int mfs_readBlocks(mfs_mount *mnt, char *buffer, __u32 block, __u32 count){
+    size_t  size;
+
+    size = (size_t) count << mnt->blockShift;
+    if(mnt->overlay != NULL){
+        if(mfs_overlayRead(mnt, buffer, block, count) == -1) return -1;
+    }else if(pread64(mnt->fd, buffer, size, (off64_t) block << mnt->blockShift) <
+             (ssize_t) size){
+        perror("mfs_readBlocks read");
+        return -1;
+    }
+    MFS_STAT_ADD(block_reads, count);
+    MFS_STAT_ADD(bytes_read, size);
+
+    return 0;
+}
+
+int mfs_writeBlocks(mfs_mount *mnt, char *buffer, __u32 block, __u32 count){
+    size_t  size;
+
+    size = (size_t) count << mnt->blockShift;
+    if(mnt->overlay != NULL){
+        if(mfs_overlayWrite(mnt, buffer, block, count) == -1) return -1;
+    }else if(pwrite64(mnt->fd, buffer, size, (off64_t) block << mnt->blockShift) <
+             (ssize_t) size){
+        perror("mfs_writeBlocks write");
+        return -1;
+    }
+    MFS_STAT_ADD(block_writes, count);
+    MFS_STAT_ADD(bytes_written, size);
+
+    return 0;
+}
+
+/* Sorts the blocks of a vectored call, keeping each buffer with its block. */
+static void mfs_vecSort(char **buffers, __u32 *blocks, int count){
+    int     i, j;
+    char    *buffer;
+    __u32   block;
+
+    for(i = 1; i < count; i++){
+        buffer = buffers[i];
+        block = blocks[i];
+        for(j = i; j > 0 && blocks[j - 1] > block; j--){
+            buffers[j] = buffers[j - 1];
+            blocks[j] = blocks[j - 1];
+        }
+        buffers[j] = buffer;
+        blocks[j] = block;
+    }
+}
+
+static int mfs_transferVec(mfs_mount *mnt, char **buffers, __u32 *blocks, int count,
+                           int write){
+    int             i, n;
+    size_t          size;
+    ssize_t         done;
+    struct iovec    iov[MFS_VEC_BLOCKS];
+
+    if(mnt->overlay != NULL){
+        for(i = 0; i < count; i++){
+            if(write && mfs_write(mnt, buffers[i], blocks[i]) == -1) return -1;
+            if(!write && mfs_read(mnt, buffers[i], blocks[i]) == -1) return -1;
+        }
+        return 0;
+    }
+
+    mfs_vecSort(buffers, blocks, count);
+    for(i = 0; i < count; i += n){
+        for(n = 0; i + n < count && n < MFS_VEC_BLOCKS &&
+            blocks[i + n] == blocks[i] + n; n++){
+            iov[n].iov_base = buffers[i + n];
+            iov[n].iov_len = mnt->sblock.block_size;
+        }
+        size = (size_t) n << mnt->blockShift;
+        if(write){
+            done = pwritev64(mnt->fd, iov, n, (off64_t) blocks[i] << mnt->blockShift);
+            MFS_STAT_ADD(block_writes, n);
+            MFS_STAT_ADD(bytes_written, size);
+        }else{
+            done = preadv64(mnt->fd, iov, n, (off64_t) blocks[i] << mnt->blockShift);
+            MFS_STAT_ADD(block_reads, n);
+            MFS_STAT_ADD(bytes_read, size);
+        }
+        if(done < (ssize_t) size){
+            perror(write ? "mfs_writeVec write" : "mfs_readVec read");
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int mfs_readVec(mfs_mount *mnt, char **buffers, __u32 *blocks, int count){
+    return mfs_transferVec(mnt, buffers, blocks, count, 0);
+}
+
+int mfs_writeVec(mfs_mount *mnt, char **buffers, __u32 *blocks, int count){
+    return mfs_transferVec(mnt, buffers, blocks, count, 1);
+}
+
+int mfs_zeroBlocks(mfs_mount *mnt, __u32 block, __u32 count){
+    int             i, n;
+    char            *zero;
+    size_t          size;
+    struct iovec    iov[MFS_VEC_BLOCKS];
+
+    if(mnt->overlay != NULL) return mfs_overlayZero(mnt, block, count);
+    zero = mfs_blockZero(mnt->sblock.block_size);
+    if(zero == NULL){
+        perror("mfs_zeroBlocks malloc");
+        return -1;
+    }
+    for(i = 0; i < MFS_VEC_BLOCKS; i++){
+        iov[i].iov_base = zero;
+        iov[i].iov_len = mnt->sblock.block_size;
+    }
+
+    for(; count > 0; block += n, count -= n){
+        n = count < MFS_VEC_BLOCKS ? count : MFS_VEC_BLOCKS;
+        size = (size_t) n << mnt->blockShift;
+        if(pwritev64(mnt->fd, iov, n, (off64_t) block << mnt->blockShift) <
+           (ssize_t) size){
+            perror("mfs_zeroBlocks write");
+            mfs_blockPut(zero, mnt->sblock.block_size);
+            return -1;
+        }
+        MFS_STAT_ADD(block_writes, n);
+        MFS_STAT_ADD(bytes_written, size);
+    }
+
+    mfs_blockPut(zero, mnt->sblock.block_size);
+    return 0;
+}
+
+int mfs_imageBlocks(mfs_mount *mnt, __u64 *blocks){
+    struct stat64   st;
+
+    if(mnt->overlay != NULL){
+        *blocks = mfs_overlayBlocks(mnt);
+        return 0;
+    }
+    if(fstat64(mnt->fd, &st) == -1){
+        perror("mfs_imageBlocks stat");
+        return -1;
+    }
+    *blocks = st.st_size >> mnt->blockShift;
+
+    return 0;
+}
+
+int mfs_imageExtend(mfs_mount *mnt, __u32 block, __u32 count){
+    int     err;
+
+    if(mnt->overlay != NULL) return mfs_overlayZero(mnt, block, count);
+    err = posix_fallocate64(mnt->fd, (off64_t) block << mnt->blockShift,
+                            (off64_t) count << mnt->blockShift);
+    if(err){
+        errno = err;
+        perror("mfs_imageExtend fallocate");
+        return -1;
+    }
+
+    return 0;
+}
+
+int mfs_imageTruncate(mfs_mount *mnt, __u32 blocks){
+    if(mnt->overlay != NULL) return mfs_overlayTruncate(mnt, blocks);
+    if(ftruncate64(mnt->fd, (off64_t) blocks << mnt->blockShift) == -1){
+        perror("mfs_imageTruncate truncate");
+        return -1;
+    }
+
+    return 0;
+}
+
+int mfs_writeSuperblock(mfs_mount *mnt){
+    char    *buffer;
+    int     err;
+
+    buffer = mfs_blockGet(mnt->sblock.block_size);
+    if(buffer == NULL){
+        perror("mfs_writeSuperblock malloc");
+        return -1;
+    }
+
+    err = mfs_read(mnt, buffer, 0);
+    if(!err){
+        memcpy(buffer, &mnt->sblock, sizeof(mfs_superblock));
+        err = mfs_write(mnt, buffer, 0);
+    }
+
+    mfs_blockPut(buffer, mnt->sblock.block_size);
+    return err;
+}
+
+int mfs_groupLocate(mfs_mount *mnt, __u32 group, __u32 *blockNo, __u32 *grDescNo){
+    __u32           i, desc_block;
+    char            *buffer;
+    group_linker    link;
+
+    desc_block = mfs_divide(group, mnt->descRecip);
+
+    buffer = mfs_blockGet(mnt->sblock.block_size);
+    if(buffer == NULL){
+        perror("mfs_groupLocate malloc");
+        return -1;
+    }
+
+    *blockNo = 1;
+    for(i = 0; i < desc_block; i++){
+        if(mfs_read(mnt, buffer, *blockNo) == -1){
+            mfs_blockPut(buffer, mnt->sblock.block_size);
+            return -1;
+        }
+        memcpy(&link, buffer, sizeof(group_linker));
+        if(link.next_block == 0){
+            mfs_blockPut(buffer, mnt->sblock.block_size);
+            return -1;
+        }
+        *blockNo = link.next_block;
+    }
+    *grDescNo = group - desc_block * mnt->descPerBlock;
+
+    mfs_blockPut(buffer, mnt->sblock.block_size);
+    return 0;
+}
+
+__u32 mfs_groupNumber(mfs_mount *mnt, __u32 blockNo, __u32 grDescNo){
+    __u32           block = 1, desc_block = 0;
+    char            *buffer;
+    group_linker    link;
+
+    buffer = mfs_blockGet(mnt->sblock.block_size);
+    if(buffer == NULL){
+        perror("mfs_groupNumber malloc");
+        return 0;
+    }
+
+    while(block != blockNo && block != 0){
+        if(mfs_read(mnt, buffer, block) == -1) break;
+        memcpy(&link, buffer, sizeof(group_linker));
+        block = link.next_block;
+        desc_block++;
+    }
+
+    mfs_blockPut(buffer, mnt->sblock.block_size);
+    return desc_block * mnt->descPerBlock + grDescNo;
+}
+
+int mfs_updateInode(mfs_mount *mnt, inode *toUpdate){
+    __u32   blockNo, grDescNo, index;
+
+    index = (toUpdate->node_id - 1) & mnt->groupMask;
+    if(mfs_groupLocate(mnt, (toUpdate->node_id - 1) >> mnt->groupShift, &blockNo,
+                       &grDescNo) == -1){
+        return -1;
+    }
+
+    return mfs_writeInode(mnt, toUpdate, blockNo, grDescNo, index, 1);
+}
+
+__u32 mfs_inodeGoal(mfs_mount *mnt, __u32 ino){
+    __u32               blockNo, grDescNo, goal = 0;
+    char                *buffer;
+    group_linker        link;
+    group_descriptor    grDesc;
+
+    if(ino == 0 || mfs_groupLocate(mnt, mfs_inodeGroup(mnt, ino), &blockNo,
+                                   &grDescNo) == -1){
+        return 0;
+    }
+    buffer = mfs_blockGet(mnt->sblock.block_size);
+    if(buffer == NULL) return 0;
+
+    if(mfs_read(mnt, buffer, blockNo) == 0){
+        memcpy(&link, buffer, sizeof(group_linker));
+        if(grDescNo < link.no_descriptors){
+            memcpy(&grDesc, buffer + sizeof(group_linker) +
+                   grDescNo * sizeof(group_descriptor), sizeof(group_descriptor));
+            goal = grDesc.inode_table + mnt->sblock.inode_blocks;
+        }
+    }
+
+    mfs_blockPut(buffer, mnt->sblock.block_size);
+    return goal;
+}
+
+int mfs_allocInode(mfs_mount *mnt, inode *newInode, __u32 parent){
+    int     empty, policy = MFS_PICK_INODE;
+    __u32   blockNo, grDescNo, ino;
+
+    if(MFS_TYPE(newInode->mode) == 0 && parent == MFS_ROOT_INO) policy = MFS_PICK_SPREAD;
+    if(mfs_groupPick(mnt, mfs_inodeGroup(mnt, parent), policy, &blockNo,
+                     &grDescNo) == -1){
+        return -1;
+    }
+
+    empty = mfs_findFree(mnt, &blockNo, &grDescNo, 0);
+    while(empty == -2){
+        empty = mfs_findFree(mnt, &blockNo, &grDescNo, 0);
+    }
+    if(empty == -1) return -1;
+
+    /* Once the groups mfs_groupPick offers are full, mfs_findFree may still
+     * return a slot whose number does not fit in node_id. */
+    ino = (mfs_groupNumber(mnt, blockNo, grDescNo) << mnt->groupShift) + empty + 1;
+    if(ino > 0xffff) return -1;
+    newInode->node_id = ino;
+
+    return mfs_writeInode(mnt, newInode, blockNo, grDescNo, empty, 0);
+}
+
+int mfs_allocBlock(mfs_mount *mnt, char *data, __u32 *array, __u32 index, __u32 near){
+    int     empty;
+    __u32   blockNo, grDescNo;
+
+    if(mfs_groupPick(mnt, mfs_inodeGroup(mnt, near), MFS_PICK_BLOCK, &blockNo,
+                     &grDescNo) == -1){
+        return -1;
+    }
+
+    empty = mfs_findFree(mnt, &blockNo, &grDescNo, 1);
+    while(empty == -2){
+        empty = mfs_findFree(mnt, &blockNo, &grDescNo, 1);
+    }
+    if(empty == -1) return -1;
+
+    return mfs_writeData(mnt, data, blockNo, grDescNo, array, empty, index);
+}
+
+void mfs_fileInit(mfs_mount *mnt, inode *file){
+    mfs_extent_header   *hdr;
+
+    memset(file->datablocks, 0, sizeof(file->datablocks));
+    file->mode = 1;
+    if(mnt->sblock.feature_incompat & MFS_FEATURE_EXTENTS){
+        file->mode |= MFS_MODE_EXTENTS;
+        hdr = (mfs_extent_header *) file->datablocks;
+        hdr->magic = MFS_EXTENT_MAGIC;
+        hdr->max = (sizeof(file->datablocks) - sizeof(mfs_extent_header)) /
+                   sizeof(mfs_extent);
+    }
+    if(mnt->sblock.feature_incompat & MFS_FEATURE_INLINE){
+        file->mode |= MFS_MODE_INLINE;
+    }
+}
+
+int mfs_inlineSpill(mfs_mount *mnt, inode *file){
+    int             err = 0;
+    char            *buffer;
+    __u32           physical;
+    mfs_blockmap    map;
+
+    buffer = mfs_blockZero(mnt->sblock.block_size);
+    if(buffer == NULL){
+        perror("mfs_inlineSpill malloc");
+        return -1;
+    }
+    memcpy(buffer, file->datablocks, file->file_size);
+
+    mfs_fileInit(mnt, file);
+    file->mode &= ~MFS_MODE_INLINE;
+    if(file->file_size){
+        if(mfs_mapInit(&map, mnt, file) == -1){
+            mfs_blockPut(buffer, mnt->sblock.block_size);
+            return -1;
+        }
+        err = mfs_mapResolve(&map, 0, &physical, buffer);
+        mfs_mapDestroy(&map);
+    }
+
+    mfs_blockPut(buffer, mnt->sblock.block_size);
+    return err == -1 ? -1 : 0;
+}
+
+int mfs_tailPrepare(mfs_mount *mnt, inode *file){
+    __u32               tail;
+    mfs_extent_header   *hdr;
+
+    tail = file->file_size & mnt->blockMask;
+    if(!(mnt->sblock.feature_incompat & MFS_FEATURE_TAILS) ||
+       (file->mode & (MFS_MODE_INLINE | MFS_MODE_COMPRESS)) || tail == 0 ||
+       tail > mnt->sblock.block_size / 2){
+        return 0;
+    }
+    if(file->mode & MFS_MODE_EXTENTS){
+        hdr = (mfs_extent_header *) file->datablocks;
+        hdr->max = (MFS_TAIL_BLOCK * 4 - sizeof(mfs_extent_header)) / sizeof(mfs_extent);
+    }else if((file->file_size >> mnt->blockShift) > DATABLOCK_NUM - 3 +
+             mnt->sblock.block_size / 4){
+        return 0;
+    }
+    file->mode |= MFS_MODE_TAIL;
+
+    return 1;
+}
+
+int mfs_tailPack(mfs_mount *mnt, inode *file, char *data, __u32 length){
+    char    *buffer;
+    __u32   used = 0, frag;
+
+    buffer = mfs_blockZero(mnt->sblock.block_size);
+    if(buffer == NULL){
+        perror("mfs_tailPack malloc");
+        return -1;
+    }
+
+    frag = mnt->sblock.frag_block;
+    if(frag != 0){
+        if(mfs_read(mnt, buffer, frag) == -1){
+            mfs_blockPut(buffer, mnt->sblock.block_size);
+            return -1;
+        }
+        memcpy(&used, buffer, 4);
+    }
+    if(frag == 0 || used + length > mnt->sblock.block_size){
+        memset(buffer, 0, mnt->sblock.block_size);
+        used = 4;
+        memcpy(buffer, &used, 4);
+        if(mfs_allocBlock(mnt, buffer, &frag, 0, file->node_id) == -1){
+            mfs_blockPut(buffer, mnt->sblock.block_size);
+            return -1;
+        }
+        mnt->sblock.frag_block = frag;
+        if(mfs_writeSuperblock(mnt) == -1){
+            mfs_blockPut(buffer, mnt->sblock.block_size);
+            return -1;
+        }
+    }
+
+    memcpy(buffer + used, data, length);
+    file->datablocks[MFS_TAIL_BLOCK] = frag;
+    file->datablocks[MFS_TAIL_WHERE] = used << 16 | length;
+    used += length;
+    memcpy(buffer, &used, 4);
+    if(mfs_write(mnt, buffer, frag) == -1){
+        mfs_blockPut(buffer, mnt->sblock.block_size);
+        return -1;
+    }
+
+    mfs_blockPut(buffer, mnt->sblock.block_size);
+    return 0;
+}
+
+int mfs_tailRead(mfs_mount *mnt, inode *file, char *buffer){
+    __u32   offset, length;
+
+    offset = file->datablocks[MFS_TAIL_WHERE] >> 16;
+    length = file->datablocks[MFS_TAIL_WHERE] & 0xffff;
+    if(offset + length > mnt->sblock.block_size ||
+       mfs_read(mnt, buffer, file->datablocks[MFS_TAIL_BLOCK]) == -1){
+        return -1;
+    }
+    memmove(buffer, buffer + offset, length);
+    memset(buffer + length, 0, mnt->sblock.block_size - length);
+
+    return 0;
+}
+
+int mfs_tailUnpack(mfs_mount *mnt, inode *file){
+    int                 err;
+    char                *buffer;
+    __u32               physical;
+    mfs_blockmap        map;
+    mfs_extent_header   *hdr;
+
+    buffer = mfs_blockGet(mnt->sblock.block_size);
+    if(buffer == NULL){
+        perror("mfs_tailUnpack malloc");
+        return -1;
+    }
+    if(mfs_tailRead(mnt, file, buffer) == -1){
+        mfs_blockPut(buffer, mnt->sblock.block_size);
+        return -1;
+    }
+
+    file->mode &= ~MFS_MODE_TAIL;
+    file->datablocks[MFS_TAIL_BLOCK] = 0;
+    file->datablocks[MFS_TAIL_WHERE] = 0;
+    if(file->mode & MFS_MODE_EXTENTS){
+        hdr = (mfs_extent_header *) file->datablocks;
+        hdr->max = (sizeof(file->datablocks) - sizeof(mfs_extent_header)) /
+                   sizeof(mfs_extent);
+    }
+
+    if(mfs_mapInit(&map, mnt, file) == -1){
+        mfs_blockPut(buffer, mnt->sblock.block_size);
+        return -1;
+    }
+    err = mfs_mapResolve(&map, file->file_size >> mnt->blockShift, &physical, buffer);
+    mfs_mapDestroy(&map);
+
+    mfs_blockPut(buffer, mnt->sblock.block_size);
+    return err == -1 ? -1 : 0;
+}
+
+int mfs_freeBlocks(mfs_mount *mnt, __u32 block, __u32 count){
+    char                *buffer, *bitmap, *buffers[2];
+    __u32               blockNo = 1, i, j, start, blocks[2];
+    group_linker        link;
+    group_descriptor    grDesc;
+
+    buffer = mfs_blockGet(mnt->sblock.block_size);
+    bitmap = mfs_blockGet(mnt->sblock.block_size);
+    if(buffer == NULL || bitmap == NULL){
+        perror("mfs_freeBlocks malloc");
+        mfs_blockPut(buffer, mnt->sblock.block_size);
+        mfs_blockPut(bitmap, mnt->sblock.block_size);
+        return -1;
+    }
+
+    while(blockNo != 0){
+        if(mfs_read(mnt, buffer, blockNo) == -1) break;
+        memcpy(&link, buffer, sizeof(group_linker));
+        for(i = 0; i < link.no_descriptors; i++){
+            memcpy(&grDesc, buffer + sizeof(group_linker) + i * sizeof(group_descriptor),
+                   sizeof(group_descriptor));
+            start = grDesc.inode_table + mnt->sblock.inode_blocks;
+            if(block < start || block + count > start + mnt->sblock.blocks_per_group){
+                continue;
+            }
+
+            if(mfs_read(mnt, bitmap, grDesc.block_bitmap) == -1) break;
+            for(j = 0; j < count; j++){
+                mfs_clearBit(bitmap, block - start + j);
+                if(grDesc.free_blocks < 0xffff) grDesc.free_blocks++;
+            }
+            memcpy(buffer + sizeof(group_linker) + i * sizeof(group_descriptor),
+                   &grDesc, sizeof(group_descriptor));
+            buffers[0] = bitmap;
+            buffers[1] = buffer;
+            blocks[0] = grDesc.block_bitmap;
+            blocks[1] = blockNo;
+            if(mfs_writeVec(mnt, buffers, blocks, 2) == -1) break;
+            mfs_freemapMark(mnt, block, count, 0);
+            mfs_blockPut(buffer, mnt->sblock.block_size);
+            mfs_blockPut(bitmap, mnt->sblock.block_size);
+            return 0;
+        }
+        if(i < link.no_descriptors) break;
+        blockNo = link.next_block;
+    }
+
+    mfs_blockPut(buffer, mnt->sblock.block_size);
+    mfs_blockPut(bitmap, mnt->sblock.block_size);
+    return -1;
+}
+
+int mfs_freeInode(mfs_mount *mnt, inode *file){
+    int                 err = -1;
+    char                *buffer, *bitmap, *buffers[2];
+    __u32               blockNo, grDescNo, index, blocks[2];
+    group_descriptor    grDesc;
+
+    if(mfs_mapRelease(mnt, file) == -1 ||
+       mfs_groupLocate(mnt, (file->node_id - 1) >> mnt->groupShift, &blockNo,
+                       &grDescNo) == -1){
+        return -1;
+    }
+    index = (file->node_id - 1) & mnt->groupMask;
+
+    buffer = mfs_blockGet(mnt->sblock.block_size);
+    bitmap = mfs_blockGet(mnt->sblock.block_size);
+    if(buffer == NULL || bitmap == NULL){
+        perror("mfs_freeInode malloc");
+    }else if(mfs_read(mnt, buffer, blockNo) == 0){
+        memcpy(&grDesc, buffer + sizeof(group_linker) + grDescNo * sizeof(group_descriptor),
+               sizeof(group_descriptor));
+        if(mfs_read(mnt, bitmap, grDesc.inode_bitmap) == 0){
+            mfs_clearBit(bitmap, index);
+            grDesc.free_inodes++;
+            memcpy(buffer + sizeof(group_linker) + grDescNo * sizeof(group_descriptor),
+                   &grDesc, sizeof(group_descriptor));
+            buffers[0] = bitmap;
+            buffers[1] = buffer;
+            blocks[0] = grDesc.inode_bitmap;
+            blocks[1] = blockNo;
+            err = mfs_writeVec(mnt, buffers, blocks, 2);
+        }
+    }
+
+    mfs_blockPut(buffer, mnt->sblock.block_size);
+    mfs_blockPut(bitmap, mnt->sblock.block_size);
+    return err;
+}
+
+int mfs_findRun(mfs_mount *mnt, __u32 count, __u32 goal, __u32 *blockNo,
+                __u32 *grDescNo, __u32 *pos){
+    return mfs_freemapFind(mnt, count, goal, blockNo, grDescNo, pos);
+}
+
+int mfs_mapInit(mfs_blockmap *map, mfs_mount *mnt, inode *file){
+    int i;
+
+    map->mnt = mnt;
+    map->file = file;
+    map->blockNo = 0;
+    map->grDescNo = 0;
+    map->goal = 0;
+    map->goalLeft = 0;
+    map->link = 0;
+    for(i = 0; i < 3; i++){
+        map->cached[i] = 0;
+        map->table[i] = mfs_blockGet(mnt->sblock.block_size);
+        if(map->table[i] == NULL){
+            perror("mfs_mapInit malloc");
+            while(i--) mfs_blockPut(map->table[i], mnt->sblock.block_size);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+void mfs_mapDestroy(mfs_blockmap *map){
+    int i;
+
+    for(i = 0; i < 3; i++) mfs_blockPut(map->table[i], map->mnt->sblock.block_size);
+}
+
+static int mfs_mapAlloc(mfs_blockmap *map, char *data, __u32 *array, __u32 index){
+    int empty;
+
+    if(map->goalLeft){
+        map->goalLeft--;
+        return mfs_writeData(map->mnt, data, map->blockNo,
+                             map->grDescNo, array, map->goal++, index);
+    }
+    if(map->blockNo == 0 && mfs_groupPick(map->mnt,
+                                          mfs_inodeGroup(map->mnt, map->file->node_id),
+                                          MFS_PICK_BLOCK, &map->blockNo,
+                                          &map->grDescNo) == -1){
+        return -1;
+    }
+
+    empty = mfs_findFree(map->mnt, &map->blockNo, &map->grDescNo, 1);
+    while(empty == -2){
+        empty = mfs_findFree(map->mnt, &map->blockNo, &map->grDescNo, 1);
+    }
+    if(empty == -1) return -1;
+
+    return mfs_writeData(map->mnt, data, map->blockNo, map->grDescNo,
+                         array, empty, index);
+}
+
+/* Like mfs_mapAlloc, for data blocks only, which may be linked instead. */
+static int mfs_mapData(mfs_blockmap *map, char *data, __u32 *array, __u32 index){
+    if(map->link == 0) return mfs_mapAlloc(map, data, array, index);
+    array[index] = map->link;
+    map->link = 0;
+
+    return 0;
+}
+
+static int mfs_mapTable(mfs_blockmap *map, int depth, __u32 block){
+    if(map->cached[depth - 1] == block) return 0;
+    if(mfs_read(map->mnt, (char *) map->table[depth - 1], block) == -1){
+        map->cached[depth - 1] = 0;
+        return -1;
+    }
+    map->cached[depth - 1] = block;
+
+    return 0;
+}
+
+static void mfs_extInvalidate(mfs_blockmap *map){
+    int i;
+
+    for(i = 0; i < 3; i++) map->cached[i] = 0;
+}
+
+/* Index of the last extent starting at or before logical, -1 if none. */
+static int mfs_extSearch(mfs_extent_header *hdr, __u32 logical){
+    int         lo = 0, hi, mid, found = -1;
+    mfs_extent  *ext;
+
+    ext = (mfs_extent *) (hdr + 1);
+    hi = hdr->entries - 1;
+    while(lo <= hi){
+        mid = (lo + hi) / 2;
+        if(ext[mid].logical <= logical){
+            found = mid;
+            lo = mid + 1;
+        }else{
+            hi = mid - 1;
+        }
+    }
+
+    return found;
+}
+
+static int mfs_extWrite(mfs_blockmap *map, mfs_extent_header *hdr, __u32 block){
+    if(block == 0) return 0;
+    return mfs_write(map->mnt, (char *) hdr, block);
+}
+
+/* Descends to the leaf responsible for logical and stores its block (0 for the
+ * inode itself). With lower != 0 index keys are lowered to logical on the way
+ * down, so that an extent inserted before a subtree is found again. */
+static mfs_extent_header* mfs_extLeaf(mfs_blockmap *map, __u32 logical,
+                                      __u32 *block, int lower){
+    int                 idx, depth;
+    mfs_extent          *ext;
+    mfs_extent_header   *hdr;
+
+    hdr = (mfs_extent_header *) map->file->datablocks;
+    *block = 0;
+    while(hdr->depth > 0){
+        depth = hdr->depth;
+        ext = (mfs_extent *) (hdr + 1);
+        idx = mfs_extSearch(hdr, logical);
+        if(idx == -1){
+            if(!lower) return hdr;
+            ext[0].logical = logical;
+            if(mfs_extWrite(map, hdr, *block) == -1) return NULL;
+            idx = 0;
+        }
+        *block = ext[idx].physical;
+        if(depth > MFS_EXTENT_DEPTH || mfs_mapTable(map, depth, *block) == -1){
+            return NULL;
+        }
+        hdr = (mfs_extent_header *) map->table[depth - 1];
+        if(hdr->magic != MFS_EXTENT_MAGIC || hdr->depth != depth - 1){
+            map->cached[depth - 1] = 0;
+            return NULL;
+        }
+    }
+
+    return hdr;
+}
+
+static int mfs_extLookup(mfs_blockmap *map, __u64 logical, __u32 *physical,
+                         __u32 *length){
+    int                 idx;
+    __u32               block;
+    mfs_extent          *ext;
+    mfs_extent_header   *hdr;
+
+    *physical = 0;
+    *length = 1;
+    hdr = (mfs_extent_header *) map->file->datablocks;
+    if(logical > 0xffffffffULL) return -1;
+    if(hdr->magic != MFS_EXTENT_MAGIC) return 0;
+
+    hdr = mfs_extLeaf(map, logical, &block, 0);
+    if(hdr == NULL) return -1;
+    if(hdr->depth > 0) return 0;
+
+    ext = (mfs_extent *) (hdr + 1);
+    idx = mfs_extSearch(hdr, logical);
+    if(idx >= 0 && logical < (__u64) ext[idx].logical + ext[idx].length){
+        *physical = ext[idx].physical + (logical - ext[idx].logical);
+        *length = ext[idx].logical + ext[idx].length - logical;
+    }else if(idx + 1 < hdr->entries){
+        *length = ext[idx + 1].logical - logical;
+    }
+
+    return 0;
+}
+
+/* Moves the entries of a full root into a new block and adds a level. */
+static int mfs_extGrow(mfs_blockmap *map){
+    __u32               child;
+    mfs_extent_header   *root, *hdr;
+    mfs_extent          *ext;
+
+    root = (mfs_extent_header *) map->file->datablocks;
+    if(root->depth == MFS_EXTENT_DEPTH) return -1;
+
+    hdr = mfs_blockZero(map->mnt->sblock.block_size);
+    if(hdr == NULL){
+        perror("mfs_extGrow malloc");
+        return -1;
+    }
+    hdr->magic = MFS_EXTENT_MAGIC;
+    hdr->entries = root->entries;
+    hdr->max = (map->mnt->sblock.block_size - sizeof(mfs_extent_header)) /
+               sizeof(mfs_extent);
+    hdr->depth = root->depth;
+    memcpy(hdr + 1, root + 1, root->entries * sizeof(mfs_extent));
+    if(mfs_mapAlloc(map, (char *) hdr, &child, 0) == -1){
+        mfs_blockPut(hdr, map->mnt->sblock.block_size);
+        return -1;
+    }
+
+    ext = (mfs_extent *) (root + 1);
+    ext[0].logical = ((mfs_extent *) (hdr + 1))[0].logical;
+    ext[0].physical = child;
+    ext[0].length = 0;
+    root->entries = 1;
+    root->depth++;
+    mfs_extInvalidate(map);
+    mfs_blockPut(hdr, map->mnt->sblock.block_size);
+
+    return 0;
+}
+
+/* Splits the full child at index idx of hdr (stored in block) in two halves. */
+static int mfs_extSplit(mfs_blockmap *map, mfs_extent_header *hdr, __u32 block,
+                        int idx, mfs_extent_header *child){
+    int                 half;
+    __u32               right;
+    mfs_extent          *ext;
+    mfs_extent_header   *split;
+
+    split = mfs_blockZero(map->mnt->sblock.block_size);
+    if(split == NULL){
+        perror("mfs_extSplit malloc");
+        return -1;
+    }
+    half = child->entries / 2;
+    memcpy(split, child, sizeof(mfs_extent_header));
+    split->entries = child->entries - half;
+    memcpy(split + 1, (mfs_extent *) (child + 1) + half,
+           split->entries * sizeof(mfs_extent));
+    child->entries = half;
+
+    ext = (mfs_extent *) (hdr + 1);
+    if(mfs_mapAlloc(map, (char *) split, &right, 0) == -1 ||
+       mfs_write(map->mnt, (char *) child, ext[idx].physical) == -1){
+        mfs_extInvalidate(map);
+        mfs_blockPut(split, map->mnt->sblock.block_size);
+        return -1;
+    }
+
+    memmove(ext + idx + 2, ext + idx + 1, (hdr->entries - idx - 1) * sizeof(mfs_extent));
+    ext[idx + 1].logical = ((mfs_extent *) (split + 1))[0].logical;
+    ext[idx + 1].physical = right;
+    ext[idx + 1].length = 0;
+    hdr->entries++;
+    mfs_extInvalidate(map);
+    mfs_blockPut(split, map->mnt->sblock.block_size);
+
+    return mfs_extWrite(map, hdr, block);
+}
+
+static int mfs_extInsert(mfs_blockmap *map, __u32 logical, __u32 physical){
+    int                 idx, depth;
+    __u32               block;
+    mfs_extent          *ext;
+    mfs_extent_header   *hdr, *child;
+
+    hdr = mfs_extLeaf(map, logical, &block, 1);
+    if(hdr == NULL) return -1;
+    ext = (mfs_extent *) (hdr + 1);
+    idx = mfs_extSearch(hdr, logical);
+    if(idx >= 0 && ext[idx].logical + ext[idx].length == logical &&
+       ext[idx].physical + ext[idx].length == physical){
+        ext[idx].length++;
+        return mfs_extWrite(map, hdr, block);
+    }
+    if(idx + 1 < hdr->entries && ext[idx + 1].logical == logical + 1 &&
+       ext[idx + 1].physical == physical + 1){
+        ext[idx + 1].logical--;
+        ext[idx + 1].physical--;
+        ext[idx + 1].length++;
+        return mfs_extWrite(map, hdr, block);
+    }
+
+    /* A new extent is needed: split full nodes on the way down so that the
+     * leaf and every parent have room. */
+    hdr = (mfs_extent_header *) map->file->datablocks;
+    if(hdr->entries == hdr->max && mfs_extGrow(map) == -1) return -1;
+    block = 0;
+    while(hdr->depth > 0){
+        depth = hdr->depth;
+        ext = (mfs_extent *) (hdr + 1);
+        idx = mfs_extSearch(hdr, logical);
+        if(idx == -1){
+            ext[0].logical = logical;
+            if(mfs_extWrite(map, hdr, block) == -1) return -1;
+            idx = 0;
+        }
+        if(mfs_mapTable(map, depth, ext[idx].physical) == -1) return -1;
+        child = (mfs_extent_header *) map->table[depth - 1];
+        if(child->entries == child->max){
+            if(mfs_extSplit(map, hdr, block, idx, child) == -1) return -1;
+            continue;
+        }
+        block = ext[idx].physical;
+        hdr = child;
+    }
+
+    ext = (mfs_extent *) (hdr + 1);
+    idx = mfs_extSearch(hdr, logical) + 1;
+    memmove(ext + idx + 1, ext + idx, (hdr->entries - idx) * sizeof(mfs_extent));
+    ext[idx].logical = logical;
+    ext[idx].physical = physical;
+    ext[idx].length = 1;
+    hdr->entries++;
+
+    return mfs_extWrite(map, hdr, block);
+}
+
+int mfs_mapResolve(mfs_blockmap *map, __u64 logical, __u32 *physical, char *fill){
+    int     level, depth, created = 0;
+    __u32   cur, idx, slot, shift, *table;
+
+    *physical = 0;
+
+    if(map->file->mode & MFS_MODE_INLINE) return -1;
+    if(map->file->mode & MFS_MODE_EXTENTS){
+        if(mfs_extLookup(map, logical, physical, &cur) == -1) return -1;
+        if(*physical != 0 || fill == NULL) return 0;
+        if(mfs_mapData(map, fill, &cur, 0) == -1 ||
+           mfs_extInsert(map, logical, cur) == -1){
+            return -1;
+        }
+        *physical = cur;
+        return 1;
+    }
+
+    if(logical < DATABLOCK_NUM - 3){
+        if(map->file->datablocks[logical] == 0 && fill != NULL){
+            if(mfs_mapData(map, fill, map->file->datablocks, logical) == -1){
+                return -1;
+            }
+            created = 1;
+        }
+        *physical = map->file->datablocks[logical];
+        return created;
+    }
+
+    logical -= DATABLOCK_NUM - 3;
+    shift = map->mnt->ptrShift;
+    for(level = 1; level < 4 && logical >> shift; level++){
+        logical -= (__u64) 1 << shift;
+        shift += map->mnt->ptrShift;
+    }
+    if(level == 4) return -1;
+
+    slot = DATABLOCK_NUM - 4 + level;
+    if(map->file->datablocks[slot] == 0){
+        if(fill == NULL) return 0;
+        memset(map->table[level - 1], 0, map->mnt->sblock.block_size);
+        if(mfs_mapAlloc(map, (char *) map->table[level - 1], map->file->datablocks,
+                        slot) == -1){
+            map->cached[level - 1] = 0;
+            return -1;
+        }
+        map->cached[level - 1] = map->file->datablocks[slot];
+    }
+    cur = map->file->datablocks[slot];
+
+    for(depth = level; depth > 0; depth--){
+        shift -= map->mnt->ptrShift;
+        idx = (logical >> shift) & ((1U << map->mnt->ptrShift) - 1);
+        if(mfs_mapTable(map, depth, cur) == -1) return -1;
+        table = map->table[depth - 1];
+        if(table[idx] == 0){
+            if(fill == NULL) return 0;
+            if(depth > 1){
+                memset(map->table[depth - 2], 0, map->mnt->sblock.block_size);
+                map->cached[depth - 2] = 0;
+            }
+            if((depth == 1 ? mfs_mapData(map, fill, table, idx) :
+                mfs_mapAlloc(map, (char *) map->table[depth - 2], table, idx)) == -1 ||
+               mfs_write(map->mnt, (char *) table, cur) == -1){
+                map->cached[depth - 1] = 0;
+                return -1;
+            }
+            if(depth > 1) map->cached[depth - 2] = table[idx];
+            else created = 1;
+        }
+        cur = table[idx];
+    }
+
+    *physical = cur;
+    return created;
+}
+
+int mfs_mapRun(mfs_blockmap *map, __u64 logical, __u32 count, __u32 *physical,
+               __u32 *length){
+    __u32   next;
+
+    if(map->file->mode & MFS_MODE_INLINE) return -1;
+    if(map->file->mode & MFS_MODE_EXTENTS){
+        if(mfs_extLookup(map, logical, physical, length) == -1) return -1;
+        if(*length > count) *length = count;
+        return 0;
+    }
+
+    if(mfs_mapResolve(map, logical, physical, NULL) == -1) return -1;
+    *length = 1;
+    while(*length < count){
+        if(mfs_mapResolve(map, logical + *length, &next, NULL) == -1) return -1;
+        if(*physical == 0 ? next != 0 : next != *physical + *length) break;
+        (*length)++;
+    }
+
+    return 0;
+}
+
+/* Data blocks of a deduplicated file may be shared and go through dedup. */
+static int mfs_releaseData(mfs_mount *mnt, __u32 block, __u32 count, int shared){
+    if(shared) return mfs_dedupFree(mnt, block, count);
+    return mfs_freeBlocks(mnt, block, count);
+}
+
+static int mfs_releaseIndirect(mfs_mount *mnt, __u32 block, int depth, int shared){
+    __u32   i, *table;
+    int     err = 0;
+
+    if(depth > 0){
+        table = mfs_blockGet(mnt->sblock.block_size);
+        if(table == NULL){
+            perror("mfs_mapRelease malloc");
+            return -1;
+        }
+        if(mfs_read(mnt, (char *) table, block) == -1){
+            mfs_blockPut(table, mnt->sblock.block_size);
+            return -1;
+        }
+        for(i = 0; i < mnt->sblock.block_size / 4 && !err; i++){
+            if(table[i] != 0) err = mfs_releaseIndirect(mnt, table[i], depth - 1, shared);
+        }
+        mfs_blockPut(table, mnt->sblock.block_size);
+        if(err) return -1;
+        return mfs_freeBlocks(mnt, block, 1);
+    }
+
+    return mfs_releaseData(mnt, block, 1, shared);
+}
+
+static int mfs_releaseExtents(mfs_mount *mnt, mfs_extent_header *hdr, int shared){
+    int                 i, err = 0;
+    mfs_extent          *ext;
+    mfs_extent_header   *child;
+
+    ext = (mfs_extent *) (hdr + 1);
+    if(hdr->depth == 0){
+        for(i = 0; i < hdr->entries && !err; i++){
+            err = mfs_releaseData(mnt, ext[i].physical, ext[i].length, shared);
+        }
+        return err;
+    }
+
+    child = mfs_blockGet(mnt->sblock.block_size);
+    if(child == NULL){
+        perror("mfs_mapRelease malloc");
+        return -1;
+    }
+    for(i = 0; i < hdr->entries && !err; i++){
+        err = mfs_read(mnt, (char *) child, ext[i].physical);
+        if(!err && child->magic == MFS_EXTENT_MAGIC && child->depth == hdr->depth - 1){
+            err = mfs_releaseExtents(mnt, child, shared);
+        }
+        if(!err) err = mfs_freeBlocks(mnt, ext[i].physical, 1);
+    }
+    mfs_blockPut(child, mnt->sblock.block_size);
+
+    return err;
+}
+
+int mfs_mapRelease(mfs_mount *mnt, inode *file){
+    int                 i, slots;
+    mfs_extent_header   *hdr;
+
+    if(file->mode & MFS_MODE_INLINE) return 0;
+    if(file->mode & MFS_MODE_EXTENTS){
+        hdr = (mfs_extent_header *) file->datablocks;
+        if(hdr->magic != MFS_EXTENT_MAGIC) return 0;
+        return mfs_releaseExtents(mnt, hdr, (file->mode & MFS_MODE_DEDUP) != 0);
+    }
+
+    slots = file->mode & MFS_MODE_TAIL ? MFS_TAIL_BLOCK : DATABLOCK_NUM;
+    for(i = 0; i < slots; i++){
+        if(file->datablocks[i] == 0) continue;
+        if(mfs_releaseIndirect(mnt, file->datablocks[i],
+                               MFS_TYPE(file->mode) == 0 || i < DATABLOCK_NUM - 3 ?
+                               0 : i - (DATABLOCK_NUM - 4),
+                               (file->mode & MFS_MODE_DEDUP) != 0) == -1){
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int mfs_clearEntry(mfs_mount *mnt, inode *dir, inode *toClear){
+    char            *buffer;
+    int             i = 0;
+    int             curOffset, offset;
+    __u32           dead;
+    directory_entry entry;
+
+    buffer = mfs_blockGet(mnt->sblock.block_size);
+    if(buffer == NULL){
+        perror("mfs_clearEntry malloc");
+        return -1;
+    }
+
+    while(i < DATABLOCK_NUM && dir->datablocks[i] != 0){
+        if(mfs_read(mnt, buffer, dir->datablocks[i]) == -1){
+            mfs_blockPut(buffer, mnt->sblock.block_size);
+            return -1;
+        }
+        memcpy(&offset, buffer, 4);
+        curOffset = 4;
+        while(curOffset < offset){
+            memcpy(&entry, buffer + curOffset, sizeof(directory_entry));
+            if(entry.inodeptr == toClear->node_id){
+                entry.inodeptr = 0;
+                memcpy(buffer + curOffset, &entry, sizeof(directory_entry));
+                if(mfs_write(mnt, buffer, dir->datablocks[i]) == -1){
+                    mfs_blockPut(buffer, mnt->sblock.block_size);
+                    return -1;
+                }
+
+                dead = 0;
+                for(curOffset = 4; curOffset < offset; curOffset += entry.rec_len){
+                    memcpy(&entry, buffer + curOffset, sizeof(directory_entry));
+                    if(entry.inodeptr == 0) dead += entry.rec_len;
+                }
+                mfs_blockPut(buffer, mnt->sblock.block_size);
+                if(dead * 100 >= (offset - 4) * MFS_COMPACT_THRESHOLD &&
+                   mfs_compactDir(mnt, dir, NULL) == -1){
+                    return -1;
+                }
+                return 0;
+            }
+            curOffset += entry.rec_len;
+        }
+        i++;
+    }
+
+    mfs_blockPut(buffer, mnt->sblock.block_size);
+    return -1;
+}
+
+int mfs_compactDir(mfs_mount *mnt, inode *dir, __u32 *reclaimed){
+    int             freed = 0;
+    char            *in, *out;
+    __u32           i, j, offset, curOffset, outOffset = 4, outBlock = 0, dead = 0,
+                    length;
+    directory_entry entry;
+
+    in = mfs_blockGet(mnt->sblock.block_size);
+    out = mfs_blockZero(mnt->sblock.block_size);
+    if(in == NULL || out == NULL){
+        perror("mfs_compactDir malloc");
+        mfs_blockPut(in, mnt->sblock.block_size);
+        mfs_blockPut(out, mnt->sblock.block_size);
+        return -1;
+    }
+
+    for(i = 0; i < DATABLOCK_NUM && dir->datablocks[i] != 0; i++){
+        if(mfs_read(mnt, in, dir->datablocks[i]) == -1){
+            mfs_blockPut(in, mnt->sblock.block_size);
+            mfs_blockPut(out, mnt->sblock.block_size);
+            return -1;
+        }
+        memcpy(&offset, in, 4);
+        for(curOffset = 4; curOffset < offset; curOffset += entry.rec_len){
+            memcpy(&entry, in + curOffset, sizeof(directory_entry));
+            if(entry.rec_len == 0) break;
+            length = sizeof(directory_entry) + entry.name_len;
+            dead += entry.rec_len;
+            if(entry.inodeptr == 0) continue;
+            dead -= length;
+
+            if(outOffset + length >= mnt->sblock.block_size){
+                memcpy(out, &outOffset, 4);
+                if(mfs_write(mnt, out, dir->datablocks[outBlock]) == -1){
+                    mfs_blockPut(in, mnt->sblock.block_size);
+                    mfs_blockPut(out, mnt->sblock.block_size);
+                    return -1;
+                }
+                memset(out, 0, mnt->sblock.block_size);
+                outOffset = 4;
+                outBlock++;
+            }
+            entry.rec_len = length;
+            memcpy(out + outOffset, &entry, sizeof(directory_entry));
+            memcpy(out + outOffset + sizeof(directory_entry),
+                   in + curOffset + sizeof(directory_entry), entry.name_len);
+            outOffset += length;
+        }
+    }
+
+    memcpy(out, &outOffset, 4);
+    if(mfs_write(mnt, out, dir->datablocks[outBlock]) == -1){
+        mfs_blockPut(in, mnt->sblock.block_size);
+        mfs_blockPut(out, mnt->sblock.block_size);
+        return -1;
+    }
+    for(j = outBlock + 1; j < i; j++){
+        if(mfs_freeBlocks(mnt, dir->datablocks[j], 1) == -1) break;
+        dir->datablocks[j] = 0;
+        dir->file_size -= mnt->sblock.block_size;
+        freed++;
+    }
+    if(freed && mfs_updateInode(mnt, dir) == -1) freed = -1;
+
+    if(reclaimed != NULL) *reclaimed = dead;
+    mfs_blockPut(in, mnt->sblock.block_size);
+    mfs_blockPut(out, mnt->sblock.block_size);
+    return freed;
+}
+
+char* mfs_extractPath(char *buffer){
+    int     len, i, flag = -1;
+    char    *path;
+
+    len = strlen(buffer);
+    path = malloc(len + 1);
+
+    i = len - 1;
+    while(i >= 0){
+        if(!flag){
+            path[i] = buffer[i];
+        }else if(buffer[i] == '/'){
+            flag = 0;
+            path[i] = '\0';
+        }
+        i--;
+    }
+
+    if(flag){
+        path[0] = '.';
+        path[1] = '\0';
+    }
+
+    return path;
 }
\ No newline at end of file
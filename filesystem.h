@@ -8,6 +8,46 @@
 #define DEFAULT_MAX_FILE_SIZE   17179869184
 #define DEFAULT_MAX_FILES       45
 #define DATABLOCK_NUM           15
+#define MFS_RUN_BLOCKS          64
+#define MFS_COMPACT_THRESHOLD   50
+
+/* Incompatible features: images using them must not be opened by code that
+ * does not know about them. */
+#define MFS_FEATURE_LARGE_IMAGE     0x0001
+#define MFS_FEATURE_EXTENTS         0x0002
+#define MFS_FEATURE_INLINE          0x0004
+#define MFS_FEATURE_TAILS           0x0008
+#define MFS_FEATURE_DEDUP           0x0010
+#define MFS_FEATURE_COMPRESS        0x0020
+#define MFS_FEATURE_OVERLAY         0x0040
+#define MFS_FEATURE_SUPPORTED       (MFS_FEATURE_LARGE_IMAGE | MFS_FEATURE_EXTENTS | \
+                                     MFS_FEATURE_INLINE | MFS_FEATURE_TAILS | \
+                                     MFS_FEATURE_DEDUP | MFS_FEATURE_COMPRESS | \
+                                     MFS_FEATURE_OVERLAY)
+
+/* The low byte of inode.mode is the file type (0 directory, 1 file), the high
+ * byte holds flags describing how the data is stored. */
+#define MFS_MODE_TYPE               0x00ff
+#define MFS_MODE_EXTENTS            0x0100
+#define MFS_MODE_INLINE             0x0200
+#define MFS_MODE_TAIL               0x0400
+#define MFS_MODE_DEDUP              0x0800
+#define MFS_MODE_COMPRESS           0x1000
+#define MFS_TYPE(mode)              ((mode) & MFS_MODE_TYPE)
+
+#define MFS_ROOT_INO                1
+
+#define MFS_EXTENT_MAGIC            0xf30a
+#define MFS_EXTENT_DEPTH            3
+
+/* Files with MFS_MODE_INLINE keep their data in the datablocks area. */
+#define MFS_INLINE_SIZE             (DATABLOCK_NUM * 4)
+
+/* Files with MFS_MODE_TAIL keep their last partial block in a shared fragment
+ * block: datablocks[MFS_TAIL_BLOCK] is the block, datablocks[MFS_TAIL_WHERE]
+ * holds offset << 16 | length. Fragment blocks start with their used size. */
+#define MFS_TAIL_BLOCK              (DATABLOCK_NUM - 2)
+#define MFS_TAIL_WHERE              (DATABLOCK_NUM - 1)
 
 typedef struct{
     __u32       inodes_count;
@@ -19,6 +59,12 @@ typedef struct{
     __u32       max_filename_size;
     __u32       max_directory_files;
     __u64       max_file_size;
+    __u32       feature_compat;
+    __u32       feature_incompat;
+    __u32       frag_block;
+    __u32       generation;
+    __u32       dedup_block;
+    __u32       dedup_blocks;
 }mfs_superblock;
 
 typedef struct{
@@ -31,6 +77,22 @@ typedef struct{
     __u32       datablocks[DATABLOCK_NUM];
 }inode;
 
+/* With MFS_MODE_EXTENTS the datablocks area holds a header and up to four
+ * extents. Deeper trees keep the same layout in whole blocks, where an index
+ * entry points (physical) at the node covering blocks from logical on. */
+typedef struct{
+    __u16       magic;
+    __u16       entries;
+    __u16       max;
+    __u16       depth;
+}mfs_extent_header;
+
+typedef struct{
+    __u32       logical;
+    __u32       physical;
+    __u32       length;
+}mfs_extent;
+
 typedef struct{
     __u32       next_block;
     __u32       no_descriptors;
@@ -52,28 +114,289 @@ typedef struct{
     __u8        file_type;
 }directory_entry;
 
-typedef struct list_node list_node;
+/* An open image. The geometry is derived from the superblock by
+ * mfs_mountGeometry: block sizes are powers of two, so block, bitmap and group
+ * arithmetic is done with shifts and masks. The inode (88 bytes) and the group
+ * linker do not divide a block evenly, so their counts come with a reciprocal
+ * and the division becomes a multiply. libmfs keeps its lock state and a
+ * scratch block here as well, the allocator its free-extent index, dedup
+ * its fingerprint table and an overlay image the map of its own blocks. While
+ * limit is non-zero nothing is allocated at or past that block. */
+typedef struct mfs_mount{
+    int             fd;
+    mfs_superblock  sblock;
+    __u32           blockShift;
+    __u32           blockMask;
+    __u32           groupShift;
+    __u32           groupMask;
+    __u32           ptrShift;
+    __u32           inodesPerBlock;
+    __u32           inodeRecip;
+    __u32           descPerBlock;
+    __u32           descRecip;
+    int             flags;
+    int             lockType;
+    int             lockDepth;
+    char            *buffer;
+    struct mfs_freemap *freemap;
+    struct mfs_dedup *dedup;
+    struct mfs_overlay *overlay;
+    __u32           limit;
+}mfs_mount;
+
+/* Walks the block map of one inode. The indirect block last read at each
+ * depth is kept so that sequential lookups only touch the data blocks. While
+ * goalLeft is non-zero, allocations take position goal, goal + 1, ... of the
+ * group at blockNo/grDescNo instead of searching. Otherwise the search starts
+ * there, or in the group of the inode while blockNo is 0. A non-zero link is
+ * mapped as the next data block instead of allocating and writing one. */
+typedef struct{
+    mfs_mount       *mnt;
+    inode           *file;
+    __u32           blockNo;
+    __u32           grDescNo;
+    __u32           goal;
+    __u32           goalLeft;
+    __u32           link;
+    __u32           cached[3];
+    __u32           *table[3];
+}mfs_blockmap;
+
+#define MFS_ARENA_CHUNK             65536
+#define MFS_BLOCK_ALIGN             4096
+#define MFS_POOL_BLOCKS             16
+#define MFS_POOL_CLASSES            12
+#define MFS_VEC_BLOCKS              256
+
+/* Bump allocator: memory is handed out from large chunks and only given back
+ * all at once, by mfs_arenaReset or mfs_arenaDestroy. */
+typedef struct mfs_arenaChunk mfs_arenaChunk;
 
-struct list_node{
-    list_node   *previous;
-    list_node   *next;
-    char        *filename;
-    inode       mds;
+struct mfs_arenaChunk{
+    mfs_arenaChunk  *next;
+    size_t          size;
+    size_t          used;
 };
 
 typedef struct{
-    list_node    *root;
-    int         size;
-}list_root;
+    mfs_arenaChunk  *chunks;
+    size_t          chunkSize;
+}mfs_arena;
+
+/* A directory listing: the fields ls prints, with the names in an arena. */
+typedef struct{
+    char        *name;
+    __u64       file_size;
+    __u32       creation_time;
+    __u32       access_time;
+    __u32       modification_time;
+    __u16       node_id;
+    __u16       mode;
+}mfs_listEntry;
+
+/* An entry returned by mfs_readdirPlus. name is not terminated. */
+typedef struct{
+    char        *name;
+    __u8        name_len;
+    __u8        file_type;
+    inode       attr;
+}mfs_direntPlus;
+
+#define MFS_DIRENT_ALL              0x1
+#define MFS_DIRENT_DIRS             0x2
+
+typedef struct{
+    mfs_listEntry   *entries;
+    int             count;
+    int             size;
+    mfs_arena       names;
+}mfs_list;
+
+/* Block buffers are aligned for O_DIRECT and come from a per-thread pool of
+ * up to MFS_POOL_BLOCKS buffers per block size, so the I/O paths do not call
+ * malloc once the pool is warm. mfs_blockDrain frees the calling thread's
+ * pool, threads that exit should call it. */
+void* mfs_blockGet(__u32 size);
+
+void* mfs_blockZero(__u32 size);
+
+void mfs_blockPut(void *buffer, __u32 size);
+
+void mfs_blockDrain();
+
+void mfs_arenaInit(mfs_arena *arena, size_t chunkSize);
+
+void* mfs_arenaAlloc(mfs_arena *arena, size_t size);
+
+char* mfs_arenaStrdup(mfs_arena *arena, const char *string);
+
+void mfs_arenaReset(mfs_arena *arena);
+
+void mfs_arenaDestroy(mfs_arena *arena);
+
+void mfs_listInit(mfs_list *list);
+
+int mfs_listAdd(mfs_list *list, inode *toAdd, char *filename, int name_len);
+
+/* Sorts by name, or by creation time and then name when byTime is set. */
+void mfs_listSort(mfs_list *list, int byTime);
+
+void mfs_listPrint(mfs_list *list, int lFlag);
+
+void mfs_listDestroy(mfs_list *list);
+
+/* Fills in the geometry of mnt from mnt->sblock. */
+void mfs_mountGeometry(mfs_mount *mnt);
+
+int mfs_insertEntry(mfs_mount *mnt, inode *folder, inode *toInsert, char *path);
+
+char* mfs_extractFilename(char *path);
+
+int mfs_writeInode(mfs_mount *mnt, inode *toInsert, __u32 blockNo,
+                   __u32 grDescNo, __u32 pos, int mode);
+
+int mfs_writeData(mfs_mount *mnt, char *toCopy, __u32 blockNo,
+                  __u32 grDescNo, __u32 *datablocks, __u32 pos, __u32 dataIndex);
+
+int mfs_followPath(mfs_mount *mnt, char *path, inode *ptr, int mode);
+
+int mfs_findEntry(mfs_mount *mnt, inode *curFolder, char *name, int file_type);
+
+int mfs_findInode(mfs_mount *mnt, __u32 inodeptr, inode *requested);
+
+/* Reads count inodes at once: inodes[i] receives inode inodeptrs[i], or gets a
+ * node_id of 0 if it does not exist. The requests are sorted by table block,
+ * so every block is read once. Returns the number found. */
+int mfs_findInodes(mfs_mount *mnt, __u32 *inodeptrs, inode *inodes, int count);
+
+/* Reads dir into buffer (DATABLOCK_NUM blocks) and returns its entries, in
+ * directory order, with their inodes fetched by mfs_findInodes. Names starting
+ * with '.' are only kept with MFS_DIRENT_ALL, only directories with
+ * MFS_DIRENT_DIRS. The names point into buffer; free *entries when done. */
+int mfs_readdirPlus(mfs_mount *mnt, inode *dir, char *buffer, int flags,
+                    mfs_direntPlus **entries);
+
+int mfs_findFree(mfs_mount *mnt, __u32 *blockNo, __u32 *grDescNo, int mode);
+
+void mfs_setBit(char *buffer, __u32 index);
+
+void mfs_clearBit(char *buffer, __u32 index);
+
+int mfs_testBit(char *buffer, __u32 index);
+
+__u32 mfs_fzeroBit(mfs_mount *mnt, __u32 offset);
+
+int mfs_newGroupDescriptor(mfs_mount *mnt, __u32 *blockNo,
+                           __u32 *grDescNo, group_linker *grlink, __u32 pos);
+
+int mfs_read(mfs_mount *mnt, char *buffer, __u32 block);
+
+int mfs_write(mfs_mount *mnt, char *buffer, __u32 block);
+
+int mfs_readBlocks(mfs_mount *mnt, char *buffer, __u32 block, __u32 count);
+
+int mfs_writeBlocks(mfs_mount *mnt, char *buffer, __u32 block, __u32 count);
+
+/* Transfer count blocks, each with its own buffer. Blocks that are adjacent
+ * on disk share one preadv or pwritev wherever their buffers are. Both arrays
+ * are sorted by block in place. */
+int mfs_readVec(mfs_mount *mnt, char **buffers, __u32 *blocks, int count);
+
+int mfs_writeVec(mfs_mount *mnt, char **buffers, __u32 *blocks, int count);
+
+/* Zeroes count blocks from block on, extending the image if needed. */
+int mfs_zeroBlocks(mfs_mount *mnt, __u32 block, __u32 count);
+
+/* Size of the image in blocks. */
+int mfs_imageBlocks(mfs_mount *mnt, __u64 *blocks);
+
+/* Makes count blocks from block on, past the end of the image, part of it.
+ * They read as zeros and their disk space is reserved up front. */
+int mfs_imageExtend(mfs_mount *mnt, __u32 block, __u32 count);
+
+/* Cuts the image down to its first blocks blocks. */
+int mfs_imageTruncate(mfs_mount *mnt, __u32 blocks);
+
+int mfs_writeSuperblock(mfs_mount *mnt);
+
+int mfs_groupLocate(mfs_mount *mnt, __u32 group, __u32 *blockNo, __u32 *grDescNo);
+
+__u32 mfs_groupNumber(mfs_mount *mnt, __u32 blockNo, __u32 grDescNo);
+
+int mfs_updateInode(mfs_mount *mnt, inode *toUpdate);
+
+/* Allocates an inode near its parent directory. Directories created in the
+ * root instead go to a roomy group, so that separate trees spread over the
+ * image. */
+int mfs_allocInode(mfs_mount *mnt, inode *newInode, __u32 parent);
+
+/* Allocates a block, searching from the group of inode near on. */
+int mfs_allocBlock(mfs_mount *mnt, char *data, __u32 *array, __u32 index, __u32 near);
+
+/* First data block of the group holding inode ino, 0 if unknown. A goal for
+ * mfs_findRun that keeps data next to its inode. */
+__u32 mfs_inodeGoal(mfs_mount *mnt, __u32 ino);
+
+/* Releases count blocks starting at block, all within one group. */
+int mfs_freeBlocks(mfs_mount *mnt, __u32 block, __u32 count);
+
+/* Releases the data of file and its inode, which nothing may point to. A
+ * packed tail stays in its fragment block. */
+int mfs_freeInode(mfs_mount *mnt, inode *file);
+
+/* Finds count free blocks in a row, as close after goal as possible, and
+ * stores the group and the position of the run. See freemap.h. */
+int mfs_findRun(mfs_mount *mnt, __u32 count, __u32 goal, __u32 *blockNo,
+                __u32 *grDescNo, __u32 *pos);
+
+/* Sets up a new regular file according to the features of the image. */
+void mfs_fileInit(mfs_mount *mnt, inode *file);
+
+/* Moves the data of an inline file into a data block and clears the flag. The
+ * caller must write back the inode afterwards. */
+int mfs_inlineSpill(mfs_mount *mnt, inode *file);
+
+/* Marks a new file of known size for tail packing if the image allows it and
+ * its last partial block is small enough. Returns 1 when marked. */
+int mfs_tailPrepare(mfs_mount *mnt, inode *file);
+
+int mfs_tailPack(mfs_mount *mnt, inode *file, char *data, __u32 length);
+
+/* Copies the tail of file to the start of buffer (one block in size). */
+int mfs_tailRead(mfs_mount *mnt, inode *file, char *buffer);
+
+/* Moves the tail of file back into a block of its own and clears the flag. The
+ * caller must write back the inode afterwards. */
+int mfs_tailUnpack(mfs_mount *mnt, inode *file);
+
+int mfs_mapInit(mfs_blockmap *map, mfs_mount *mnt, inode *file);
+
+void mfs_mapDestroy(mfs_blockmap *map);
+
+/* Maps logical block of the file to its physical block (0 for a hole). With
+ * fill != NULL missing blocks are allocated (data blocks initialised from fill)
+ * and 1 is returned when the data block itself was created. The caller must
+ * write back the inode afterwards. */
+int mfs_mapResolve(mfs_blockmap *map, __u64 logical, __u32 *physical, char *fill);
 
-list_root* mfs_listCreate();
+/* Maps up to count blocks starting at logical to one physically contiguous run
+ * (or one hole) and stores its start and length. */
+int mfs_mapRun(mfs_blockmap *map, __u64 logical, __u32 count, __u32 *physical,
+               __u32 *length);
 
-int mfs_listAddNodeAB(list_root *root, inode toAdd, char *filename, int name_len);
+/* Releases every data, indirect and extent-tree block of file. The inode
+ * itself is left untouched. */
+int mfs_mapRelease(mfs_mount *mnt, inode *file);
 
-int mfs_listAddNodeCT(list_root *root, inode toAdd, char *filename, int name_len);
+/* Tombstones the entry of toClear. Once MFS_COMPACT_THRESHOLD percent of the
+ * block is dead the directory is compacted, so callers must re-read dir. */
+int mfs_clearEntry(mfs_mount *mnt, inode *dir, inode *toClear);
 
-void mfs_listPrint(list_root root, int lFlag);
+/* Rewrites the blocks of dir without dead records and releases the blocks left
+ * empty at the end. Returns the number of released blocks and stores the
+ * number of reclaimed bytes in reclaimed (if not NULL). */
+int mfs_compactDir(mfs_mount *mnt, inode *dir, __u32 *reclaimed);
 
-void mfs_listDestroy(list_root *root);
+char* mfs_extractPath(char *buffer);
 
 #endif
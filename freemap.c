@@ -0,0 +1,307 @@
+#define _LARGEFILE64_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "freemap.h"
+
+/* Bit i of a bitmap word is (0x80000000 >> i) once loaded, see mfs_testBit. */
+static void mfs_freeLeaf(mfs_freeNode *node, __u32 word){
+    __u32   i, run = 0;
+
+    for(i = 0; i < 32 && !(word & (0x80000000U >> i)); i++);
+    node->head = i;
+    node->longest = 0;
+    for(i = 0; i < 32; i++){
+        if(word & (0x80000000U >> i)) run = 0;
+        else if(++run > node->longest) node->longest = run;
+    }
+    node->tail = run;
+}
+
+static void mfs_freeJoin(mfs_freeNode *tree, __u32 node, __u32 half){
+    mfs_freeNode    *left = &tree[2 * node], *right = &tree[2 * node + 1];
+
+    tree[node].head = left->head == half ? half + right->head : left->head;
+    tree[node].tail = right->tail == half ? half + left->tail : right->tail;
+    tree[node].longest = left->tail + right->head;
+    if(left->longest > tree[node].longest) tree[node].longest = left->longest;
+    if(right->longest > tree[node].longest) tree[node].longest = right->longest;
+}
+
+static void mfs_freeBuild(mfs_freeGroup *group, __u32 leaves){
+    __u32   i, width, half;
+
+    for(i = 0; i < leaves; i++) mfs_freeLeaf(&group->tree[leaves + i], group->words[i]);
+    for(width = leaves / 2, half = 32; width > 0; width /= 2, half *= 2){
+        for(i = width; i < 2 * width; i++) mfs_freeJoin(group->tree, i, half);
+    }
+}
+
+/* Scans bits from..31 of the word that holds bits lo..lo + 31, extending the
+ * free run in carry. */
+static int mfs_freeScan(__u32 word, __u32 lo, __u32 from, __u32 count, __u32 *carry,
+                        __u32 *start){
+    __u32   i;
+
+    for(i = from; i < 32; i++){
+        if(word & (0x80000000U >> i)){
+            *carry = 0;
+        }else if(++*carry >= count){
+            *start = lo + i + 1 - *carry;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+/* First run of count free bits inside node, which must have one. */
+static int mfs_freeLeftmost(mfs_freeGroup *group, __u32 leaves, __u32 node, __u32 lo,
+                            __u32 len, __u32 count, __u32 *start){
+    __u32           carry = 0;
+    mfs_freeNode    *left, *right;
+
+    while(node < leaves){
+        left = &group->tree[2 * node];
+        right = left + 1;
+        len /= 2;
+        if(left->longest >= count){
+            node = 2 * node;
+        }else if(left->tail + right->head >= count){
+            *start = lo + len - left->tail;
+            return 0;
+        }else{
+            node = 2 * node + 1;
+            lo += len;
+        }
+    }
+
+    return mfs_freeScan(group->words[node - leaves], lo, 0, count, &carry, start);
+}
+
+/* First run of count free bits starting at or after from. Nodes are visited
+ * left to right; carry is the free run that ends right before lo. */
+static int mfs_freeSearch(mfs_freeGroup *group, __u32 leaves, __u32 node, __u32 lo,
+                          __u32 len, __u32 from, __u32 count, __u32 *carry,
+                          __u32 *start){
+    mfs_freeNode    *cur = &group->tree[node];
+
+    if(lo + len <= from){
+        *carry = 0;
+        return -1;
+    }
+    if(lo >= from){
+        if(cur->head == len){
+            *carry += len;
+            if(*carry < count) return -1;
+            *start = lo + len - *carry;
+            return 0;
+        }
+        if(*carry + cur->head >= count){
+            *start = lo - *carry;
+            return 0;
+        }
+        if(cur->longest >= count){
+            return mfs_freeLeftmost(group, leaves, node, lo, len, count, start);
+        }
+        *carry = cur->tail;
+        return -1;
+    }
+
+    if(node >= leaves){
+        return mfs_freeScan(group->words[node - leaves], lo, from - lo, count, carry,
+                            start);
+    }
+    if(mfs_freeSearch(group, leaves, 2 * node, lo, len / 2, from, count, carry,
+                      start) == 0){
+        return 0;
+    }
+    return mfs_freeSearch(group, leaves, 2 * node + 1, lo + len / 2, len / 2, from,
+                          count, carry, start);
+}
+
+static mfs_freeGroup* mfs_freeGrow(mfs_freemap *map){
+    mfs_freeGroup   *group;
+
+    if(map->groups == map->size){
+        group = realloc(map->group, (map->size ? 2 * map->size : 16) *
+                        sizeof(mfs_freeGroup));
+        if(group == NULL) return NULL;
+        map->group = group;
+        map->size = map->size ? 2 * map->size : 16;
+    }
+    group = &map->group[map->groups];
+    group->words = malloc(map->leaves * sizeof(__u32) +
+                          2 * map->leaves * sizeof(mfs_freeNode));
+    if(group->words == NULL) return NULL;
+    group->tree = (mfs_freeNode *) (group->words + map->leaves);
+
+    return group;
+}
+
+static int mfs_freemapLoad(mfs_mount *mnt){
+    __u32               block = 1, i;
+    char                *buffer;
+    group_linker        link;
+    group_descriptor    grDesc;
+    mfs_freemap         *map;
+    mfs_freeGroup       *group;
+
+    if(mnt->freemap != NULL) return 0;
+
+    map = malloc(sizeof(mfs_freemap));
+    buffer = mfs_blockGet(mnt->sblock.block_size);
+    if(map == NULL || buffer == NULL){
+        perror("mfs_freemapLoad malloc");
+        free(map);
+        mfs_blockPut(buffer, mnt->sblock.block_size);
+        return -1;
+    }
+    map->groups = 0;
+    map->size = 0;
+    map->leaves = mnt->sblock.blocks_per_group / 32;
+    map->group = NULL;
+    mnt->freemap = map;
+
+    while(block != 0){
+        if(mfs_read(mnt, buffer, block) == -1) break;
+        memcpy(&link, buffer, sizeof(group_linker));
+        for(i = 0; i < link.no_descriptors; i++){
+            memcpy(&grDesc, buffer + sizeof(group_linker) + i * sizeof(group_descriptor),
+                   sizeof(group_descriptor));
+            group = mfs_freeGrow(map);
+            if(group == NULL){
+                perror("mfs_freemapLoad malloc");
+                break;
+            }
+            if(mfs_read(mnt, (char *) group->words, grDesc.block_bitmap) == -1){
+                free(group->words);
+                break;
+            }
+            group->start = grDesc.inode_table + mnt->sblock.inode_blocks;
+            group->blockNo = block;
+            group->grDescNo = i;
+            mfs_freeBuild(group, map->leaves);
+            map->groups++;
+        }
+        if(i < link.no_descriptors) break;
+        block = link.next_block;
+    }
+
+    mfs_blockPut(buffer, mnt->sblock.block_size);
+    if(block != 0){
+        mfs_freemapDrop(mnt);
+        return -1;
+    }
+    return 0;
+}
+
+/* Last group starting at or before block. */
+static __u32 mfs_freeGroupOf(mfs_freemap *map, __u32 block){
+    __u32   low = 0, high = map->groups, mid;
+
+    while(high - low > 1){
+        mid = (low + high) / 2;
+        if(map->group[mid].start <= block) low = mid;
+        else high = mid;
+    }
+    return low;
+}
+
+int mfs_freemapFind(mfs_mount *mnt, __u32 count, __u32 goal, __u32 *blockNo,
+                    __u32 *grDescNo, __u32 *pos){
+    __u32           first, from = 0, bits, carry, start, i;
+    mfs_freemap     *map;
+    mfs_freeGroup   *group;
+
+    if(mfs_freemapLoad(mnt) == -1) return -1;
+    map = mnt->freemap;
+    bits = map->leaves * 32;
+    if(count == 0 || count > bits || map->groups == 0) return -1;
+
+    first = mfs_freeGroupOf(map, goal);
+    if(goal >= map->group[first].start) from = goal - map->group[first].start;
+    if(from >= bits){
+        first = (first + 1) % map->groups;
+        from = 0;
+    }
+
+    for(i = 0; i <= map->groups; i++){
+        if(i == map->groups && from == 0) break;
+        group = &map->group[(first + i) % map->groups];
+        if(group->tree[1].longest < count) continue;
+        if(mnt->limit != 0 && group->start >= mnt->limit) continue;
+        carry = 0;
+        if(mfs_freeSearch(group, map->leaves, 1, 0, bits, i ? 0 : from, count, &carry,
+                          &start) == 0){
+            *blockNo = group->blockNo;
+            *grDescNo = group->grDescNo;
+            *pos = start;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+void mfs_freemapMark(mfs_mount *mnt, __u32 block, __u32 count, int used){
+    __u32           low, high, i, half, bit;
+    mfs_freemap     *map = mnt->freemap;
+    mfs_freeGroup   *group;
+
+    if(map == NULL || map->groups == 0 || count == 0) return;
+    group = &map->group[mfs_freeGroupOf(map, block)];
+    if(block < group->start || block - group->start + count > map->leaves * 32) return;
+
+    block -= group->start;
+    for(i = block; i < block + count; i++){
+        bit = 0x80000000U >> (i % 32);
+        if(used) group->words[i / 32] |= bit;
+        else group->words[i / 32] &= ~bit;
+    }
+
+    low = block / 32;
+    high = (block + count - 1) / 32;
+    for(i = low; i <= high; i++){
+        mfs_freeLeaf(&group->tree[map->leaves + i], group->words[i]);
+    }
+    low += map->leaves;
+    high += map->leaves;
+    for(half = 32; low > 1; half *= 2){
+        low /= 2;
+        high /= 2;
+        for(i = low; i <= high; i++) mfs_freeJoin(group->tree, i, half);
+    }
+}
+
+int mfs_freemapAdd(mfs_mount *mnt, __u32 blockNo, __u32 grDescNo, __u32 start){
+    mfs_freemap     *map = mnt->freemap;
+    mfs_freeGroup   *group;
+
+    if(map == NULL) return 0;
+    group = mfs_freeGrow(map);
+    if(group == NULL){
+        perror("mfs_freemapAdd malloc");
+        mfs_freemapDrop(mnt);
+        return -1;
+    }
+    memset(group->words, 0, map->leaves * sizeof(__u32));
+    group->start = start;
+    group->blockNo = blockNo;
+    group->grDescNo = grDescNo;
+    mfs_freeBuild(group, map->leaves);
+    map->groups++;
+
+    return 0;
+}
+
+void mfs_freemapDrop(mfs_mount *mnt){
+    __u32   i;
+
+    if(mnt->freemap == NULL) return;
+    for(i = 0; i < mnt->freemap->groups; i++) free(mnt->freemap->group[i].words);
+    free(mnt->freemap->group);
+    free(mnt->freemap);
+    mnt->freemap = NULL;
+}
@@ -0,0 +1,51 @@
+#ifndef _FREEMAP_H_
+#define _FREEMAP_H_
+
+#include "filesystem.h"
+
+/* One node of a group's free space tree: the free blocks at the start and at
+ * the end of the range it covers and the longest free run inside it. */
+typedef struct{
+    __u32           head;
+    __u32           tail;
+    __u32           longest;
+}mfs_freeNode;
+
+/* A copy of the block bitmap of one group with a tree over its words. Leaves
+ * are bitmap words, node n has children 2n and 2n + 1 and node 1 covers the
+ * whole group. start is the first data block of the group. */
+typedef struct{
+    __u32           start;
+    __u32           blockNo;
+    __u32           grDescNo;
+    __u32           *words;
+    mfs_freeNode    *tree;
+}mfs_freeGroup;
+
+/* Free-extent index of a mount, built from the bitmaps on first use and kept
+ * in step with mfs_writeData and mfs_freeBlocks. Groups are in disk order. */
+typedef struct mfs_freemap{
+    __u32           groups;
+    __u32           size;
+    __u32           leaves;
+    mfs_freeGroup   *group;
+}mfs_freemap;
+
+/* Finds count free blocks in a row, at or after goal if possible, else the
+ * first run in the groups that follow and then those before. The tree of a
+ * group is descended in O(log) steps. Returns 0 and the group and position of
+ * the run, or -1 if no group has one. */
+int mfs_freemapFind(mfs_mount *mnt, __u32 count, __u32 goal, __u32 *blockNo,
+                    __u32 *grDescNo, __u32 *pos);
+
+/* Records that count blocks from block on were allocated (used) or released.
+ * Does nothing if the index has not been built. */
+void mfs_freemapMark(mfs_mount *mnt, __u32 block, __u32 count, int used);
+
+/* Adds a new, empty group to a built index. */
+int mfs_freemapAdd(mfs_mount *mnt, __u32 blockNo, __u32 grDescNo, __u32 start);
+
+/* Throws the index away, e.g. when another process changed the image. */
+void mfs_freemapDrop(mfs_mount *mnt);
+
+#endif
@@ -0,0 +1,759 @@
+#define _LARGEFILE64_SOURCE
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include "libmfs.h"
+#include "freemap.h"
+#include "dedup.h"
+#include "compress.h"
+#include "overlay.h"
+
+/* Every mount takes an fcntl lock on the superblock for the duration of a
+ * call: shared for readers, exclusive for writers. Where available the lock
+ * belongs to the open file, so mounts in different threads exclude each other
+ * like separate processes do. A writer bumps the
+ * generation when it lets go, which tells the others their cached superblock
+ * (and anything they derived from the image) is stale. Locks nest within a
+ * process. An inner exclusive request inside a shared lock fails with
+ * EDEADLK: the kernel does not detect deadlocks between OFD locks, so two
+ * readers upgrading at once would wait for each other forever. */
+static int mfs_setLock(int fd, short type){
+    struct flock    lock;
+
+    memset(&lock, 0, sizeof(struct flock));
+    lock.l_type = type;
+    lock.l_whence = SEEK_SET;
+    lock.l_start = 0;
+    lock.l_len = sizeof(mfs_superblock);
+#ifdef F_OFD_SETLKW
+    while(fcntl(fd, F_OFD_SETLKW, &lock) == -1){
+#else
+    while(fcntl(fd, F_SETLKW, &lock) == -1){
+#endif
+        if(errno != EINTR) return -1;
+    }
+
+    return 0;
+}
+
+int mfs_lock(mfs_mount *mnt, int type){
+    mfs_superblock  current;
+
+    if(type == MFS_LOCK_WRITE && mnt->flags == O_RDONLY){
+        errno = EBADF;
+        return -1;
+    }
+    if(mnt->lockDepth > 0){
+        if(type == MFS_LOCK_WRITE && mnt->lockType == MFS_LOCK_READ){
+            errno = EDEADLK;
+            return -1;
+        }
+        mnt->lockDepth++;
+        return 0;
+    }
+
+    if(mfs_setLock(mnt->fd, type == MFS_LOCK_WRITE ? F_WRLCK : F_RDLCK) == -1){
+        return -1;
+    }
+    if(pread(mnt->fd, &current, sizeof(mfs_superblock), 0) <
+       (ssize_t) sizeof(mfs_superblock)){
+        mfs_setLock(mnt->fd, F_UNLCK);
+        errno = EIO;
+        return -1;
+    }
+    mnt->lockType = type;
+    mnt->lockDepth = 1;
+    if(current.generation == mnt->sblock.generation) return 0;
+
+    mfs_freemapDrop(mnt);
+    mfs_dedupDrop(mnt);
+    mnt->sblock = current;
+    mfs_mountGeometry(mnt);
+    if(mfs_overlayReload(mnt) == -1){
+        mnt->lockDepth = 0;
+        mfs_setLock(mnt->fd, F_UNLCK);
+        errno = EIO;
+        return -1;
+    }
+    return 1;
+}
+
+int mfs_unlock(mfs_mount *mnt){
+    int err = 0;
+
+    if(mnt->lockDepth == 0){
+        errno = EINVAL;
+        return -1;
+    }
+    if(--mnt->lockDepth > 0) return 0;
+
+    if(mnt->lockType == MFS_LOCK_WRITE){
+        err = mfs_dedupFlush(mnt);
+        mnt->sblock.generation++;
+        if(mfs_writeSuperblock(mnt) == -1) err = -1;
+    }
+    if(mfs_setLock(mnt->fd, F_UNLCK) == -1) err = -1;
+
+    return err;
+}
+
+mfs_mount* mfs_open(const char *path, int flags){
+    mfs_mount   *mnt;
+    inode       root;
+
+    mnt = malloc(sizeof(mfs_mount));
+    if(mnt == NULL) return NULL;
+
+    mnt->flags = flags & O_ACCMODE;
+    mnt->fd = open(path, mnt->flags == O_RDONLY ? O_RDONLY : O_RDWR, 0);
+    if(mnt->fd == -1){
+        free(mnt);
+        return NULL;
+    }
+    mnt->lockDepth = 0;
+    mnt->freemap = NULL;
+    mnt->dedup = NULL;
+    mnt->overlay = NULL;
+    mnt->limit = 0;
+    if(mfs_setLock(mnt->fd, F_RDLCK) == -1 ||
+       pread(mnt->fd, &mnt->sblock, sizeof(mfs_superblock), 0) <
+       (ssize_t) sizeof(mfs_superblock) || mfs_setLock(mnt->fd, F_UNLCK) == -1 ||
+       mnt->sblock.block_size < 512 ||
+       (mnt->sblock.block_size & (mnt->sblock.block_size - 1)) ||
+       (mnt->sblock.feature_incompat & ~MFS_FEATURE_SUPPORTED)){
+        close(mnt->fd);
+        free(mnt);
+        errno = EINVAL;
+        return NULL;
+    }
+    mfs_mountGeometry(mnt);
+    if((mnt->sblock.feature_incompat & MFS_FEATURE_OVERLAY) &&
+       mfs_overlayOpen(mnt) == -1){
+        close(mnt->fd);
+        free(mnt);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    mnt->buffer = mfs_blockGet(mnt->sblock.block_size);
+    if(mnt->buffer == NULL){
+        mfs_overlayClose(mnt);
+        close(mnt->fd);
+        free(mnt);
+        return NULL;
+    }
+
+    if(mfs_stat(mnt, MFS_ROOT_INO, &root) == -1 || root.mode != 0){
+        mfs_close(mnt);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    return mnt;
+}
+
+int mfs_close(mfs_mount *mnt){
+    int err;
+
+    if(mnt == NULL) return 0;
+    err = close(mnt->fd);
+    mfs_freemapDrop(mnt);
+    mfs_dedupDrop(mnt);
+    mfs_overlayClose(mnt);
+    mfs_blockPut(mnt->buffer, mnt->sblock.block_size);
+    free(mnt);
+    return err;
+}
+
+int mfs_fileno(mfs_mount *mnt){
+    return mnt->fd;
+}
+
+mfs_superblock* mfs_getSuperblock(mfs_mount *mnt){
+    return &mnt->sblock;
+}
+
+static int mfs_lookupImpl(mfs_mount *mnt, __u32 dir, const char *path, __u32 *ino){
+    int     found;
+    char    *copy, *token, *save;
+    inode   cur;
+
+    if(path[0] == '/') dir = MFS_ROOT_INO;
+    if(mfs_findInode(mnt, dir, &cur) == -1){
+        errno = EIO;
+        return -1;
+    }
+
+    copy = strdup(path);
+    if(copy == NULL) return -1;
+
+    token = strtok_r(copy, "/", &save);
+    while(token != NULL){
+        if(cur.mode != 0){
+            free(copy);
+            errno = ENOTDIR;
+            return -1;
+        }
+        if(strcmp(token, ".")){
+            found = mfs_findEntry(mnt, &cur, token, -1);
+            if(found == -1){
+                free(copy);
+                errno = ENOENT;
+                return -1;
+            }
+            if(mfs_findInode(mnt, found, &cur) == -1){
+                free(copy);
+                errno = EIO;
+                return -1;
+            }
+        }
+        token = strtok_r(NULL, "/", &save);
+    }
+
+    free(copy);
+    *ino = cur.node_id;
+    return 0;
+}
+
+int mfs_lookup(mfs_mount *mnt, __u32 dir, const char *path, __u32 *ino){
+    int     err, saved;
+
+    if(mfs_lock(mnt, MFS_LOCK_READ) == -1) return -1;
+    err = mfs_lookupImpl(mnt, dir, path, ino);
+    saved = errno;
+    mfs_unlock(mnt);
+    errno = saved;
+    return err;
+}
+
+static int mfs_statImpl(mfs_mount *mnt, __u32 ino, inode *st){
+    if(ino == 0){
+        errno = EINVAL;
+        return -1;
+    }
+    if(mfs_findInode(mnt, ino, st) == -1){
+        errno = EIO;
+        return -1;
+    }
+
+    return 0;
+}
+
+int mfs_stat(mfs_mount *mnt, __u32 ino, inode *st){
+    int     err, saved;
+
+    if(mfs_lock(mnt, MFS_LOCK_READ) == -1) return -1;
+    err = mfs_statImpl(mnt, ino, st);
+    saved = errno;
+    mfs_unlock(mnt);
+    errno = saved;
+    return err;
+}
+
+/* Reads of a compressed file go through whole clusters. A cluster that is
+ * wanted whole is decompressed straight into buf. */
+static int mfs_readClusters(mfs_blockmap *map, char *buf, size_t count, __u64 offset){
+    int         err = 0;
+    char        *cluster;
+    __u32       size, inCluster, chunk;
+    __u64       index, clusterSize;
+    size_t      done = 0;
+    mfs_mount   *mnt = map->mnt;
+
+    clusterSize = (__u64) MFS_CLUSTER_BLOCKS << mnt->blockShift;
+    cluster = mfs_blockGet(clusterSize);
+    if(cluster == NULL) return -1;
+
+    while(done < count && !err){
+        index = (offset + done) / clusterSize;
+        inCluster = (offset + done) % clusterSize;
+        size = clusterSize;
+        if(map->file->file_size - index * clusterSize < size){
+            size = map->file->file_size - index * clusterSize;
+        }
+        chunk = size - inCluster;
+        if(chunk > count - done) chunk = count - done;
+
+        if(inCluster == 0 && count - done >= ((size + mnt->blockMask) & ~mnt->blockMask)){
+            err = mfs_clusterLoad(map, index, buf + done, size);
+        }else if((err = mfs_clusterLoad(map, index, cluster, size)) == 0){
+            memcpy(buf + done, cluster + inCluster, chunk);
+        }
+        done += chunk;
+    }
+
+    mfs_blockPut(cluster, clusterSize);
+    return err;
+}
+
+static ssize_t mfs_readAtImpl(mfs_mount *mnt, __u32 ino, void *buf, size_t count,
+                              __u64 offset){
+    int             err = 0;
+    __u32           bsize, physical, inBlock, chunk, run;
+    __u64           logical;
+    size_t          done = 0;
+    inode           file;
+    mfs_blockmap    map;
+
+    if(mfs_statImpl(mnt, ino, &file) == -1) return -1;
+    if(file.mode == 0){
+        errno = EISDIR;
+        return -1;
+    }
+    if(offset >= file.file_size) return 0;
+    if(count > file.file_size - offset) count = file.file_size - offset;
+    if(file.mode & MFS_MODE_INLINE){
+        memcpy(buf, (char *) file.datablocks + offset, count);
+        return count;
+    }
+    if(mfs_mapInit(&map, mnt, &file) == -1) return -1;
+    if(file.mode & MFS_MODE_COMPRESS){
+        err = mfs_readClusters(&map, buf, count, offset);
+        done = count;
+    }
+
+    bsize = mnt->sblock.block_size;
+    while(done < count && !err){
+        logical = (offset + done) >> mnt->blockShift;
+        inBlock = (offset + done) & mnt->blockMask;
+        if(inBlock == 0 && count - done >= bsize){
+            run = (count - done) >> mnt->blockShift;
+            if(run > MFS_RUN_BLOCKS) run = MFS_RUN_BLOCKS;
+            if(mfs_mapRun(&map, logical, run, &physical, &run) == -1){
+                err = -1;
+                break;
+            }
+            if(physical == 0){
+                memset((char *) buf + done, 0, (size_t) run * bsize);
+            }else if(mfs_readBlocks(mnt, (char *) buf + done, physical, run) == -1){
+                err = -1;
+                break;
+            }
+            done += (size_t) run * bsize;
+            continue;
+        }
+
+        chunk = bsize - inBlock;
+        if(chunk > count - done) chunk = count - done;
+        if((file.mode & MFS_MODE_TAIL) && logical == file.file_size >> mnt->blockShift){
+            if(mfs_tailRead(mnt, &file, mnt->buffer) == -1){
+                err = -1;
+                break;
+            }
+            memcpy((char *) buf + done, mnt->buffer + inBlock, chunk);
+            done += chunk;
+            continue;
+        }
+        if(mfs_mapResolve(&map, logical, &physical, NULL) == -1){
+            err = -1;
+            break;
+        }
+        if(physical == 0){
+            memset((char *) buf + done, 0, chunk);
+        }else{
+            if(mfs_read(mnt, mnt->buffer, physical) == -1){
+                err = -1;
+                break;
+            }
+            memcpy((char *) buf + done, mnt->buffer + inBlock, chunk);
+        }
+        done += chunk;
+    }
+
+    mfs_mapDestroy(&map);
+    if(err){
+        errno = EIO;
+        return -1;
+    }
+
+    return done;
+}
+
+ssize_t mfs_read_at(mfs_mount *mnt, __u32 ino, void *buf, size_t count,
+                    __u64 offset){
+    ssize_t done;
+    int     saved;
+
+    if(mfs_lock(mnt, MFS_LOCK_READ) == -1) return -1;
+    done = mfs_readAtImpl(mnt, ino, buf, count, offset);
+    saved = errno;
+    mfs_unlock(mnt);
+    errno = saved;
+    return done;
+}
+
+static ssize_t mfs_writeAtImpl(mfs_mount *mnt, __u32 ino, const void *buf, size_t count,
+                               __u64 offset){
+    __u32           bsize, physical, inBlock, chunk, run;
+    __u64           logical;
+    size_t          done = 0;
+    inode           file;
+    mfs_blockmap    map;
+
+    if(mnt->flags == O_RDONLY){
+        errno = EBADF;
+        return -1;
+    }
+    if(mfs_statImpl(mnt, ino, &file) == -1) return -1;
+    if(file.mode == 0){
+        errno = EISDIR;
+        return -1;
+    }
+    if(offset + count > mnt->sblock.max_file_size){
+        errno = EFBIG;
+        return -1;
+    }
+    if(file.mode & MFS_MODE_INLINE){
+        if(offset + count <= MFS_INLINE_SIZE){
+            memcpy((char *) file.datablocks + offset, buf, count);
+            if(offset + count > file.file_size) file.file_size = offset + count;
+            file.modification_time = time(NULL);
+            if(mfs_updateInode(mnt, &file) == -1){
+                errno = EIO;
+                return -1;
+            }
+            return count;
+        }
+        if(mfs_inlineSpill(mnt, &file) == -1){
+            errno = ENOSPC;
+            return -1;
+        }
+    }
+    if((file.mode & MFS_MODE_TAIL) &&
+       mfs_tailUnpack(mnt, &file) == -1){
+        errno = ENOSPC;
+        return -1;
+    }
+    if(mfs_compressUnpack(mnt, &file) == -1){
+        errno = ENOSPC;
+        return -1;
+    }
+    /* Shared blocks must not change under the other files that map them. */
+    if(mfs_dedupUnshare(mnt, &file) == -1){
+        errno = ENOSPC;
+        return -1;
+    }
+    if(mfs_mapInit(&map, mnt, &file) == -1) return -1;
+
+    bsize = mnt->sblock.block_size;
+    while(done < count){
+        logical = (offset + done) >> mnt->blockShift;
+        inBlock = (offset + done) & mnt->blockMask;
+        chunk = bsize - inBlock;
+        if(chunk > count - done) chunk = count - done;
+
+        if(chunk == bsize){
+            run = (count - done) >> mnt->blockShift;
+            if(run > MFS_RUN_BLOCKS) run = MFS_RUN_BLOCKS;
+            if(mfs_mapRun(&map, logical, run, &physical, &run) == -1){
+                break;
+            }
+            if(physical == 0){
+                if(mfs_mapResolve(&map, logical, &physical, (char *) buf + done) == -1){
+                    break;
+                }
+                run = 1;
+            }else if(mfs_writeBlocks(mnt, (char *) buf + done, physical, run) == -1){
+                break;
+            }
+            done += (size_t) run * bsize;
+            continue;
+        }
+
+        if(mfs_mapResolve(&map, logical, &physical, NULL) == -1){
+            break;
+        }
+        if(physical == 0){
+            memset(mnt->buffer, 0, bsize);
+        }else if(mfs_read(mnt, mnt->buffer, physical) == -1){
+            break;
+        }
+        memcpy(mnt->buffer + inBlock, (char *) buf + done, chunk);
+        if(physical == 0){
+            if(mfs_mapResolve(&map, logical, &physical, mnt->buffer) == -1){
+                break;
+            }
+        }else if(mfs_write(mnt, mnt->buffer, physical) == -1){
+            break;
+        }
+        done += chunk;
+    }
+    mfs_mapDestroy(&map);
+
+    if(offset + done > file.file_size) file.file_size = offset + done;
+    if(done){
+        file.modification_time = time(NULL);
+        if(mfs_updateInode(mnt, &file) == -1){
+            errno = EIO;
+            return -1;
+        }
+    }
+    if(done < count && !done){
+        errno = ENOSPC;
+        return -1;
+    }
+
+    return done;
+}
+
+ssize_t mfs_write_at(mfs_mount *mnt, __u32 ino, const void *buf, size_t count,
+                     __u64 offset){
+    ssize_t done;
+    int     saved;
+
+    if(mfs_lock(mnt, MFS_LOCK_WRITE) == -1) return -1;
+    done = mfs_writeAtImpl(mnt, ino, buf, count, offset);
+    saved = errno;
+    mfs_unlock(mnt);
+    errno = saved;
+    return done;
+}
+
+static int mfs_readdirImpl(mfs_mount *mnt, __u32 dir, __u64 *cookie, mfs_dirent *entries,
+                           int count){
+    int             filled = 0;
+    __u32           i, curOffset, offset;
+    directory_entry entry;
+    inode           folder;
+
+    if(mfs_statImpl(mnt, dir, &folder) == -1) return -1;
+    if(folder.mode != 0){
+        errno = ENOTDIR;
+        return -1;
+    }
+
+    i = *cookie >> 32;
+    curOffset = *cookie & 0xffffffff;
+    while(filled < count && i < DATABLOCK_NUM && folder.datablocks[i] != 0){
+        if(mfs_read(mnt, mnt->buffer, folder.datablocks[i]) == -1){
+            errno = EIO;
+            return -1;
+        }
+        memcpy(&offset, mnt->buffer, 4);
+        if(curOffset < 4) curOffset = 4;
+        while(filled < count && curOffset < offset){
+            memcpy(&entry, mnt->buffer + curOffset, sizeof(directory_entry));
+            if(entry.inodeptr != 0){
+                entries[filled].inodeptr = entry.inodeptr;
+                entries[filled].file_type = entry.file_type;
+                entries[filled].name_len = entry.name_len;
+                memcpy(entries[filled].name, mnt->buffer + curOffset +
+                       sizeof(directory_entry), entry.name_len);
+                entries[filled].name[entry.name_len] = '\0';
+                filled++;
+            }
+            curOffset += entry.rec_len;
+        }
+        if(curOffset >= offset){
+            i++;
+            curOffset = 0;
+        }
+    }
+
+    *cookie = ((__u64) i << 32) | curOffset;
+    return filled;
+}
+
+int mfs_readdir(mfs_mount *mnt, __u32 dir, __u64 *cookie, mfs_dirent *entries,
+                int count){
+    int     err, saved;
+
+    if(mfs_lock(mnt, MFS_LOCK_READ) == -1) return -1;
+    err = mfs_readdirImpl(mnt, dir, cookie, entries, count);
+    saved = errno;
+    mfs_unlock(mnt);
+    errno = saved;
+    return err;
+}
+
+static int mfs_readdirplusImpl(mfs_mount *mnt, __u32 dir, __u64 *cookie,
+                               mfs_dirent *entries, inode *attrs, int count){
+    int     filled, i;
+    __u32   *ptrs;
+
+    filled = mfs_readdirImpl(mnt, dir, cookie, entries, count);
+    if(filled <= 0) return filled;
+
+    ptrs = malloc(filled * sizeof(__u32));
+    if(ptrs == NULL) return -1;
+    for(i = 0; i < filled; i++) ptrs[i] = entries[i].inodeptr;
+    if(mfs_findInodes(mnt, ptrs, attrs, filled) == -1){
+        free(ptrs);
+        errno = EIO;
+        return -1;
+    }
+
+    free(ptrs);
+    return filled;
+}
+
+int mfs_readdirplus(mfs_mount *mnt, __u32 dir, __u64 *cookie, mfs_dirent *entries,
+                    inode *attrs, int count){
+    int     err, saved;
+
+    if(mfs_lock(mnt, MFS_LOCK_READ) == -1) return -1;
+    err = mfs_readdirplusImpl(mnt, dir, cookie, entries, attrs, count);
+    saved = errno;
+    mfs_unlock(mnt);
+    errno = saved;
+    return err;
+}
+
+static int mfs_mkdirImpl(mfs_mount *mnt, __u32 dir, const char *name, __u32 *ino){
+    __u32           offset;
+    char            *filename;
+    inode           folder, newDir;
+    directory_entry dirEntry;
+
+    if(mnt->flags == O_RDONLY){
+        errno = EBADF;
+        return -1;
+    }
+    if(mfs_statImpl(mnt, dir, &folder) == -1) return -1;
+    if(folder.mode != 0){
+        errno = ENOTDIR;
+        return -1;
+    }
+    if(name[0] == '\0' || strchr(name, '/') != NULL ||
+       strlen(name) > mnt->sblock.max_filename_size){
+        errno = EINVAL;
+        return -1;
+    }
+    if(mfs_findEntry(mnt, &folder, (char *) name, -1) != -1){
+        errno = EEXIST;
+        return -1;
+    }
+
+    memset(&newDir, 0, sizeof(inode));
+    newDir.mode = 0;
+    newDir.file_size = mnt->sblock.block_size;
+    newDir.creation_time = time(NULL);
+    newDir.access_time = newDir.creation_time;
+    newDir.modification_time = newDir.creation_time;
+    if(mfs_allocInode(mnt, &newDir, folder.node_id) == -1){
+        errno = ENOSPC;
+        return -1;
+    }
+
+    memset(mnt->buffer, 0, mnt->sblock.block_size);
+    offset = 2 * sizeof(directory_entry) + 3 + 4;
+    memcpy(mnt->buffer, &offset, 4);
+    dirEntry.inodeptr = newDir.node_id;
+    dirEntry.rec_len = sizeof(directory_entry) + 1;
+    dirEntry.name_len = 1;
+    dirEntry.file_type = 0;
+    memcpy(mnt->buffer + 4, &dirEntry, sizeof(directory_entry));
+    mnt->buffer[4 + sizeof(directory_entry)] = '.';
+    dirEntry.inodeptr = folder.node_id;
+    dirEntry.rec_len = sizeof(directory_entry) + 2;
+    dirEntry.name_len = 2;
+    memcpy(mnt->buffer + 4 + sizeof(directory_entry) + 1, &dirEntry,
+           sizeof(directory_entry));
+    mnt->buffer[4 + 2 * sizeof(directory_entry) + 1] = '.';
+    mnt->buffer[4 + 2 * sizeof(directory_entry) + 2] = '.';
+    if(mfs_allocBlock(mnt, mnt->buffer, newDir.datablocks, 0, newDir.node_id) == -1 ||
+       mfs_updateInode(mnt, &newDir) == -1){
+        mfs_freeInode(mnt, &newDir);
+        errno = ENOSPC;
+        return -1;
+    }
+
+    filename = strdup(name);
+    if(filename == NULL){
+        mfs_freeInode(mnt, &newDir);
+        errno = ENOMEM;
+        return -1;
+    }
+    if(mfs_insertEntry(mnt, &folder, &newDir, filename) == -1){
+        free(filename);
+        mfs_freeInode(mnt, &newDir);
+        errno = ENOSPC;
+        return -1;
+    }
+    free(filename);
+
+    if(ino != NULL) *ino = newDir.node_id;
+    return 0;
+}
+
+int mfs_mkdir(mfs_mount *mnt, __u32 dir, const char *name, __u32 *ino){
+    int     err, saved;
+
+    if(mfs_lock(mnt, MFS_LOCK_WRITE) == -1) return -1;
+    err = mfs_mkdirImpl(mnt, dir, name, ino);
+    saved = errno;
+    mfs_unlock(mnt);
+    errno = saved;
+    return err;
+}
+
+static int mfs_creatImpl(mfs_mount *mnt, __u32 dir, const char *name, __u32 *ino){
+    char    *filename;
+    inode   folder, newFile;
+
+    if(mnt->flags == O_RDONLY){
+        errno = EBADF;
+        return -1;
+    }
+    if(mfs_statImpl(mnt, dir, &folder) == -1) return -1;
+    if(folder.mode != 0){
+        errno = ENOTDIR;
+        return -1;
+    }
+    if(name[0] == '\0' || strchr(name, '/') != NULL ||
+       strlen(name) > mnt->sblock.max_filename_size){
+        errno = EINVAL;
+        return -1;
+    }
+    if(mfs_findEntry(mnt, &folder, (char *) name, -1) != -1){
+        errno = EEXIST;
+        return -1;
+    }
+
+    memset(&newFile, 0, sizeof(inode));
+    mfs_fileInit(mnt, &newFile);
+    newFile.file_size = 0;
+    newFile.creation_time = time(NULL);
+    newFile.access_time = newFile.creation_time;
+    newFile.modification_time = newFile.creation_time;
+    if(mfs_allocInode(mnt, &newFile, folder.node_id) == -1){
+        errno = ENOSPC;
+        return -1;
+    }
+
+    filename = strdup(name);
+    if(filename == NULL){
+        mfs_freeInode(mnt, &newFile);
+        errno = ENOMEM;
+        return -1;
+    }
+    if(mfs_insertEntry(mnt, &folder, &newFile, filename) == -1){
+        free(filename);
+        mfs_freeInode(mnt, &newFile);
+        errno = ENOSPC;
+        return -1;
+    }
+    free(filename);
+
+    if(ino != NULL) *ino = newFile.node_id;
+    return 0;
+}
+
+int mfs_creat(mfs_mount *mnt, __u32 dir, const char *name, __u32 *ino){
+    int     err, saved;
+
+    if(mfs_lock(mnt, MFS_LOCK_WRITE) == -1) return -1;
+    err = mfs_creatImpl(mnt, dir, name, ino);
+    saved = errno;
+    mfs_unlock(mnt);
+    errno = saved;
+    return err;
+}
@@ -0,0 +1,58 @@
+#ifndef _LIBMFS_H_
+#define _LIBMFS_H_
+
+#include <sys/types.h>
+#include "filesystem.h"
+
+#define MFS_LOCK_READ   0
+#define MFS_LOCK_WRITE  1
+
+typedef struct{
+    __u32       inodeptr;
+    __u8        file_type;
+    __u8        name_len;
+    char        name[DEFAULT_FILENAME_SIZE + 1];
+}mfs_dirent;
+
+/* All calls return -1 and set errno on failure, nothing is printed. */
+
+mfs_mount* mfs_open(const char *path, int flags);
+
+int mfs_close(mfs_mount *mnt);
+
+int mfs_fileno(mfs_mount *mnt);
+
+mfs_superblock* mfs_getSuperblock(mfs_mount *mnt);
+
+/* Takes the image lock for a sequence of calls, each call also takes it on its
+ * own. Returns 1 when another process changed the image since this mount last
+ * held the lock, in which case cached inodes should be read again. A shared
+ * lock cannot be upgraded: asking for MFS_LOCK_WRITE while holding
+ * MFS_LOCK_READ fails with EDEADLK. */
+int mfs_lock(mfs_mount *mnt, int type);
+
+int mfs_unlock(mfs_mount *mnt);
+
+int mfs_lookup(mfs_mount *mnt, __u32 dir, const char *path, __u32 *ino);
+
+int mfs_stat(mfs_mount *mnt, __u32 ino, inode *st);
+
+ssize_t mfs_read_at(mfs_mount *mnt, __u32 ino, void *buf, size_t count,
+                    __u64 offset);
+
+ssize_t mfs_write_at(mfs_mount *mnt, __u32 ino, const void *buf, size_t count,
+                     __u64 offset);
+
+int mfs_readdir(mfs_mount *mnt, __u32 dir, __u64 *cookie, mfs_dirent *entries,
+                int count);
+
+/* Like mfs_readdir, and attrs[i] receives the inode of entries[i] (node_id 0
+ * if it is gone). The inode table blocks are read once each, in disk order. */
+int mfs_readdirplus(mfs_mount *mnt, __u32 dir, __u64 *cookie, mfs_dirent *entries,
+                    inode *attrs, int count);
+
+int mfs_mkdir(mfs_mount *mnt, __u32 dir, const char *name, __u32 *ino);
+
+int mfs_creat(mfs_mount *mnt, __u32 dir, const char *name, __u32 *ino);
+
+#endif
@@ -9,15 +9,40 @@
 #include <termios.h>
 #include "login.h"
 #include "commands.h"
+#include "server.h"
 
 int main(int argc, char *argv[]){
     char            *command, **spltCommand, fileSystem[BUFFER_SIZE],
                     path[BUFFER_SIZE] = "/", *username = NULL;
     int             i = 0, openedFS = -1, wordCount, commandType, userID, flag;
-    int             fd;
-    mfs_superblock  sblock;
+    int             lockType;
+    mfs_mount       *mnt = NULL;
     inode           currentFolder;
 
+    if(argc >= 3 && !strcmp(argv[1], "-serve")){
+        if(argc < 4 || mfs_serve(argv[2], argv[3], argc > 4 ? atoi(argv[4]) : 0)){
+            if(argc < 4) fprintf(stderr, "usage: %s -serve image socket [threads]\n",
+                                 argv[0]);
+            exit(1);
+        }
+        exit(0);
+    }
+    if(argc >= 2 && !strcmp(argv[1], "-import")){
+        if(argc < 5){
+            fprintf(stderr, "usage: %s -import image dir name < data\n", argv[0]);
+            exit(1);
+        }
+        exit(mfs_importStdin(argv[2], argv[3], argv[4]) ? 1 : 0);
+    }
+    if(argc >= 2 && !strcmp(argv[1], "-client")){
+        if(argc < 5){
+            fprintf(stderr, "usage: %s -client socket command path [path]\n", argv[0]);
+            exit(1);
+        }
+        exit(mfs_client(argv[2], argc - 3, argv + 3) ? 1 : 0);
+    }
+
+    mfs_arenaInit(&commandArena, MFS_ARENA_CHUNK);
     command = malloc(COMMAND_SIZE * sizeof(char));
     if(command == NULL){
         perror("command malloc");
@@ -34,20 +59,37 @@ int main(int argc, char *argv[]){
                 break;
             }
             spltCommand = splitCommand(wordCount, command, &commandType);
-            if(commandType != WORKWITH && commandType != CREATE && openedFS){
+            mfs_statsBegin();
+            if(commandType != WORKWITH && commandType != CREATE &&
+               commandType != STATS && commandType != LATENCY && openedFS){
                 fprintf(stderr, "No filesystem open to work with.\n");
+            }else if((lockType = mfs_commandLock(commandType)) != -1 &&
+                     (flag = mfs_lock(mnt, lockType)) == -1){
+                perror("mfs_lock");
             }else{
+                /* Another process may have changed the image since the last
+                 * command: the current folder is read again, or dropped back
+                 * to the root when it no longer is a directory. */
+                if(lockType != -1 && flag == 1 &&
+                   (mfs_stat(mnt, currentFolder.node_id, &currentFolder) ||
+                    currentFolder.mode != 0)){
+                    mfs_stat(mnt, MFS_ROOT_INO, &currentFolder);
+                    strcpy(path, "/");
+                }
                 switch(commandType){
                     case WORKWITH:
-                        openedFS = mfs_workwith(spltCommand, &sblock, &fd,
-                                                fileSystem, &currentFolder);
+                        flag = mfs_workwith(spltCommand, &mnt, fileSystem,
+                                            &currentFolder);
+                        if(!flag){
+                            openedFS = 0;
+                            strcpy(path, "/");
+                        }
                         break;
                     case LS:
-                        mfs_ls(spltCommand, fd, sblock, wordCount, &currentFolder);
+                        mfs_ls(spltCommand, mnt, wordCount, &currentFolder);
                         break;
                     case CD:
-                        flag = mfs_followPath(fd, sblock, spltCommand[1],
-                                              &currentFolder, 0);
+                        flag = mfs_followPath(mnt, spltCommand[1], &currentFolder, 0);
                         if(!flag && !strcmp(spltCommand[1], "..")){
                             if(strcmp(path, "/")){
                                 mfs_goUp(path);
@@ -64,34 +106,60 @@ int main(int argc, char *argv[]){
                     case CP:
                         break;
                     case MV:
+                        mfs_mv(spltCommand, mnt, wordCount, &currentFolder);
+                        mfs_stat(mnt, currentFolder.node_id, &currentFolder);
                         break;
                     case RM:
                         break;
                     case MKDIR:
-                        mfs_mkdir(fd, &sblock, spltCommand, currentFolder, wordCount);
-                        mfs_findInode(fd, sblock, currentFolder.node_id, &currentFolder);
+                        mfs_mkdirCommand(spltCommand, mnt, &currentFolder, wordCount);
+                        mfs_stat(mnt, currentFolder.node_id, &currentFolder);
                         break;
                     case TOUCH:
-                        mfs_touch(spltCommand, fd, sblock, wordCount, &currentFolder);
+                        mfs_touch(spltCommand, mnt, wordCount, &currentFolder);
                         break;
                     case IMPORT:
-                        flag = mfs_import(spltCommand, fd, &sblock, &currentFolder,
-                                          wordCount);
-                        if(!flag) mfs_findInode(fd, sblock, currentFolder.node_id,
-                                                &currentFolder);
+                        flag = mfs_import(spltCommand, mnt, &currentFolder, wordCount);
+                        if(!flag) mfs_stat(mnt, currentFolder.node_id, &currentFolder);
                         break;
                     case EXPORT:
-                        mfs_export(spltCommand, fd, sblock, &currentFolder, wordCount);
+                        mfs_export(spltCommand, mnt, &currentFolder, wordCount);
                         break;
                     case CAT:
+                        mfs_cat(spltCommand, mnt, &currentFolder, wordCount);
                         break;
                     case CREATE:
                         mfs_create(spltCommand, wordCount);
                         break;
+                    case STATS:
+                        mfs_statsCommand(spltCommand, wordCount);
+                        break;
+                    case LATENCY:
+                        mfs_latencyCommand(spltCommand, wordCount);
+                        break;
+                    case DEFRAG:
+                        mfs_defragCommand(spltCommand, mnt, &currentFolder, wordCount);
+                        mfs_stat(mnt, currentFolder.node_id, &currentFolder);
+                        break;
+                    case RESIZE:
+                        mfs_resizeCommand(spltCommand, mnt, wordCount);
+                        if(mfs_stat(mnt, currentFolder.node_id, &currentFolder) ||
+                           currentFolder.mode != 0){
+                            mfs_stat(mnt, MFS_ROOT_INO, &currentFolder);
+                            strcpy(path, "/");
+                        }
+                        break;
+                    case COMPACT:
+                        mfs_compactCommand(spltCommand, mnt, &currentFolder, wordCount);
+                        mfs_stat(mnt, currentFolder.node_id, &currentFolder);
+                        break;
                     default:
                         continue;
                 }
+                if(lockType != -1) mfs_unlock(mnt);
             }
+            mfs_statsEnd(commandType);
+            mfs_arenaReset(&commandArena);
             for(i = 0; i < wordCount; i++){
                 free(spltCommand[i]);
             }
@@ -99,6 +167,9 @@ int main(int argc, char *argv[]){
         }
     }
 
+    if(getenv("MFS_STATS_FILE") != NULL) mfs_statsDump(getenv("MFS_STATS_FILE"));
+    mfs_close(mnt);
+    mfs_arenaDestroy(&commandArena);
     free(command);
     exit(0);
 }
\ No newline at end of file
@@ -0,0 +1,481 @@
+#define _LARGEFILE64_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "overlay.h"
+
+/* Where a block of an overlay image is read from. */
+#define MFS_OVERLAY_OWN         0
+#define MFS_OVERLAY_BASE        1
+#define MFS_OVERLAY_NONE        2
+
+static int mfs_overlayPread(mfs_mount *mnt, int fd, char *buffer, __u32 block,
+                            __u32 count){
+    size_t  size;
+
+    size = (size_t) count << mnt->blockShift;
+    if(pread64(fd, buffer, size, (off64_t) block << mnt->blockShift) < (ssize_t) size){
+        perror("mfs_overlay read");
+        return -1;
+    }
+    return 0;
+}
+
+static int mfs_overlayPwrite(mfs_mount *mnt, char *buffer, __u32 block, __u32 count){
+    size_t  size;
+
+    size = (size_t) count << mnt->blockShift;
+    if(pwrite64(mnt->fd, buffer, size, (off64_t) block << mnt->blockShift) <
+       (ssize_t) size){
+        perror("mfs_overlay write");
+        return -1;
+    }
+    return 0;
+}
+
+static mfs_overlay_header* mfs_overlayHeader(mfs_overlay *ovl){
+    return (mfs_overlay_header *) ovl->header;
+}
+
+static __u32* mfs_overlayIndex(mfs_overlay *ovl){
+    return (__u32 *) (ovl->header + sizeof(mfs_overlay_header));
+}
+
+static void mfs_overlayForget(mfs_overlay *ovl){
+    __u32   i;
+
+    for(i = 0; i < ovl->segments; i++){
+        free(ovl->seg[i]);
+        ovl->seg[i] = NULL;
+    }
+}
+
+static int mfs_overlayLoad(mfs_mount *mnt){
+    __u32           i, *index;
+    struct stat64   st;
+    mfs_overlay     *ovl = mnt->overlay;
+
+    mfs_overlayForget(ovl);
+    memset(ovl->segBlock, 0, ovl->segments * sizeof(__u32));
+    if(mfs_overlayPread(mnt, mnt->fd, ovl->header, MFS_OVERLAY_HEADER, 1) == -1){
+        return -1;
+    }
+    if(mfs_overlayHeader(ovl)->magic != MFS_OVERLAY_MAGIC){
+        fprintf(stderr, "mfs_overlay: bad overlay header.\n");
+        errno = EINVAL;
+        return -1;
+    }
+
+    index = mfs_overlayIndex(ovl);
+    for(i = 0; i < ovl->indexCount; i++){
+        if(index[i] != 0 &&
+           mfs_overlayPread(mnt, mnt->fd, (char *) (ovl->segBlock + i * ovl->perIndex),
+                            index[i], 1) == -1){
+            return -1;
+        }
+    }
+    if(fstat64(mnt->fd, &st) == -1){
+        perror("mfs_overlay stat");
+        return -1;
+    }
+    ovl->next = (st.st_size + mnt->blockMask) >> mnt->blockShift;
+
+    return 0;
+}
+
+int mfs_overlayOpen(mfs_mount *mnt){
+    __u64           maxIndex;
+    mfs_overlay     *ovl;
+    mfs_superblock  sblock;
+
+    ovl = calloc(1, sizeof(mfs_overlay));
+    if(ovl == NULL){
+        perror("mfs_overlayOpen malloc");
+        return -1;
+    }
+    ovl->base = -1;
+    pthread_mutex_init(&ovl->lock, NULL);
+    ovl->segShift = mnt->blockShift + 3;
+    ovl->mapBlocks = (sizeof(__u32) << ovl->segShift) >> mnt->blockShift;
+    ovl->perIndex = mnt->sblock.block_size / sizeof(__u32);
+    ovl->indexCount = (mnt->sblock.block_size - sizeof(mfs_overlay_header)) /
+                      sizeof(__u32);
+    maxIndex = ((0x100000000ULL >> ovl->segShift) + ovl->perIndex - 1) / ovl->perIndex;
+    if(ovl->indexCount > maxIndex) ovl->indexCount = maxIndex;
+    ovl->segments = ovl->indexCount * ovl->perIndex;
+    ovl->header = malloc(mnt->sblock.block_size);
+    ovl->segBlock = malloc(ovl->segments * sizeof(__u32));
+    ovl->seg = calloc(ovl->segments, sizeof(char *));
+    mnt->overlay = ovl;
+    if(ovl->header == NULL || ovl->segBlock == NULL || ovl->seg == NULL){
+        perror("mfs_overlayOpen malloc");
+        mfs_overlayClose(mnt);
+        return -1;
+    }
+    if(mfs_overlayLoad(mnt) == -1){
+        mfs_overlayClose(mnt);
+        return -1;
+    }
+
+    ovl->base = open(mfs_overlayHeader(ovl)->base, O_RDONLY);
+    if(ovl->base == -1 ||
+       pread(ovl->base, &sblock, sizeof(mfs_superblock), 0) < (ssize_t) sizeof(sblock) ||
+       sblock.block_size != mnt->sblock.block_size){
+        fprintf(stderr, "mfs_overlay: cannot use base image %s.\n",
+                mfs_overlayHeader(ovl)->base);
+        mfs_overlayClose(mnt);
+        errno = EINVAL;
+        return -1;
+    }
+
+    return 0;
+}
+
+int mfs_overlayReload(mfs_mount *mnt){
+    if(mnt->overlay == NULL) return 0;
+    return mfs_overlayLoad(mnt);
+}
+
+void mfs_overlayClose(mfs_mount *mnt){
+    mfs_overlay *ovl = mnt->overlay;
+
+    if(ovl == NULL) return;
+    if(ovl->seg != NULL) mfs_overlayForget(ovl);
+    if(ovl->base != -1) close(ovl->base);
+    free(ovl->header);
+    free(ovl->segBlock);
+    free(ovl->seg);
+    pthread_mutex_destroy(&ovl->lock);
+    free(ovl);
+    mnt->overlay = NULL;
+}
+
+__u32 mfs_overlayBlocks(mfs_mount *mnt){
+    return mfs_overlayHeader(mnt->overlay)->blocks;
+}
+
+static int mfs_overlayGrow(mfs_mount *mnt, __u32 end){
+    mfs_overlay_header  *hdr = mfs_overlayHeader(mnt->overlay);
+
+    if(end <= hdr->blocks) return 0;
+    hdr->blocks = end;
+    return mfs_overlayPwrite(mnt, mnt->overlay->header, MFS_OVERLAY_HEADER, 1);
+}
+
+/* Metadata of segment seg, NULL in *meta if it has none and create is not
+ * set. A new segment's empty metadata is written before the index entry that
+ * points to it. */
+static int mfs_overlaySegmentImpl(mfs_mount *mnt, __u32 seg, int create,
+                                  char **meta){
+    int             fresh = 0;
+    __u32           blocks, *index, i;
+    mfs_overlay     *ovl = mnt->overlay;
+
+    *meta = NULL;
+    if(seg >= ovl->segments){
+        if(!create) return 0;
+        fprintf(stderr, "mfs_overlay: image too large for an overlay.\n");
+        errno = EFBIG;
+        return -1;
+    }
+    if(ovl->seg[seg] != NULL){
+        *meta = ovl->seg[seg];
+        return 0;
+    }
+    if(ovl->segBlock[seg] == 0 && !create) return 0;
+
+    blocks = 1 + ovl->mapBlocks;
+    *meta = calloc(((size_t) blocks << mnt->blockShift) + blocks, 1);
+    if(*meta == NULL){
+        perror("mfs_overlay malloc");
+        return -1;
+    }
+    if(ovl->segBlock[seg] != 0){
+        if(mfs_overlayPread(mnt, mnt->fd, *meta, ovl->segBlock[seg], blocks) == -1){
+            free(*meta);
+            return -1;
+        }
+        ovl->seg[seg] = *meta;
+        return 0;
+    }
+
+    index = mfs_overlayIndex(ovl);
+    i = seg / ovl->perIndex;
+    if(mfs_overlayPwrite(mnt, *meta, ovl->next, blocks) == -1){
+        free(*meta);
+        return -1;
+    }
+    ovl->segBlock[seg] = ovl->next;
+    ovl->next += blocks;
+    if(index[i] == 0){
+        index[i] = ovl->next++;
+        fresh = 1;
+    }
+    if(mfs_overlayPwrite(mnt, (char *) (ovl->segBlock + i * ovl->perIndex), index[i],
+                         1) == -1 ||
+       (fresh && mfs_overlayPwrite(mnt, ovl->header, MFS_OVERLAY_HEADER, 1) == -1)){
+        ovl->segBlock[seg] = 0;
+        if(fresh) index[i] = 0;
+        free(*meta);
+        return -1;
+    }
+    ovl->seg[seg] = *meta;
+
+    return 0;
+}
+
+static int mfs_overlaySegment(mfs_mount *mnt, __u32 seg, int create, char **meta){
+    int     err;
+
+    pthread_mutex_lock(&mnt->overlay->lock);
+    err = mfs_overlaySegmentImpl(mnt, seg, create, meta);
+    pthread_mutex_unlock(&mnt->overlay->lock);
+    return err;
+}
+
+static int mfs_overlayFind(mfs_mount *mnt, __u32 block, __u32 *where){
+    char        *meta;
+    __u32       pos;
+    mfs_overlay *ovl = mnt->overlay;
+
+    *where = block;
+    if(block == 0) return MFS_OVERLAY_OWN;
+    if(mfs_overlaySegment(mnt, block >> ovl->segShift, 0, &meta) == -1) return -1;
+    pos = block & ((1U << ovl->segShift) - 1);
+    if(meta != NULL && mfs_testBit(meta, pos)){
+        *where = ((__u32 *) (meta + mnt->sblock.block_size))[pos];
+        return MFS_OVERLAY_OWN;
+    }
+
+    return block < mfs_overlayHeader(ovl)->base_blocks ? MFS_OVERLAY_BASE :
+                                                         MFS_OVERLAY_NONE;
+}
+
+static int mfs_overlayFetch(mfs_mount *mnt, int source, char *buffer, __u32 block,
+                            __u32 count){
+    if(source == MFS_OVERLAY_NONE){
+        memset(buffer, 0, (size_t) count << mnt->blockShift);
+        return 0;
+    }
+    if(source == MFS_OVERLAY_BASE){
+        return mfs_overlayPread(mnt, mnt->overlay->base, buffer, block, count);
+    }
+    return mfs_overlayPread(mnt, mnt->fd, buffer, block, count);
+}
+
+/* Blocks that follow each other in the same file are read with one call. */
+int mfs_overlayRead(mfs_mount *mnt, char *buffer, __u32 block, __u32 count){
+    int     source, runSource = 0;
+    char    *runBuffer = buffer;
+    __u32   where, runStart = 0, run = 0, i;
+
+    for(i = 0; i < count; i++){
+        source = mfs_overlayFind(mnt, block + i, &where);
+        if(source == -1) return -1;
+        if(run && source == runSource && where == runStart + run){
+            run++;
+            continue;
+        }
+        if(run && mfs_overlayFetch(mnt, runSource, runBuffer, runStart, run) == -1){
+            return -1;
+        }
+        runSource = source;
+        runStart = where;
+        run = 1;
+        runBuffer = buffer + ((size_t) i << mnt->blockShift);
+    }
+    if(run && mfs_overlayFetch(mnt, runSource, runBuffer, runStart, run) == -1){
+        return -1;
+    }
+
+    return 0;
+}
+
+static int mfs_overlayFlush(mfs_mount *mnt, __u32 seg){
+    char        *meta, *dirty;
+    __u32       i;
+    mfs_overlay *ovl = mnt->overlay;
+
+    meta = ovl->seg[seg];
+    if(meta == NULL) return 0;
+    dirty = meta + ((size_t) (1 + ovl->mapBlocks) << mnt->blockShift);
+    for(i = 1; i <= ovl->mapBlocks; i++){
+        if(!dirty[i]) continue;
+        if(mfs_overlayPwrite(mnt, meta + ((size_t) i << mnt->blockShift),
+                             ovl->segBlock[seg] + i, 1) == -1){
+            return -1;
+        }
+        dirty[i] = 0;
+    }
+    if(dirty[0]){
+        if(mfs_overlayPwrite(mnt, meta, ovl->segBlock[seg], 1) == -1) return -1;
+        dirty[0] = 0;
+    }
+
+    return 0;
+}
+
+int mfs_overlayWrite(mfs_mount *mnt, char *buffer, __u32 block, __u32 count){
+    char        *meta, *dirty, *runBuffer = buffer;
+    __u32       where, pos, runStart = 0, run = 0, seg, i, *map;
+    mfs_overlay *ovl = mnt->overlay;
+
+    for(i = 0; i < count; i++){
+        where = 0;
+        if(block + i != 0){
+            if(mfs_overlaySegment(mnt, (block + i) >> ovl->segShift, 1, &meta) == -1){
+                return -1;
+            }
+            pos = (block + i) & ((1U << ovl->segShift) - 1);
+            map = (__u32 *) (meta + mnt->sblock.block_size);
+            if(!mfs_testBit(meta, pos)){
+                dirty = meta + ((size_t) (1 + ovl->mapBlocks) << mnt->blockShift);
+                map[pos] = ovl->next++;
+                mfs_setBit(meta, pos);
+                dirty[0] = 1;
+                dirty[1 + (pos >> mnt->ptrShift)] = 1;
+            }
+            where = map[pos];
+        }
+        if(run && where == runStart + run){
+            run++;
+            continue;
+        }
+        if(run && mfs_overlayPwrite(mnt, runBuffer, runStart, run) == -1) return -1;
+        runStart = where;
+        run = 1;
+        runBuffer = buffer + ((size_t) i << mnt->blockShift);
+    }
+    if(run && mfs_overlayPwrite(mnt, runBuffer, runStart, run) == -1) return -1;
+
+    /* The map blocks go out before the bitmap that commits them. */
+    for(seg = block >> ovl->segShift;
+        count && seg <= (block + count - 1) >> ovl->segShift; seg++){
+        if(mfs_overlayFlush(mnt, seg) == -1) return -1;
+    }
+
+    return mfs_overlayGrow(mnt, block + count);
+}
+
+/* Blocks past the end of the base that were never written already read as
+ * zeros, so zeroing them, as a new group does, costs nothing. */
+int mfs_overlayZero(mfs_mount *mnt, __u32 block, __u32 count){
+    int     err = 0;
+    char    *zero;
+    __u32   where, i;
+
+    zero = mfs_blockZero(mnt->sblock.block_size);
+    if(zero == NULL){
+        perror("mfs_overlayZero malloc");
+        return -1;
+    }
+    for(i = 0; i < count && !err; i++){
+        switch(mfs_overlayFind(mnt, block + i, &where)){
+            case -1:
+                err = -1;
+                break;
+            case MFS_OVERLAY_NONE:
+                break;
+            default:
+                err = mfs_overlayWrite(mnt, zero, block + i, 1);
+        }
+    }
+    mfs_blockPut(zero, mnt->sblock.block_size);
+    if(err) return -1;
+
+    return mfs_overlayGrow(mnt, block + count);
+}
+
+int mfs_overlayTruncate(mfs_mount *mnt, __u32 blocks){
+    char                *meta;
+    __u32               seg, pos, last;
+    mfs_overlay         *ovl = mnt->overlay;
+    mfs_overlay_header  *hdr = mfs_overlayHeader(ovl);
+
+    last = hdr->blocks ? (hdr->blocks - 1) >> ovl->segShift : 0;
+    for(seg = blocks >> ovl->segShift; seg <= last; seg++){
+        if(mfs_overlaySegment(mnt, seg, 0, &meta) == -1) return -1;
+        if(meta == NULL) continue;
+        pos = seg == blocks >> ovl->segShift ? blocks & ((1U << ovl->segShift) - 1) : 0;
+        for(; pos < 1U << ovl->segShift; pos++) mfs_clearBit(meta, pos);
+        if(mfs_overlayPwrite(mnt, meta, ovl->segBlock[seg], 1) == -1) return -1;
+    }
+
+    if(hdr->base_blocks > blocks) hdr->base_blocks = blocks;
+    hdr->blocks = blocks;
+    return mfs_overlayPwrite(mnt, ovl->header, MFS_OVERLAY_HEADER, 1);
+}
+
+int mfs_overlayCreate(const char *base, const char *path){
+    int                 fd, baseFd, err = 0;
+    char                *buffer, resolved[PATH_MAX];
+    mfs_superblock      sblock;
+    mfs_overlay_header  hdr;
+    struct stat64       st;
+
+    baseFd = open(base, O_RDONLY);
+    if(baseFd == -1){
+        perror("mfs_create -backing open");
+        return -1;
+    }
+    if(pread(baseFd, &sblock, sizeof(mfs_superblock), 0) < (ssize_t) sizeof(sblock) ||
+       fstat64(baseFd, &st) == -1 || sblock.block_size < 512 ||
+       (sblock.block_size & (sblock.block_size - 1)) ||
+       (sblock.feature_incompat & ~MFS_FEATURE_SUPPORTED) ||
+       (sblock.feature_incompat & MFS_FEATURE_OVERLAY)){
+        fprintf(stderr, "mfs_create: %s cannot back an overlay.\n", base);
+        close(baseFd);
+        return -1;
+    }
+    if(realpath(base, resolved) == NULL || strlen(resolved) >= MFS_OVERLAY_PATH){
+        fprintf(stderr, "mfs_create: path of %s too long.\n", base);
+        close(baseFd);
+        return -1;
+    }
+
+    buffer = calloc(2, sblock.block_size);
+    if(buffer == NULL){
+        perror("mfs_create malloc");
+        close(baseFd);
+        return -1;
+    }
+    if(pread(baseFd, buffer, sblock.block_size, 0) < (ssize_t) sblock.block_size){
+        perror("mfs_create read");
+        free(buffer);
+        close(baseFd);
+        return -1;
+    }
+    close(baseFd);
+
+    sblock.feature_incompat |= MFS_FEATURE_OVERLAY;
+    memcpy(buffer, &sblock, sizeof(mfs_superblock));
+    memset(&hdr, 0, sizeof(mfs_overlay_header));
+    hdr.magic = MFS_OVERLAY_MAGIC;
+    hdr.blocks = st.st_size / sblock.block_size;
+    hdr.base_blocks = hdr.blocks;
+    strcpy(hdr.base, resolved);
+    memcpy(buffer + (size_t) MFS_OVERLAY_HEADER * sblock.block_size, &hdr,
+           sizeof(mfs_overlay_header));
+
+    fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0666);
+    if(fd == -1){
+        perror("mfs_create open");
+        free(buffer);
+        return -1;
+    }
+    if(pwrite(fd, buffer, 2 * sblock.block_size, 0) < 2 * (ssize_t) sblock.block_size){
+        perror("mfs_create write");
+        unlink(path);
+        err = -1;
+    }
+
+    close(fd);
+    free(buffer);
+    return err;
+}
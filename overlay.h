@@ -0,0 +1,72 @@
+#ifndef _OVERLAY_H_
+#define _OVERLAY_H_
+
+#include <pthread.h>
+#include "filesystem.h"
+
+#define MFS_OVERLAY_MAGIC       0x4d4f564c
+#define MFS_OVERLAY_PATH        256
+/* Block 0 of an overlay file is the image's superblock, block 1 the header. */
+#define MFS_OVERLAY_HEADER      1
+
+/* Header of an overlay image, made by mfs_create -backing. Image blocks are
+ * grouped in segments of block_size * 8. The __u32s that follow the header in
+ * its block point to index blocks, whose entries point to the metadata of one
+ * segment each: a presence bitmap block followed by the map, one __u32 per
+ * image block giving the overlay block that holds it. Blocks whose bit is
+ * clear are read from the base image, or as zeros past its end. */
+typedef struct{
+    __u32           magic;
+    __u32           blocks;
+    __u32           base_blocks;
+    __u32           reserved;
+    char            base[MFS_OVERLAY_PATH];
+}mfs_overlay_header;
+
+/* The overlay state of a mount. segBlock holds the index blocks one after
+ * the other, so an index block is written straight from it. seg caches the
+ * metadata of a segment once read, followed by one dirty flag per block.
+ * Readers fill seg in, and mfs_walk reads from several threads, so lock
+ * guards it. */
+typedef struct mfs_overlay{
+    int             base;
+    __u32           next;
+    __u32           segShift;
+    __u32           mapBlocks;
+    __u32           perIndex;
+    __u32           indexCount;
+    __u32           segments;
+    char            *header;
+    __u32           *segBlock;
+    char            **seg;
+    pthread_mutex_t lock;
+}mfs_overlay;
+
+/* Creates path as an empty overlay of the image base. Only the superblock and
+ * the header are written. */
+int mfs_overlayCreate(const char *base, const char *path);
+
+/* Opens the base of an image with MFS_FEATURE_OVERLAY and reads its index. */
+int mfs_overlayOpen(mfs_mount *mnt);
+
+/* Re-reads the index after another process changed the overlay. */
+int mfs_overlayReload(mfs_mount *mnt);
+
+void mfs_overlayClose(mfs_mount *mnt);
+
+/* Size of the image in blocks, which is not the size of the overlay file. */
+__u32 mfs_overlayBlocks(mfs_mount *mnt);
+
+/* Block I/O of an overlay image, used by mfs_read and friends. Written blocks
+ * get an overlay block on first write; the map is written before the bitmap,
+ * which commits the block. */
+int mfs_overlayRead(mfs_mount *mnt, char *buffer, __u32 block, __u32 count);
+int mfs_overlayWrite(mfs_mount *mnt, char *buffer, __u32 block, __u32 count);
+int mfs_overlayZero(mfs_mount *mnt, __u32 block, __u32 count);
+
+/* Shrinks the image to blocks blocks. Overlay blocks past the end are unmapped
+ * and the base no longer shows through there, so the image grows back from
+ * zeros. The overlay file itself keeps its size. */
+int mfs_overlayTruncate(mfs_mount *mnt, __u32 blocks);
+
+#endif
@@ -0,0 +1,398 @@
+#define _LARGEFILE64_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "resize.h"
+#include "defrag.h"
+#include "freemap.h"
+#include "libmfs.h"
+
+int mfs_groupCount(mfs_mount *mnt, __u32 *groups){
+    __u32           block = 1;
+    char            *buffer;
+    group_linker    link;
+
+    buffer = mfs_blockGet(mnt->sblock.block_size);
+    if(buffer == NULL){
+        perror("mfs_groupCount malloc");
+        return -1;
+    }
+
+    *groups = 0;
+    while(block != 0){
+        if(mfs_read(mnt, buffer, block) == -1){
+            mfs_blockPut(buffer, mnt->sblock.block_size);
+            return -1;
+        }
+        memcpy(&link, buffer, sizeof(group_linker));
+        *groups += link.no_descriptors;
+        block = link.next_block;
+    }
+
+    mfs_blockPut(buffer, mnt->sblock.block_size);
+    return 0;
+}
+
+int mfs_growGroups(mfs_mount *mnt, __u32 count){
+    int                 err = 0;
+    char                *last, *fresh = NULL, *cur, **buffers = NULL;
+    __u32               lastBlock = 1, curBlock, ptr, span, descs, room, n = 0, i;
+    __u32               *blocks = NULL;
+    __u64               size, end;
+    group_linker        link;
+    group_descriptor    grDesc;
+
+    if(count == 0) return 0;
+    last = mfs_blockGet(mnt->sblock.block_size);
+    if(last == NULL){
+        perror("mfs_growGroups malloc");
+        return -1;
+    }
+    while(1){
+        if(mfs_read(mnt, last, lastBlock) == -1){
+            mfs_blockPut(last, mnt->sblock.block_size);
+            return -1;
+        }
+        memcpy(&link, last, sizeof(group_linker));
+        if(link.next_block == 0) break;
+        lastBlock = link.next_block;
+    }
+
+    /* A group is its two bitmaps, its inode table and its data blocks, and
+     * every max_descriptors groups start with a new descriptor block. */
+    span = 2 + mnt->sblock.inode_blocks + mnt->sblock.block_size * 8;
+    room = link.max_descriptors - link.no_descriptors;
+    descs = count > room ? (count - room + link.max_descriptors - 1) /
+                           link.max_descriptors : 0;
+    if(mfs_imageBlocks(mnt, &size) == -1){
+        mfs_blockPut(last, mnt->sblock.block_size);
+        return -1;
+    }
+    end = size + descs + (__u64) count * span;
+    if(end > 0xffffffffULL){
+        fprintf(stderr, "mfs_growGroups: block numbers exhausted.\n");
+        mfs_blockPut(last, mnt->sblock.block_size);
+        return -1;
+    }
+    if(descs){
+        fresh = calloc(descs, mnt->sblock.block_size);
+        buffers = malloc(descs * sizeof(char *));
+        blocks = malloc(descs * sizeof(__u32));
+        if(fresh == NULL || buffers == NULL || blocks == NULL){
+            perror("mfs_growGroups malloc");
+            err = -1;
+        }
+    }
+    if(!err) err = mfs_imageExtend(mnt, size, end - size);
+
+    grDesc.free_blocks = mnt->sblock.block_size * 8 > 0xffff ? 0xffff :
+                         mnt->sblock.block_size * 8;
+    grDesc.free_inodes = grDesc.free_blocks;
+    cur = last;
+    curBlock = lastBlock;
+    ptr = size;
+    for(i = 0; i < count && !err; i++){
+        if(link.no_descriptors == link.max_descriptors){
+            link.next_block = ptr;
+            memcpy(cur, &link, sizeof(group_linker));
+            cur = fresh + (size_t) n * mnt->sblock.block_size;
+            buffers[n] = cur;
+            blocks[n++] = ptr;
+            curBlock = ptr++;
+            link.next_block = 0;
+            link.no_descriptors = 0;
+        }
+        grDesc.block_bitmap = ptr;
+        grDesc.inode_bitmap = ptr + 1;
+        grDesc.inode_table = ptr + 2;
+        memcpy(cur + sizeof(group_linker) + link.no_descriptors *
+               sizeof(group_descriptor), &grDesc, sizeof(group_descriptor));
+        mfs_freemapAdd(mnt, curBlock, link.no_descriptors,
+                       grDesc.inode_table + mnt->sblock.inode_blocks);
+        link.no_descriptors++;
+        ptr += span;
+    }
+    memcpy(cur, &link, sizeof(group_linker));
+
+    /* The new descriptor blocks are unreachable until the last old one is
+     * written, which adds all the groups at once. */
+    if(!err && ((n && mfs_writeVec(mnt, buffers, blocks, n) == -1) ||
+                mfs_write(mnt, last, lastBlock) == -1)){
+        err = -1;
+    }
+    if(err) mfs_freemapDrop(mnt);
+    free(fresh);
+    free(buffers);
+    free(blocks);
+    mfs_blockPut(last, mnt->sblock.block_size);
+
+    if(!err && end * mnt->sblock.block_size > 0xffffffffULL &&
+       !(mnt->sblock.feature_incompat & MFS_FEATURE_LARGE_IMAGE)){
+        mnt->sblock.feature_incompat |= MFS_FEATURE_LARGE_IMAGE;
+        err = mfs_writeSuperblock(mnt);
+    }
+
+    return err;
+}
+
+/* Checks that the groups before keep have room for the blocks and inodes in
+ * use in the groups from keep on. */
+static int mfs_shrinkFits(mfs_mount *mnt, __u32 keep){
+    __u32               block = 1, group = 0, full, i;
+    __u64               room[2] = {0, 0}, used[2] = {0, 0};
+    char                *buffer;
+    group_linker        link;
+    group_descriptor    grDesc;
+
+    buffer = mfs_blockGet(mnt->sblock.block_size);
+    if(buffer == NULL){
+        perror("mfs_shrinkGroups malloc");
+        return -1;
+    }
+
+    full = mnt->sblock.block_size * 8 > 0xffff ? 0xffff : mnt->sblock.block_size * 8;
+    while(block != 0){
+        if(mfs_read(mnt, buffer, block) == -1){
+            mfs_blockPut(buffer, mnt->sblock.block_size);
+            return -1;
+        }
+        memcpy(&link, buffer, sizeof(group_linker));
+        for(i = 0; i < link.no_descriptors; i++, group++){
+            memcpy(&grDesc, buffer + sizeof(group_linker) + i * sizeof(group_descriptor),
+                   sizeof(group_descriptor));
+            if(group < keep){
+                room[0] += grDesc.free_blocks;
+                room[1] += grDesc.free_inodes;
+            }else{
+                used[0] += full - grDesc.free_blocks;
+                used[1] += full - grDesc.free_inodes;
+            }
+        }
+        block = link.next_block;
+    }
+
+    mfs_blockPut(buffer, mnt->sblock.block_size);
+    if(used[0] > room[0] || used[1] > room[1]){
+        fprintf(stderr, "mfs_shrinkGroups: the remaining groups are too full.\n");
+        return -1;
+    }
+    return 0;
+}
+
+/* 1 if a data, indirect or extent tree block of file lies at or past cut.
+ * Classic files are looked up one block at a time, so that every indirect
+ * block they have passes through map.cached. */
+static int mfs_shrinkReaches(mfs_mount *mnt, inode *file, __u32 cut){
+    int             found = 0, i;
+    __u32           physical, run, step;
+    __u64           logical, length;
+    mfs_blockmap    map;
+
+    length = (file->file_size + mnt->blockMask) >> mnt->blockShift;
+    if(file->mode & MFS_MODE_TAIL) length--;
+    if(mfs_mapInit(&map, mnt, file) == -1) return -1;
+
+    for(logical = 0; logical < length && !found; logical += run){
+        step = 1;
+        if(file->mode & MFS_MODE_EXTENTS){
+            step = length - logical < 0xffffffffULL ? length - logical : 0xffffffff;
+        }
+        if(mfs_mapRun(&map, logical, step, &physical, &run) == -1){
+            found = -1;
+            break;
+        }
+        if(physical != 0 && (__u64) physical + run > cut) found = 1;
+        for(i = 0; i < 3; i++){
+            if(map.cached[i] >= cut) found = 1;
+        }
+    }
+
+    mfs_mapDestroy(&map);
+    return found;
+}
+
+/* Moves whatever file keeps at or past cut to blocks before it. */
+static int mfs_shrinkFile(mfs_mount *mnt, inode *file, __u32 cut){
+    int     err = 0, i;
+    char    *buffer;
+    __u32   old, runs;
+    __u64   blocks;
+
+    if(file->mode & MFS_MODE_INLINE) return 0;
+    buffer = mfs_blockGet(mnt->sblock.block_size);
+    if(buffer == NULL){
+        perror("mfs_shrinkGroups malloc");
+        return -1;
+    }
+
+    if(MFS_TYPE(file->mode) == 0){
+        for(i = 0; i < DATABLOCK_NUM && !err; i++){
+            old = file->datablocks[i];
+            if(old < cut) continue;
+            if(mfs_read(mnt, buffer, old) == -1 ||
+               mfs_allocBlock(mnt, buffer, file->datablocks, i, file->node_id) == -1 ||
+               mfs_updateInode(mnt, file) == -1 || mfs_freeBlocks(mnt, old, 1) == -1){
+                err = -1;
+            }
+        }
+        mfs_blockPut(buffer, mnt->sblock.block_size);
+        return err;
+    }
+
+    if((file->mode & MFS_MODE_TAIL) && file->datablocks[MFS_TAIL_BLOCK] >= cut){
+        if(mfs_tailRead(mnt, file, buffer) == -1 ||
+           mfs_tailPack(mnt, file, buffer,
+                        file->datablocks[MFS_TAIL_WHERE] & 0xffff) == -1 ||
+           mfs_updateInode(mnt, file) == -1){
+            err = -1;
+        }
+    }
+    mfs_blockPut(buffer, mnt->sblock.block_size);
+    if(err) return -1;
+
+    switch(mfs_shrinkReaches(mnt, file, cut)){
+        case -1:
+            return -1;
+        case 0:
+            return 0;
+    }
+    if(mfs_fragments(mnt, file, &runs, &blocks) == -1) return -1;
+    return mfs_moveFile(mnt, file, blocks, 0) == -1 ? -1 : 0;
+}
+
+static int mfs_shrinkLink(mfs_mount *mnt, char *buffer, __u32 offset, __u32 block,
+                          __u32 inodeptr){
+    directory_entry entry;
+
+    memcpy(&entry, buffer + offset, sizeof(directory_entry));
+    if(entry.inodeptr == inodeptr) return 0;
+    entry.inodeptr = inodeptr;
+    memcpy(buffer + offset, &entry, sizeof(directory_entry));
+
+    return mfs_write(mnt, buffer, block);
+}
+
+/* Empties the groups from keep on below dir. An inode in those groups is
+ * copied to a new one first and its entry, and the "." and ".." entries that
+ * name it, switched over. */
+static int mfs_shrinkDir(mfs_mount *mnt, inode *dir, __u32 parent, __u32 keep,
+                         __u32 cut){
+    int             err = 0, i;
+    char            *buffer, *name;
+    __u32           offset, curOffset;
+    directory_entry entry;
+    inode           cur;
+
+    buffer = mfs_blockGet(mnt->sblock.block_size);
+    if(buffer == NULL){
+        perror("mfs_shrinkGroups malloc");
+        return -1;
+    }
+
+    for(i = 0; i < DATABLOCK_NUM && dir->datablocks[i] != 0 && !err; i++){
+        if(mfs_read(mnt, buffer, dir->datablocks[i]) == -1){
+            err = -1;
+            break;
+        }
+        memcpy(&offset, buffer, 4);
+        for(curOffset = 4; curOffset < offset && !err; curOffset += entry.rec_len){
+            memcpy(&entry, buffer + curOffset, sizeof(directory_entry));
+            if(entry.rec_len == 0) break;
+            if(entry.inodeptr == 0) continue;
+            name = buffer + curOffset + sizeof(directory_entry);
+            if(entry.name_len <= 2 && !strncmp(name, "..", entry.name_len)){
+                err = mfs_shrinkLink(mnt, buffer, curOffset, dir->datablocks[i],
+                                     entry.name_len == 1 ? dir->node_id : parent);
+                continue;
+            }
+
+            if(mfs_findInode(mnt, entry.inodeptr, &cur) == -1){
+                err = -1;
+                break;
+            }
+            if((cur.node_id - 1) >> mnt->groupShift >= keep &&
+               (mfs_allocInode(mnt, &cur, dir->node_id) == -1 ||
+                mfs_shrinkLink(mnt, buffer, curOffset, dir->datablocks[i],
+                               cur.node_id) == -1)){
+                err = -1;
+                break;
+            }
+            err = mfs_shrinkFile(mnt, &cur, cut);
+            if(!err && MFS_TYPE(cur.mode) == 0){
+                err = mfs_shrinkDir(mnt, &cur, dir->node_id, keep, cut);
+            }
+        }
+    }
+
+    mfs_blockPut(buffer, mnt->sblock.block_size);
+    return err;
+}
+
+int mfs_shrinkGroups(mfs_mount *mnt, __u32 count){
+    int                 err;
+    char                *buffer;
+    __u32               groups, keep, blockNo, grDescNo, cut;
+    group_linker        link;
+    group_descriptor    grDesc;
+    inode               root;
+
+    if(count == 0) return 0;
+    if(mfs_groupCount(mnt, &groups) == -1) return -1;
+    if(count >= groups){
+        fprintf(stderr, "mfs_shrinkGroups: the first group cannot be removed.\n");
+        return -1;
+    }
+    keep = groups - count;
+    if(mfs_shrinkFits(mnt, keep) == -1) return -1;
+
+    buffer = mfs_blockGet(mnt->sblock.block_size);
+    if(buffer == NULL){
+        perror("mfs_shrinkGroups malloc");
+        return -1;
+    }
+    if(mfs_groupLocate(mnt, keep, &blockNo, &grDescNo) == -1 ||
+       mfs_read(mnt, buffer, blockNo) == -1){
+        mfs_blockPut(buffer, mnt->sblock.block_size);
+        return -1;
+    }
+    memcpy(&grDesc, buffer + sizeof(group_linker) + grDescNo * sizeof(group_descriptor),
+           sizeof(group_descriptor));
+    cut = grDescNo == 0 ? blockNo : grDesc.block_bitmap;
+
+    /* Nothing is allocated from the groups being removed while they are
+     * emptied, and the tail fragment block is replaced if it is among them. */
+    mnt->limit = cut;
+    if(mnt->sblock.frag_block >= cut) mnt->sblock.frag_block = 0;
+    err = mfs_findInode(mnt, MFS_ROOT_INO, &root);
+    if(!err) err = mfs_shrinkFile(mnt, &root, cut);
+    if(!err) err = mfs_shrinkDir(mnt, &root, root.node_id, keep, cut);
+    mnt->limit = 0;
+    if(err){
+        fprintf(stderr, "mfs_shrinkGroups: could not empty the last groups.\n");
+        mfs_blockPut(buffer, mnt->sblock.block_size);
+        return -1;
+    }
+
+    /* The chain ends after the last group that stays. When the first group
+     * removed starts a descriptor block, that whole block goes. The moves
+     * above changed the free counts, so the block is read again. */
+    if(grDescNo == 0 && mfs_groupLocate(mnt, keep - 1, &blockNo, &grDescNo) == 0){
+        grDescNo++;
+    }
+    if(grDescNo == 0 || mfs_read(mnt, buffer, blockNo) == -1){
+        mfs_blockPut(buffer, mnt->sblock.block_size);
+        return -1;
+    }
+    memcpy(&link, buffer, sizeof(group_linker));
+    link.no_descriptors = grDescNo;
+    link.next_block = 0;
+    memcpy(buffer, &link, sizeof(group_linker));
+    err = mfs_write(mnt, buffer, blockNo);
+    mfs_blockPut(buffer, mnt->sblock.block_size);
+    if(err) return -1;
+
+    mfs_freemapDrop(mnt);
+    if(mfs_writeSuperblock(mnt) == -1) return -1;
+    return mfs_imageTruncate(mnt, cut);
+}
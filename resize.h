@@ -0,0 +1,20 @@
+#ifndef _RESIZE_H_
+#define _RESIZE_H_
+
+#include "filesystem.h"
+
+/* Number of block groups of the image. */
+int mfs_groupCount(mfs_mount *mnt, __u32 *groups);
+
+/* Appends count empty groups at once. The space of all of them is reserved
+ * with one fallocate, their descriptors are written together and the last
+ * existing descriptor block, which links them in, goes last. */
+int mfs_growGroups(mfs_mount *mnt, __u32 count);
+
+/* Removes the last count groups and truncates the image. Data blocks, inodes
+ * and tails in those groups are first moved into the groups that stay, and
+ * directory entries are pointed at the moved inodes. If anything cannot be
+ * moved the image is left at its size. */
+int mfs_shrinkGroups(mfs_mount *mnt, __u32 count);
+
+#endif
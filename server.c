@@ -0,0 +1,482 @@
+#define _LARGEFILE64_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "server.h"
+
+typedef struct{
+    const char      *image;
+    pthread_mutex_t lock;
+    pthread_cond_t  ready;
+    int             clients[MFS_SERVER_QUEUE];
+    int             head;
+    int             count;
+}mfs_server;
+
+static int mfs_sendAll(int sock, const void *buf, size_t len){
+    ssize_t sent;
+
+    while(len > 0){
+        sent = send(sock, buf, len, 0);
+        if(sent == -1){
+            if(errno == EINTR) continue;
+            return -1;
+        }
+        buf = (const char *) buf + sent;
+        len -= sent;
+    }
+
+    return 0;
+}
+
+/* Fails with errno 0 when the peer closed the connection. */
+static int mfs_recvAll(int sock, void *buf, size_t len){
+    ssize_t got;
+
+    while(len > 0){
+        got = recv(sock, buf, len, 0);
+        if(got == 0) errno = 0;
+        if(got == 0 || (got == -1 && errno != EINTR)) return -1;
+        if(got == -1) continue;
+        buf = (char *) buf + got;
+        len -= got;
+    }
+
+    return 0;
+}
+
+static int mfs_socketAddress(const char *socketPath, struct sockaddr_un *addr){
+    memset(addr, 0, sizeof(struct sockaddr_un));
+    addr->sun_family = AF_UNIX;
+    if(strlen(socketPath) >= sizeof(addr->sun_path)){
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr->sun_path, socketPath);
+
+    return 0;
+}
+
+/* Answers requests on one connection until the client hangs up. buffer holds
+ * MFS_SERVER_MAX_IO + 1 bytes and is used for both directions. */
+static int mfs_serveClient(mfs_mount *mnt, int client, char *buffer){
+    int             err, entries;
+    __u32           found;
+    __u64           cookie;
+    ssize_t         done;
+    mfs_request     request;
+    mfs_response    response;
+
+    while(!mfs_recvAll(client, &request, sizeof(mfs_request))){
+        if(request.length > MFS_SERVER_MAX_IO){
+            errno = EMSGSIZE;
+            return -1;
+        }
+        if(mfs_recvAll(client, buffer, request.length)) return -1;
+        buffer[request.length] = '\0';
+
+        err = 0;
+        memset(&response, 0, sizeof(mfs_response));
+        switch(request.op){
+            case MFS_OP_LOOKUP:
+                err = mfs_lookup(mnt, request.ino, buffer, &found);
+                response.value = found;
+                break;
+            case MFS_OP_STAT:
+                err = mfs_stat(mnt, request.ino, (inode *) buffer);
+                response.length = sizeof(inode);
+                break;
+            case MFS_OP_READDIR:
+                if(request.count > MFS_SERVER_MAX_IO / sizeof(mfs_dirent)){
+                    request.count = MFS_SERVER_MAX_IO / sizeof(mfs_dirent);
+                }
+                cookie = request.offset;
+                entries = mfs_readdir(mnt, request.ino, &cookie, (mfs_dirent *) buffer,
+                                      request.count);
+                if(entries == -1) err = -1;
+                else response.length = entries * sizeof(mfs_dirent);
+                response.value = cookie;
+                break;
+            case MFS_OP_READ:
+                if(request.count > MFS_SERVER_MAX_IO) request.count = MFS_SERVER_MAX_IO;
+                done = mfs_read_at(mnt, request.ino, buffer, request.count,
+                                   request.offset);
+                if(done == -1) err = -1;
+                else response.length = done;
+                break;
+            case MFS_OP_WRITE:
+                done = mfs_write_at(mnt, request.ino, buffer, request.length,
+                                    request.offset);
+                if(done == -1) err = -1;
+                else response.value = done;
+                break;
+            case MFS_OP_CREAT:
+                err = mfs_creat(mnt, request.ino, buffer, &found);
+                response.value = found;
+                break;
+            case MFS_OP_MKDIR:
+                err = mfs_mkdir(mnt, request.ino, buffer, &found);
+                response.value = found;
+                break;
+            default:
+                errno = EINVAL;
+                err = -1;
+        }
+        if(err){
+            response.status = -errno;
+            response.length = 0;
+            response.value = 0;
+        }
+        if(mfs_sendAll(client, &response, sizeof(mfs_response)) ||
+           mfs_sendAll(client, buffer, response.length)){
+            return -1;
+        }
+    }
+
+    return errno ? -1 : 0;
+}
+
+static void* mfs_serverWorker(void *arg){
+    int         client;
+    char        *buffer;
+    mfs_server  *server = arg;
+    mfs_mount   *mnt;
+
+    mnt = mfs_open(server->image, O_RDWR);
+    buffer = malloc(MFS_SERVER_MAX_IO + 1);
+    if(mnt == NULL || buffer == NULL){
+        perror("mfs_serve worker");
+        mfs_close(mnt);
+        free(buffer);
+        return NULL;
+    }
+
+    while(1){
+        pthread_mutex_lock(&server->lock);
+        while(server->count == 0) pthread_cond_wait(&server->ready, &server->lock);
+        client = server->clients[server->head];
+        server->head = (server->head + 1) % MFS_SERVER_QUEUE;
+        server->count--;
+        pthread_mutex_unlock(&server->lock);
+
+        mfs_serveClient(mnt, client, buffer);
+        close(client);
+    }
+
+    return NULL;
+}
+
+int mfs_serve(const char *image, const char *socketPath, int threads){
+    int                 sock, client, i, started = 0;
+    pthread_t           thread;
+    struct sockaddr_un  addr;
+    mfs_server          server;
+    mfs_mount           *mnt;
+
+    mnt = mfs_open(image, O_RDWR);
+    if(mnt == NULL){
+        perror("mfs_serve open");
+        return -1;
+    }
+    mfs_close(mnt);
+    if(threads < 1) threads = MFS_SERVER_THREADS;
+
+    signal(SIGPIPE, SIG_IGN);
+    if(mfs_socketAddress(socketPath, &addr) == -1){
+        perror("mfs_serve socket");
+        return -1;
+    }
+    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(sock == -1){
+        perror("mfs_serve socket");
+        return -1;
+    }
+    unlink(socketPath);
+    if(bind(sock, (struct sockaddr *) &addr, sizeof(struct sockaddr_un)) == -1 ||
+       chmod(socketPath, 0600) == -1 || listen(sock, MFS_SERVER_BACKLOG) == -1){
+        perror("mfs_serve bind");
+        close(sock);
+        return -1;
+    }
+
+    server.image = image;
+    server.head = 0;
+    server.count = 0;
+    pthread_mutex_init(&server.lock, NULL);
+    pthread_cond_init(&server.ready, NULL);
+    for(i = 0; i < threads; i++){
+        if(pthread_create(&thread, NULL, mfs_serverWorker, &server)){
+            perror("mfs_serve pthread_create");
+            continue;
+        }
+        pthread_detach(thread);
+        started++;
+    }
+    if(!started){
+        close(sock);
+        unlink(socketPath);
+        return -1;
+    }
+
+    while(1){
+        client = accept(sock, NULL, NULL);
+        if(client == -1){
+            if(errno != EINTR) perror("mfs_serve accept");
+            continue;
+        }
+        pthread_mutex_lock(&server.lock);
+        if(server.count == MFS_SERVER_QUEUE){
+            pthread_mutex_unlock(&server.lock);
+            close(client);
+            continue;
+        }
+        server.clients[(server.head + server.count) % MFS_SERVER_QUEUE] = client;
+        server.count++;
+        pthread_cond_signal(&server.ready);
+        pthread_mutex_unlock(&server.lock);
+    }
+
+    return 0;
+}
+
+/* Sends one request and reads the answer, payload goes into data which holds
+ * size bytes. Fails with the server's errno. */
+static int mfs_clientCall(int sock, mfs_request *request, const void *payload,
+                          mfs_response *response, void *data, size_t size){
+    if(mfs_sendAll(sock, request, sizeof(mfs_request)) ||
+       mfs_sendAll(sock, payload, request->length) ||
+       mfs_recvAll(sock, response, sizeof(mfs_response))){
+        if(errno == 0) errno = ECONNRESET;
+        return -1;
+    }
+    if(response->length > size){
+        errno = EMSGSIZE;
+        return -1;
+    }
+    if(mfs_recvAll(sock, data, response->length)){
+        if(errno == 0) errno = ECONNRESET;
+        return -1;
+    }
+    if(response->status < 0){
+        errno = -response->status;
+        return -1;
+    }
+
+    return 0;
+}
+
+static int mfs_clientPath(int sock, __u16 op, __u32 dir, const char *path,
+                          __u32 *ino){
+    mfs_request     request;
+    mfs_response    response;
+
+    memset(&request, 0, sizeof(mfs_request));
+    request.op = op;
+    request.ino = dir;
+    request.length = strlen(path);
+    if(mfs_clientCall(sock, &request, path, &response, NULL, 0) == -1) return -1;
+    *ino = response.value;
+
+    return 0;
+}
+
+/* Splits path into the inode of its parent directory and its last name. */
+static int mfs_clientParent(int sock, char *path, __u32 *dir, char **name){
+    char    *slash;
+
+    slash = strrchr(path, '/');
+    if(slash == NULL){
+        *dir = MFS_ROOT_INO;
+        *name = path;
+        return 0;
+    }
+    *slash = '\0';
+    *name = slash + 1;
+
+    return mfs_clientPath(sock, MFS_OP_LOOKUP, MFS_ROOT_INO, path[0] ? path : "/", dir);
+}
+
+static int mfs_clientLs(int sock, char *path, char *buffer){
+    int             i;
+    __u32           dir;
+    mfs_dirent      *entries = (mfs_dirent *) buffer;
+    mfs_request     request;
+    mfs_response    response;
+
+    if(mfs_clientPath(sock, MFS_OP_LOOKUP, MFS_ROOT_INO, path, &dir) == -1) return -1;
+    memset(&request, 0, sizeof(mfs_request));
+    request.op = MFS_OP_READDIR;
+    request.ino = dir;
+    request.count = MFS_SERVER_MAX_IO / sizeof(mfs_dirent);
+    do{
+        if(mfs_clientCall(sock, &request, NULL, &response, buffer,
+                          MFS_SERVER_MAX_IO) == -1){
+            return -1;
+        }
+        for(i = 0; i < response.length / sizeof(mfs_dirent); i++){
+            printf("%s\n", entries[i].name);
+        }
+        request.offset = response.value;
+    }while(response.length > 0);
+
+    return 0;
+}
+
+static int mfs_clientStat(int sock, char *path, char *buffer){
+    __u32           ino;
+    inode           *st = (inode *) buffer;
+    mfs_request     request;
+    mfs_response    response;
+
+    if(mfs_clientPath(sock, MFS_OP_LOOKUP, MFS_ROOT_INO, path, &ino) == -1) return -1;
+    memset(&request, 0, sizeof(mfs_request));
+    request.op = MFS_OP_STAT;
+    request.ino = ino;
+    if(mfs_clientCall(sock, &request, NULL, &response, buffer, MFS_SERVER_MAX_IO) == -1){
+        return -1;
+    }
+    printf("inode %u %s size %llu\n", st->node_id,
+           MFS_TYPE(st->mode) ? "file" : "directory", st->file_size);
+
+    return 0;
+}
+
+/* Copies path on the image to the host descriptor out. */
+static int mfs_clientRead(int sock, char *path, int out, char *buffer){
+    __u32           ino;
+    mfs_request     request;
+    mfs_response    response;
+
+    if(mfs_clientPath(sock, MFS_OP_LOOKUP, MFS_ROOT_INO, path, &ino) == -1) return -1;
+    memset(&request, 0, sizeof(mfs_request));
+    request.op = MFS_OP_READ;
+    request.ino = ino;
+    request.count = MFS_SERVER_MAX_IO;
+    do{
+        if(mfs_clientCall(sock, &request, NULL, &response, buffer,
+                          MFS_SERVER_MAX_IO) == -1 ||
+           write(out, buffer, response.length) < (ssize_t) response.length){
+            return -1;
+        }
+        request.offset += response.length;
+    }while(response.length > 0);
+
+    return 0;
+}
+
+static int mfs_clientImport(int sock, char *hostPath, char *dirPath, char *buffer){
+    int             in;
+    ssize_t         got;
+    char            *name;
+    __u32           dir;
+    mfs_request     request;
+    mfs_response    response;
+
+    name = strrchr(hostPath, '/');
+    name = name == NULL ? hostPath : name + 1;
+    in = open(hostPath, O_RDONLY);
+    if(in == -1) return -1;
+    memset(&request, 0, sizeof(mfs_request));
+    if(mfs_clientPath(sock, MFS_OP_LOOKUP, MFS_ROOT_INO, dirPath, &dir) == -1 ||
+       mfs_clientPath(sock, MFS_OP_CREAT, dir, name, &request.ino) == -1){
+        close(in);
+        return -1;
+    }
+
+    request.op = MFS_OP_WRITE;
+    while((got = read(in, buffer, MFS_SERVER_MAX_IO)) > 0){
+        request.length = got;
+        if(mfs_clientCall(sock, &request, buffer, &response, NULL, 0) == -1){
+            close(in);
+            return -1;
+        }
+        request.offset += got;
+    }
+
+    close(in);
+    return got == -1 ? -1 : 0;
+}
+
+static int mfs_clientExport(int sock, char *path, char *hostDir, char *buffer){
+    int     out, err;
+    char    *name, *hostPath;
+
+    name = strrchr(path, '/');
+    name = name == NULL ? path : name + 1;
+    hostPath = malloc(strlen(hostDir) + strlen(name) + 2);
+    if(hostPath == NULL) return -1;
+    sprintf(hostPath, "%s/%s", hostDir, name);
+    out = open(hostPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    free(hostPath);
+    if(out == -1) return -1;
+
+    err = mfs_clientRead(sock, path, out, buffer);
+    if(close(out) == -1) err = -1;
+    return err;
+}
+
+int mfs_client(const char *socketPath, int argc, char **argv){
+    int                 sock, err = -1;
+    char                *buffer, *name;
+    __u32               dir, ino;
+    struct sockaddr_un  addr;
+
+    if(argc < 2 || (argc < 3 && (!strcmp(argv[0], "import") ||
+                                  !strcmp(argv[0], "export")))){
+        fprintf(stderr, "mfs_client: Invalid arguments.\n");
+        return -1;
+    }
+    if(mfs_socketAddress(socketPath, &addr) == -1){
+        perror("mfs_client socket");
+        return -1;
+    }
+    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(sock == -1 || connect(sock, (struct sockaddr *) &addr,
+                             sizeof(struct sockaddr_un)) == -1){
+        perror("mfs_client connect");
+        if(sock != -1) close(sock);
+        return -1;
+    }
+    buffer = malloc(MFS_SERVER_MAX_IO);
+    if(buffer == NULL){
+        perror("mfs_client malloc");
+        close(sock);
+        return -1;
+    }
+
+    if(!strcmp(argv[0], "ls")){
+        err = mfs_clientLs(sock, argv[1], buffer);
+    }else if(!strcmp(argv[0], "stat")){
+        err = mfs_clientStat(sock, argv[1], buffer);
+    }else if(!strcmp(argv[0], "cat")){
+        fflush(stdout);
+        err = mfs_clientRead(sock, argv[1], STDOUT_FILENO, buffer);
+    }else if(!strcmp(argv[0], "mkdir")){
+        err = mfs_clientParent(sock, argv[1], &dir, &name);
+        if(!err) err = mfs_clientPath(sock, MFS_OP_MKDIR, dir, name, &ino);
+    }else if(!strcmp(argv[0], "import")){
+        err = mfs_clientImport(sock, argv[1], argv[2], buffer);
+    }else if(!strcmp(argv[0], "export")){
+        err = mfs_clientExport(sock, argv[1], argv[2], buffer);
+    }else{
+        fprintf(stderr, "mfs_client: Invalid command.\n");
+        free(buffer);
+        close(sock);
+        return -1;
+    }
+    if(err) fprintf(stderr, "mfs_client %s: %s\n", argv[0], strerror(errno));
+
+    free(buffer);
+    close(sock);
+    return err;
+}
@@ -0,0 +1,46 @@
+#ifndef _SERVER_H_
+#define _SERVER_H_
+
+#include "libmfs.h"
+
+#define MFS_SERVER_THREADS  4
+#define MFS_SERVER_BACKLOG  64
+#define MFS_SERVER_QUEUE    256
+#define MFS_SERVER_MAX_IO   (1 << 20)
+
+#define MFS_OP_LOOKUP       1
+#define MFS_OP_STAT         2
+#define MFS_OP_READDIR      3
+#define MFS_OP_READ         4
+#define MFS_OP_WRITE        5
+#define MFS_OP_CREAT        6
+#define MFS_OP_MKDIR        7
+
+/* Every request is a header followed by length bytes of payload: a path or
+ * name for lookup, creat and mkdir, the data for write. */
+typedef struct{
+    __u16       op;
+    __u16       reserved;
+    __u32       ino;
+    __u64       offset;
+    __u32       count;
+    __u32       length;
+}mfs_request;
+
+/* status is 0 or a negative errno. value carries the inode number, the number
+ * of bytes written or the next readdir cookie. The payload is an inode for
+ * stat, mfs_dirent records for readdir and the data for read. */
+typedef struct{
+    __s32       status;
+    __u32       length;
+    __u64       value;
+}mfs_response;
+
+/* Serves the image on a Unix socket until killed. Connections are queued and
+ * handed to a pool of worker threads, each with its own mount of the image. */
+int mfs_serve(const char *image, const char *socketPath, int threads);
+
+/* Runs one command (ls, cat, stat, mkdir, import, export) against a server. */
+int mfs_client(const char *socketPath, int argc, char **argv);
+
+#endif
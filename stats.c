@@ -0,0 +1,139 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "stats.h"
+
+__thread mfs_stats mfs_counters;
+
+__thread mfs_histogram mfs_primitiveLatency[HIST_PRIMITIVES];
+
+const char *HIST_PRIMITIVE_NAMES[] = {"mfs_findFree", "mfs_findEntry",
+                                      "mfs_findInode", "mfs_writeData",
+                                      "mfs_followPath"};
+
+void mfs_statsDiff(mfs_stats *result, const mfs_stats *now, const mfs_stats *before){
+    result->block_reads = now->block_reads - before->block_reads;
+    result->block_writes = now->block_writes - before->block_writes;
+    result->bytes_read = now->bytes_read - before->bytes_read;
+    result->bytes_written = now->bytes_written - before->bytes_written;
+    result->findfree_calls = now->findfree_calls - before->findfree_calls;
+    result->findfree_retries = now->findfree_retries - before->findfree_retries;
+    result->bitmap_words = now->bitmap_words - before->bitmap_words;
+    result->dir_blocks = now->dir_blocks - before->dir_blocks;
+}
+
+void mfs_statsAdd(mfs_stats *total, const mfs_stats *toAdd){
+    total->block_reads += toAdd->block_reads;
+    total->block_writes += toAdd->block_writes;
+    total->bytes_read += toAdd->bytes_read;
+    total->bytes_written += toAdd->bytes_written;
+    total->findfree_calls += toAdd->findfree_calls;
+    total->findfree_retries += toAdd->findfree_retries;
+    total->bitmap_words += toAdd->bitmap_words;
+    total->dir_blocks += toAdd->dir_blocks;
+}
+
+int mfs_statsEmpty(const mfs_stats *stats){
+    mfs_stats   zero;
+
+    memset(&zero, 0, sizeof(mfs_stats));
+    return !memcmp(stats, &zero, sizeof(mfs_stats));
+}
+
+void mfs_statsPrint(FILE *out, const char *label, const mfs_stats *stats){
+    fprintf(out, "%-10s reads %llu (%llu B) writes %llu (%llu B) findFree %llu "
+            "(retries %llu) bitmap words %llu dir blocks %llu\n", label,
+            stats->block_reads, stats->bytes_read, stats->block_writes,
+            stats->bytes_written, stats->findfree_calls, stats->findfree_retries,
+            stats->bitmap_words, stats->dir_blocks);
+}
+
+void mfs_statsJson(FILE *out, const char *label, const mfs_stats *stats){
+    fprintf(out, "\"%s\": {\"block_reads\": %llu, \"block_writes\": %llu, "
+            "\"bytes_read\": %llu, \"bytes_written\": %llu, \"findfree_calls\": %llu, "
+            "\"findfree_retries\": %llu, \"bitmap_words\": %llu, \"dir_blocks\": %llu}",
+            label, stats->block_reads, stats->block_writes, stats->bytes_read,
+            stats->bytes_written, stats->findfree_calls, stats->findfree_retries,
+            stats->bitmap_words, stats->dir_blocks);
+}
+
+__u64 mfs_clock(){
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (__u64) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+void mfs_histRecord(mfs_histogram *hist, __u64 value){
+    int exponent, index;
+
+    if(value < HIST_SUB_COUNT){
+        index = value;
+    }else{
+        exponent = 63 - __builtin_clzll(value);
+        index = ((exponent - HIST_SUB_BITS + 1) << HIST_SUB_BITS) +
+                ((value >> (exponent - HIST_SUB_BITS)) & (HIST_SUB_COUNT - 1));
+    }
+    hist->buckets[index]++;
+    hist->count++;
+    if(value > hist->max) hist->max = value;
+}
+
+void mfs_histAdd(mfs_histogram *total, const mfs_histogram *toAdd){
+    int i;
+
+    for(i = 0; i < HIST_BUCKETS; i++) total->buckets[i] += toAdd->buckets[i];
+    total->count += toAdd->count;
+    if(toAdd->max > total->max) total->max = toAdd->max;
+}
+
+__u64 mfs_histBucketMax(int index){
+    int shift;
+
+    if(index < HIST_SUB_COUNT) return index;
+    shift = (index >> HIST_SUB_BITS) - 1;
+    return ((__u64) (HIST_SUB_COUNT + (index & (HIST_SUB_COUNT - 1)) + 1) << shift) - 1;
+}
+
+__u64 mfs_histPercentile(const mfs_histogram *hist, double percentile){
+    int     i;
+    __u64   seen = 0, rank, value;
+
+    if(hist->count == 0) return 0;
+    rank = (__u64) (percentile / 100.0 * hist->count + 0.5);
+    if(rank == 0) rank = 1;
+    for(i = 0; i < HIST_BUCKETS; i++){
+        seen += hist->buckets[i];
+        if(seen >= rank){
+            value = mfs_histBucketMax(i);
+            return value < hist->max ? value : hist->max;
+        }
+    }
+
+    return hist->max;
+}
+
+void mfs_histPrint(FILE *out, const char *label, const mfs_histogram *hist){
+    fprintf(out, "%-15s %8llu %10.1f %10.1f %10.1f %10.1f\n", label, hist->count,
+            mfs_histPercentile(hist, 50.0) / 1000.0,
+            mfs_histPercentile(hist, 99.0) / 1000.0,
+            mfs_histPercentile(hist, 99.9) / 1000.0, hist->max / 1000.0);
+}
+
+void mfs_histJson(FILE *out, const char *label, const mfs_histogram *hist){
+    int i, first = 1;
+
+    fprintf(out, "\"%s\": {\"count\": %llu, \"p50_ns\": %llu, \"p99_ns\": %llu, "
+            "\"p999_ns\": %llu, \"max_ns\": %llu, \"buckets\": [", label,
+            hist->count, mfs_histPercentile(hist, 50.0),
+            mfs_histPercentile(hist, 99.0), mfs_histPercentile(hist, 99.9),
+            hist->max);
+    for(i = 0; i < HIST_BUCKETS; i++){
+        if(hist->buckets[i]){
+            fprintf(out, "%s[%llu, %llu]", first ? "" : ", ", mfs_histBucketMax(i),
+                    hist->buckets[i]);
+            first = 0;
+        }
+    }
+    fprintf(out, "]}");
+}
@@ -0,0 +1,71 @@
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <stdio.h>
+#include <asm/types.h>
+
+typedef struct{
+    __u64       block_reads;
+    __u64       block_writes;
+    __u64       bytes_read;
+    __u64       bytes_written;
+    __u64       findfree_calls;
+    __u64       findfree_retries;
+    __u64       bitmap_words;
+    __u64       dir_blocks;
+}mfs_stats;
+
+/* Running totals bumped on the hot paths, never reset by the library. Each
+ * thread keeps its own. */
+extern __thread mfs_stats mfs_counters;
+
+#define MFS_STAT_ADD(field, n) (mfs_counters.field += (n))
+
+/* Latency histograms keep 2^HIST_SUB_BITS linear sub-buckets per power of two,
+ * so every recorded value is known to within about 6%. */
+#define HIST_SUB_BITS       4
+#define HIST_SUB_COUNT      (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS        ((64 - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+#define HIST_FINDFREE       0
+#define HIST_FINDENTRY      1
+#define HIST_FINDINODE      2
+#define HIST_WRITEDATA      3
+#define HIST_FOLLOWPATH     4
+#define HIST_PRIMITIVES     5
+
+typedef struct{
+    __u64       count;
+    __u64       max;
+    __u64       buckets[HIST_BUCKETS];
+}mfs_histogram;
+
+extern __thread mfs_histogram mfs_primitiveLatency[HIST_PRIMITIVES];
+
+extern const char *HIST_PRIMITIVE_NAMES[];
+
+void mfs_statsDiff(mfs_stats *result, const mfs_stats *now, const mfs_stats *before);
+
+void mfs_statsAdd(mfs_stats *total, const mfs_stats *toAdd);
+
+int mfs_statsEmpty(const mfs_stats *stats);
+
+void mfs_statsPrint(FILE *out, const char *label, const mfs_stats *stats);
+
+void mfs_statsJson(FILE *out, const char *label, const mfs_stats *stats);
+
+__u64 mfs_clock();
+
+void mfs_histRecord(mfs_histogram *hist, __u64 value);
+
+void mfs_histAdd(mfs_histogram *total, const mfs_histogram *toAdd);
+
+__u64 mfs_histBucketMax(int index);
+
+__u64 mfs_histPercentile(const mfs_histogram *hist, double percentile);
+
+void mfs_histPrint(FILE *out, const char *label, const mfs_histogram *hist);
+
+void mfs_histJson(FILE *out, const char *label, const mfs_histogram *hist);
+
+#endif
@@ -0,0 +1,73 @@
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "../libmfs.h"
+#include "../commands.h"
+
+#define TEST_IMAGE  "compact_test.mfs"
+#define FILES       200
+#define MOVED       180
+
+/* Moves most of a directory's files out with mfs_mv and checks that the
+ * removals compacted it without losing the entries left in it. */
+static int testMoveOut(){
+    int         err = 0, i;
+    char        *create[] = {"mfs_create", "-bs", "1024", TEST_IMAGE};
+    char        from[32], to[32], *move[] = {"mfs_mv", from, to};
+    __u32       src, dst, ino;
+    inode       dir, root;
+    mfs_mount   *mnt;
+
+    unlink(TEST_IMAGE);
+    if(mfs_create(create, 4) == -1) return -1;
+    mnt = mfs_open(TEST_IMAGE, O_RDWR);
+    if(mnt == NULL) return -1;
+
+    if(mfs_mkdir(mnt, MFS_ROOT_INO, "src", &src) == -1 ||
+       mfs_mkdir(mnt, MFS_ROOT_INO, "dst", &dst) == -1){
+        err = -1;
+    }
+    for(i = 0; i < FILES && !err; i++){
+        sprintf(from, "file%d", i);
+        if(mfs_creat(mnt, src, from, &ino) == -1) err = -1;
+    }
+    if(err || mfs_stat(mnt, src, &dir) == -1) err = -1;
+
+    if(!err && (mfs_lock(mnt, MFS_LOCK_WRITE) == -1 ||
+                mfs_stat(mnt, MFS_ROOT_INO, &root) == -1)){
+        err = -1;
+    }
+    for(i = 0; i < MOVED && !err; i++){
+        sprintf(from, "/src/file%d", i);
+        sprintf(to, "/dst/file%d", i);
+        if(mfs_mv(move, mnt, 3, &root) == -1) err = -1;
+    }
+    mfs_unlock(mnt);
+
+    if(!err && (mfs_stat(mnt, src, &root) == -1 || root.file_size >= dir.file_size)){
+        fprintf(stderr, "src was not compacted\n");
+        err = -1;
+    }
+    for(i = 0; i < FILES && !err; i++){
+        sprintf(from, "file%d", i);
+        if(mfs_lookup(mnt, i < MOVED ? dst : src, from, &ino) == -1 ||
+           mfs_lookup(mnt, i < MOVED ? src : dst, from, &ino) != -1){
+            fprintf(stderr, "file%d is in the wrong directory\n", i);
+            err = -1;
+        }
+    }
+
+    mfs_close(mnt);
+    unlink(TEST_IMAGE);
+    return err;
+}
+
+int main(){
+    if(testMoveOut() == -1){
+        printf("compact: FAIL\n");
+        return 1;
+    }
+    printf("compact: ok\n");
+    return 0;
+}
@@ -0,0 +1,140 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "../libmfs.h"
+#include "../commands.h"
+#include "../resize.h"
+
+#define TEST_IMAGE  "inodes_test.mfs"
+
+/* Marks every inode of group as used except the last keep ones. */
+static int fillGroup(mfs_mount *mnt, __u32 group, __u32 keep){
+    __u32               blockNo, grDescNo, i;
+    char                *buffer, *bitmap;
+    group_descriptor    grDesc;
+
+    buffer = mfs_blockGet(mnt->sblock.block_size);
+    bitmap = mfs_blockGet(mnt->sblock.block_size);
+    if(buffer == NULL || bitmap == NULL) return -1;
+    if(mfs_groupLocate(mnt, group, &blockNo, &grDescNo) == -1 ||
+       mfs_read(mnt, buffer, blockNo) == -1){
+        return -1;
+    }
+    memcpy(&grDesc, buffer + sizeof(group_linker) + grDescNo * sizeof(group_descriptor),
+           sizeof(group_descriptor));
+    if(mfs_read(mnt, bitmap, grDesc.inode_bitmap) == -1) return -1;
+    for(i = 0; i < mnt->sblock.inodes_per_group - keep; i++) mfs_setBit(bitmap, i);
+    grDesc.free_inodes = keep;
+    memcpy(buffer + sizeof(group_linker) + grDescNo * sizeof(group_descriptor), &grDesc,
+           sizeof(group_descriptor));
+    if(mfs_write(mnt, bitmap, grDesc.inode_bitmap) == -1 ||
+       mfs_write(mnt, buffer, blockNo) == -1){
+        return -1;
+    }
+
+    mfs_blockPut(buffer, mnt->sblock.block_size);
+    mfs_blockPut(bitmap, mnt->sblock.block_size);
+    return 0;
+}
+
+/* Fills every group up to the one holding inode 65535 and checks that the
+ * last numbers node_id can hold are handed out and nothing past them. */
+static int testLastInodes(char *blockSize){
+    int         err = 0;
+    __u32       last, groups, g, ino;
+    char        *argv[] = {"mfs_create", "-bs", blockSize, TEST_IMAGE};
+    inode       file;
+    mfs_mount   *mnt;
+
+    unlink(TEST_IMAGE);
+    if(mfs_create(argv, 4) == -1) return -1;
+    mnt = mfs_open(TEST_IMAGE, O_RDWR);
+    if(mnt == NULL) return -1;
+
+    last = 0xffff >> mnt->groupShift;
+    if(mfs_lock(mnt, MFS_LOCK_WRITE) == -1 || mfs_groupCount(mnt, &groups) == -1 ||
+       (groups <= last && mfs_growGroups(mnt, last + 1 - groups) == -1)){
+        err = -1;
+    }
+    for(g = 0; g <= last && !err; g++){
+        if(fillGroup(mnt, g, g == last ? 2 : 0) == -1) err = -1;
+    }
+    mfs_unlock(mnt);
+
+    if(!err && (mfs_creat(mnt, MFS_ROOT_INO, "a", &ino) == -1 || ino != 0xffff ||
+                mfs_stat(mnt, ino, &file) == -1 || file.node_id != 0xffff)){
+        fprintf(stderr, "bs %s: inode 65535 not allocated\n", blockSize);
+        err = -1;
+    }
+    if(!err && (mfs_creat(mnt, MFS_ROOT_INO, "b", &ino) != -1 || errno != ENOSPC ||
+                mfs_lookup(mnt, MFS_ROOT_INO, "b", &ino) != -1)){
+        fprintf(stderr, "bs %s: inode past 65535 allocated\n", blockSize);
+        err = -1;
+    }
+
+    mfs_close(mnt);
+    unlink(TEST_IMAGE);
+    return err;
+}
+
+/* Free inodes and blocks of group 0. */
+static int groupFree(mfs_mount *mnt, __u32 *inodes, __u32 *blocks){
+    char                *buffer;
+    group_descriptor    grDesc;
+
+    buffer = mfs_blockGet(mnt->sblock.block_size);
+    if(buffer == NULL || mfs_read(mnt, buffer, 1) == -1) return -1;
+    memcpy(&grDesc, buffer + sizeof(group_linker), sizeof(group_descriptor));
+    *inodes = grDesc.free_inodes;
+    *blocks = grDesc.free_blocks;
+    mfs_blockPut(buffer, mnt->sblock.block_size);
+    return 0;
+}
+
+/* Fills the root directory and checks that creating more entries in it gives
+ * their inodes and blocks back. */
+static int testFullDirectory(){
+    int         err = 0, i;
+    char        *argv[] = {"mfs_create", "-bs", "512", TEST_IMAGE}, name[32];
+    __u32       ino, inodes, blocks, inodesAfter, blocksAfter;
+    mfs_mount   *mnt;
+
+    unlink(TEST_IMAGE);
+    if(mfs_create(argv, 4) == -1) return -1;
+    mnt = mfs_open(TEST_IMAGE, O_RDWR);
+    if(mnt == NULL) return -1;
+
+    for(i = 0; ; i++){
+        sprintf(name, "f%d", i);
+        if(mfs_creat(mnt, MFS_ROOT_INO, name, &ino) == -1) break;
+    }
+    if(errno != ENOSPC || groupFree(mnt, &inodes, &blocks) == -1) err = -1;
+    for(i = 0; i < 10 && !err; i++){
+        sprintf(name, "x%d", i);
+        if(mfs_creat(mnt, MFS_ROOT_INO, name, &ino) != -1) err = -1;
+        sprintf(name, "y%d", i);
+        if(mfs_mkdir(mnt, MFS_ROOT_INO, name, &ino) != -1) err = -1;
+    }
+    if(!err && (groupFree(mnt, &inodesAfter, &blocksAfter) == -1 ||
+                inodesAfter != inodes || blocksAfter != blocks)){
+        fprintf(stderr, "full directory: free inodes %u -> %u, blocks %u -> %u\n",
+                inodes, inodesAfter, blocks, blocksAfter);
+        err = -1;
+    }
+
+    mfs_close(mnt);
+    unlink(TEST_IMAGE);
+    return err;
+}
+
+int main(){
+    if(testLastInodes("1024") == -1 || testLastInodes("4096") == -1 ||
+       testFullDirectory() == -1){
+        printf("inodes: FAIL\n");
+        return 1;
+    }
+    printf("inodes: ok\n");
+    return 0;
+}
@@ -0,0 +1,398 @@
+#define _LARGEFILE64_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "walk.h"
+#include "stats.h"
+
+typedef struct mfs_walkNode mfs_walkNode;
+
+struct mfs_walkNode{
+    char            *path;
+    char            *name;
+    inode           dir;
+    mfs_list        list;
+    mfs_walkNode    **children;
+    int             childSize;
+    int             childCount;
+    int             done;
+};
+
+/* The owner pushes and pops at the bottom, thieves take from the top, where
+ * the directories closest to the root and so the largest subtrees are. */
+typedef struct{
+    pthread_mutex_t lock;
+    mfs_walkNode    **items;
+    int             top;
+    int             bottom;
+    int             size;
+}mfs_walkDeque;
+
+typedef struct{
+    mfs_mount       *mnt;
+    int             flags;
+    int             threads;
+    mfs_walkDeque   *deques;
+    pthread_mutex_t lock;
+    pthread_cond_t  work;
+    pthread_cond_t  finished;
+    int             queued;
+    int             pending;
+    mfs_stats       counters;
+    mfs_histogram   latency[HIST_PRIMITIVES];
+}mfs_walker;
+
+typedef struct{
+    mfs_walker      *walker;
+    int             id;
+}mfs_walkWorker;
+
+static int mfs_walkPush(mfs_walkDeque *deque, mfs_walkNode *node){
+    mfs_walkNode    **items;
+
+    pthread_mutex_lock(&deque->lock);
+    if(deque->bottom == deque->size){
+        if(deque->top > 0){
+            memmove(deque->items, deque->items + deque->top,
+                    (deque->bottom - deque->top) * sizeof(mfs_walkNode *));
+            deque->bottom -= deque->top;
+            deque->top = 0;
+        }else{
+            items = realloc(deque->items, (deque->size ? 2 * deque->size : 64) *
+                            sizeof(mfs_walkNode *));
+            if(items == NULL){
+                pthread_mutex_unlock(&deque->lock);
+                perror("mfs_walk realloc");
+                return -1;
+            }
+            deque->items = items;
+            deque->size = deque->size ? 2 * deque->size : 64;
+        }
+    }
+    deque->items[deque->bottom++] = node;
+    pthread_mutex_unlock(&deque->lock);
+
+    return 0;
+}
+
+static mfs_walkNode* mfs_walkPop(mfs_walkDeque *deque, int steal){
+    mfs_walkNode    *node = NULL;
+
+    pthread_mutex_lock(&deque->lock);
+    if(deque->top < deque->bottom){
+        if(steal) node = deque->items[deque->top++];
+        else node = deque->items[--deque->bottom];
+        if(deque->top == deque->bottom){
+            deque->top = 0;
+            deque->bottom = 0;
+        }
+    }
+    pthread_mutex_unlock(&deque->lock);
+
+    return node;
+}
+
+static mfs_walkNode* mfs_walkTake(mfs_walker *walker, int id){
+    int             i;
+    mfs_walkNode    *node;
+
+    node = mfs_walkPop(&walker->deques[id], 0);
+    for(i = 1; node == NULL && i < walker->threads; i++){
+        node = mfs_walkPop(&walker->deques[(id + i) % walker->threads], 1);
+    }
+    if(node != NULL){
+        pthread_mutex_lock(&walker->lock);
+        walker->queued--;
+        pthread_mutex_unlock(&walker->lock);
+    }
+
+    return node;
+}
+
+static mfs_walkNode* mfs_walkNodeCreate(const char *parent, const char *name,
+                                        inode *dir){
+    size_t          length;
+    mfs_walkNode    *node;
+
+    node = calloc(1, sizeof(mfs_walkNode));
+    if(node == NULL){
+        perror("mfs_walk malloc");
+        return NULL;
+    }
+    length = strlen(parent);
+    node->path = malloc(length + (name != NULL ? strlen(name) : 0) + 2);
+    if(node->path == NULL){
+        perror("mfs_walk malloc");
+        free(node);
+        return NULL;
+    }
+    strcpy(node->path, parent);
+    if(name != NULL){
+        if(length == 0 || parent[length - 1] != '/') strcat(node->path, "/");
+        node->name = node->path + strlen(node->path);
+        strcat(node->path, name);
+    }
+    memcpy(&node->dir, dir, sizeof(inode));
+    mfs_listInit(&node->list);
+
+    return node;
+}
+
+static void mfs_walkFree(mfs_walkNode *node){
+    mfs_listDestroy(&node->list);
+    free(node->children);
+    free(node->path);
+    free(node);
+}
+
+/* Asks the kernel to start reading the blocks of a directory that will be
+ * listed soon, one request per contiguous run. */
+static void mfs_walkPrefetch(mfs_mount *mnt, inode *dir){
+    int     i, run;
+
+    /* Blocks of an overlay image are not offsets in its file. */
+    if(mnt->overlay != NULL) return;
+    for(i = 0; i < DATABLOCK_NUM && dir->datablocks[i] != 0; i += run){
+        for(run = 1; i + run < DATABLOCK_NUM && dir->datablocks[i + run] ==
+            dir->datablocks[i] + run; run++);
+        posix_fadvise(mnt->fd, (off_t) dir->datablocks[i] << mnt->blockShift,
+                      (off_t) run << mnt->blockShift, POSIX_FADV_WILLNEED);
+    }
+}
+
+/* Subdirectories are visited in the order their directory lists them. */
+static int mfs_walkByName(const void *a, const void *b){
+    return strcmp((*(mfs_walkNode **) a)->name, (*(mfs_walkNode **) b)->name);
+}
+
+static int mfs_walkByTime(const void *a, const void *b){
+    const mfs_walkNode  *x = *(mfs_walkNode **) a, *y = *(mfs_walkNode **) b;
+
+    if(x->dir.creation_time != y->dir.creation_time){
+        return x->dir.creation_time < y->dir.creation_time ? -1 : 1;
+    }
+    return strcmp(x->name, y->name);
+}
+
+static int mfs_walkChild(mfs_walker *walker, mfs_walkNode *node, inode *dir,
+                         char *name){
+    mfs_walkNode    **children;
+
+    if(node->childCount == node->childSize){
+        node->childSize = node->childSize ? 2 * node->childSize : 16;
+        children = realloc(node->children, node->childSize * sizeof(mfs_walkNode *));
+        if(children == NULL){
+            perror("mfs_walk realloc");
+            return -1;
+        }
+        node->children = children;
+    }
+    node->children[node->childCount] = mfs_walkNodeCreate(node->path, name, dir);
+    if(node->children[node->childCount] == NULL) return -1;
+    mfs_walkPrefetch(walker->mnt, dir);
+    node->childCount++;
+
+    return 0;
+}
+
+/* Reads node's directory with mfs_readdirPlus and fills in its sorted listing
+ * and the subdirectories to descend into. */
+static int mfs_walkRead(mfs_walker *walker, mfs_walkNode *node, char *buffer){
+    int             i, count, err = 0;
+    char            *name, last;
+    mfs_direntPlus  *entries;
+
+    count = mfs_readdirPlus(walker->mnt, &node->dir, buffer, walker->flags, &entries);
+    if(count == -1) return -1;
+
+    for(i = 0; i < count && !err; i++){
+        name = entries[i].name;
+        if(mfs_listAdd(&node->list, &entries[i].attr, name, entries[i].name_len) == -1){
+            err = -1;
+            break;
+        }
+        if(MFS_TYPE(entries[i].attr.mode) != 0 ||
+           (entries[i].name_len == 1 && name[0] == '.') ||
+           (entries[i].name_len == 2 && name[0] == '.' && name[1] == '.')){
+            continue;
+        }
+        last = name[entries[i].name_len];
+        name[entries[i].name_len] = '\0';
+        err = mfs_walkChild(walker, node, &entries[i].attr, name);
+        name[entries[i].name_len] = last;
+    }
+    free(entries);
+    if(err) return -1;
+
+    mfs_listSort(&node->list, walker->flags & MFS_WALK_CTIME);
+    qsort(node->children, node->childCount, sizeof(mfs_walkNode *),
+          walker->flags & MFS_WALK_CTIME ? mfs_walkByTime : mfs_walkByName);
+
+    return 0;
+}
+
+static void* mfs_walkWork(void *arg){
+    int             i, failed;
+    char            *buffer;
+    mfs_walkWorker  *worker = arg;
+    mfs_walker      *walker = worker->walker;
+    mfs_walkNode    *node;
+
+    buffer = malloc(DATABLOCK_NUM * walker->mnt->sblock.block_size);
+    while(1){
+        node = mfs_walkTake(walker, worker->id);
+        if(node == NULL){
+            pthread_mutex_lock(&walker->lock);
+            while(walker->queued == 0 && walker->pending > 0){
+                pthread_cond_wait(&walker->work, &walker->lock);
+            }
+            if(walker->pending == 0){
+                pthread_mutex_unlock(&walker->lock);
+                break;
+            }
+            pthread_mutex_unlock(&walker->lock);
+            continue;
+        }
+
+        if(buffer == NULL || mfs_walkRead(walker, node, buffer) == -1){
+            fprintf(stderr, "%s: could not be listed completely.\n", node->path);
+        }
+
+        /* Children go in last first so the owner continues with the first
+         * one, which is also the one the caller will visit next. */
+        pthread_mutex_lock(&walker->lock);
+        for(i = node->childCount - 1; i >= 0; i--){
+            if(mfs_walkPush(&walker->deques[worker->id], node->children[i]) == -1){
+                break;
+            }
+        }
+        /* Children 0 to i could not be queued and are dropped, the rest move
+         * to the front. */
+        failed = i + 1;
+        node->childCount -= failed;
+        for(; i >= 0; i--) mfs_walkFree(node->children[i]);
+        memmove(node->children, node->children + failed,
+                node->childCount * sizeof(mfs_walkNode *));
+        walker->queued += node->childCount;
+        walker->pending += node->childCount - 1;
+        node->done = 1;
+        pthread_cond_broadcast(&walker->finished);
+        if(node->childCount > 0 || walker->pending == 0){
+            pthread_cond_broadcast(&walker->work);
+        }
+        pthread_mutex_unlock(&walker->lock);
+    }
+
+    /* The counters are per thread, hand this worker's over to the caller. */
+    pthread_mutex_lock(&walker->lock);
+    mfs_statsAdd(&walker->counters, &mfs_counters);
+    for(i = 0; i < HIST_PRIMITIVES; i++){
+        mfs_histAdd(&walker->latency[i], &mfs_primitiveLatency[i]);
+    }
+    pthread_mutex_unlock(&walker->lock);
+
+    free(buffer);
+    mfs_blockDrain();
+    return NULL;
+}
+
+/* Hands node and then its subtree to visit, freeing each directory as soon as
+ * it has been visited. */
+static void mfs_walkDeliver(mfs_walker *walker, mfs_walkNode *node,
+                            mfs_walkVisit visit, void *arg){
+    int i;
+
+    pthread_mutex_lock(&walker->lock);
+    while(!node->done) pthread_cond_wait(&walker->finished, &walker->lock);
+    pthread_mutex_unlock(&walker->lock);
+
+    visit(node->path, &node->list, arg);
+    for(i = 0; i < node->childCount; i++){
+        mfs_walkDeliver(walker, node->children[i], visit, arg);
+    }
+    mfs_walkFree(node);
+}
+
+int mfs_walk(mfs_mount *mnt, inode *dir, const char *path, int threads, int flags,
+             mfs_walkVisit visit, void *arg){
+    int             i, started = 0;
+    pthread_t       *ids;
+    mfs_walker      walker;
+    mfs_walkWorker  *workers;
+    mfs_walkNode    *root;
+
+    if(threads <= 0) threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if(threads <= 0) threads = 1;
+    if(threads > MFS_WALK_MAX_THREADS) threads = MFS_WALK_MAX_THREADS;
+
+    root = mfs_walkNodeCreate(path, NULL, dir);
+    if(root == NULL) return -1;
+    ids = malloc(threads * sizeof(pthread_t));
+    workers = malloc(threads * sizeof(mfs_walkWorker));
+    walker.deques = calloc(threads, sizeof(mfs_walkDeque));
+    if(ids == NULL || workers == NULL || walker.deques == NULL){
+        perror("mfs_walk malloc");
+        free(ids);
+        free(workers);
+        free(walker.deques);
+        mfs_walkFree(root);
+        return -1;
+    }
+
+    walker.mnt = mnt;
+    walker.flags = flags;
+    walker.threads = threads;
+    walker.queued = 0;
+    walker.pending = 1;
+    memset(&walker.counters, 0, sizeof(mfs_stats));
+    memset(walker.latency, 0, sizeof(walker.latency));
+    pthread_mutex_init(&walker.lock, NULL);
+    pthread_cond_init(&walker.work, NULL);
+    pthread_cond_init(&walker.finished, NULL);
+    for(i = 0; i < threads; i++){
+        pthread_mutex_init(&walker.deques[i].lock, NULL);
+        walker.deques[i].size = 64;
+        walker.deques[i].items = malloc(64 * sizeof(mfs_walkNode *));
+        if(walker.deques[i].items == NULL) walker.deques[i].size = 0;
+    }
+    mfs_walkPrefetch(mnt, dir);
+    if(mfs_walkPush(&walker.deques[0], root) == -1){
+        mfs_walkFree(root);
+        root = NULL;
+    }else{
+        walker.queued = 1;
+        for(i = 0; i < threads; i++){
+            workers[i].walker = &walker;
+            workers[i].id = i;
+            if(pthread_create(&ids[started], NULL, mfs_walkWork, &workers[i])){
+                perror("mfs_walk pthread_create");
+                continue;
+            }
+            started++;
+        }
+    }
+
+    if(root != NULL && started > 0) mfs_walkDeliver(&walker, root, visit, arg);
+    else if(root != NULL) mfs_walkFree(root);
+    for(i = 0; i < started; i++) pthread_join(ids[i], NULL);
+    mfs_statsAdd(&mfs_counters, &walker.counters);
+    for(i = 0; i < HIST_PRIMITIVES; i++){
+        mfs_histAdd(&mfs_primitiveLatency[i], &walker.latency[i]);
+    }
+
+    for(i = 0; i < threads; i++){
+        pthread_mutex_destroy(&walker.deques[i].lock);
+        free(walker.deques[i].items);
+    }
+    pthread_mutex_destroy(&walker.lock);
+    pthread_cond_destroy(&walker.work);
+    pthread_cond_destroy(&walker.finished);
+    free(walker.deques);
+    free(workers);
+    free(ids);
+    return root != NULL && started > 0 ? 0 : -1;
+}
@@ -0,0 +1,25 @@
+#ifndef _WALK_H_
+#define _WALK_H_
+
+#include "filesystem.h"
+
+#define MFS_WALK_MAX_THREADS    64
+
+/* Flags for mfs_walk. */
+#define MFS_WALK_ALL            MFS_DIRENT_ALL
+#define MFS_WALK_DIRS           MFS_DIRENT_DIRS
+#define MFS_WALK_CTIME          0x4
+
+/* Called once per directory with its listing sorted by name, or by creation
+ * time with MFS_WALK_CTIME. Names starting with '.' are only passed with
+ * MFS_WALK_ALL, only directories are passed with MFS_WALK_DIRS. */
+typedef void (*mfs_walkVisit)(const char *path, mfs_list *list, void *arg);
+
+/* Walks the tree below dir. Directories are read by a pool of threads that
+ * steal work from each other, but visit is called from the calling thread in
+ * depth first order, so the output does not depend on the scheduling. threads
+ * of 0 uses one thread per online CPU. */
+int mfs_walk(mfs_mount *mnt, inode *dir, const char *path, int threads, int flags,
+             mfs_walkVisit visit, void *arg);
+
+#endif